@@ -3,5 +3,5 @@ PHP_ARG_ENABLE(uniauth,[Whether to enable the "uniauth" extension],
 
 if test $PHP_UNIAUTH != "no"; then
     PHP_SUBST(UNIAUTH_SHARED_LIBADD)
-    PHP_NEW_EXTENSION(uniauth,uniauth.c connect.c,$ext_shared)
+    PHP_NEW_EXTENSION(uniauth,uniauth.c connect.c shmcache.c digest.c ring.c embedded.c,$ext_shared)
 fi
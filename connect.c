@@ -6,17 +6,38 @@
  * Copyright (C) Roger P. Gee
  */
 
+/* For sendmmsg(). */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
 #include "connect.h"
+#include "embedded.h"
+#include "shmcache.h"
 #include "uniauth.h"
+#include <php_network.h>
 #include <stdlib.h>
+#include <limits.h>
+#include <ctype.h>
 #include <stdarg.h>
 #include <string.h>
 #include <errno.h>
+#include <endian.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <poll.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#ifdef ZTS
+#include <pthread.h>
+#endif
 
 void uniauth_storage_delete(struct uniauth_storage* stor)
 {
@@ -24,23 +45,237 @@ void uniauth_storage_delete(struct uniauth_storage* stor)
      * is not free'd here (since it may be allocated on the stack).
      */
 
-    efree(stor->key);
-    efree(stor->username);
-    efree(stor->displayName);
-    efree(stor->redirect);
-    efree(stor->tag);
+    uniauth_field_free(stor->key);
+    uniauth_user_field_free(stor->username);
+    uniauth_user_field_free(stor->displayName);
+    uniauth_field_free(stor->redirect);
+    uniauth_field_free(stor->tag);
+}
+
+/* Arenas: each string in an arena is preceded by its offset from the start of
+ * the block so that a field can find the arena that owns it.
+ */
+
+struct uniauth_arena
+{
+    uint32_t refcount; /* one per string plus one for the builder */
+    uint32_t size;     /* bytes of 'data' in use */
+    uint32_t cap;      /* bytes of 'data' allocated */
+    char data[];
+};
+
+#define ARENA_FIELD_SZ(n) (sizeof(uint32_t) + (n) + 1)
+
+static inline struct uniauth_arena* arena_of(const char* field)
+{
+    uint32_t offset;
+
+    memcpy(&offset,field - sizeof(uint32_t),sizeof(uint32_t));
+    return (struct uniauth_arena*)(field - offset);
+}
+
+struct uniauth_arena* uniauth_arena_new(size_t len,int count)
+{
+    struct uniauth_arena* arena;
+    size_t cap = len + (size_t)count * ARENA_FIELD_SZ(0);
+
+    arena = emalloc(sizeof(struct uniauth_arena) + cap);
+    arena->refcount = 1;
+    arena->size = 0;
+    arena->cap = (uint32_t)cap;
+    return arena;
+}
+
+char* uniauth_arena_field(struct uniauth_arena* arena,const char* src,size_t n)
+{
+    char* field;
+    uint32_t offset;
+
+    /* Strings that do not fit get an arena of their own. */
+    if (ARENA_FIELD_SZ(n) > arena->cap - arena->size) {
+        return uniauth_field_new(src,n);
+    }
+
+    field = arena->data + arena->size + sizeof(uint32_t);
+    offset = (uint32_t)(field - (char*)arena);
+    memcpy(field - sizeof(uint32_t),&offset,sizeof(uint32_t));
+    memcpy(field,src,n);
+    field[n] = 0;
+
+    arena->size += ARENA_FIELD_SZ(n);
+    arena->refcount += 1;
+    return field;
+}
+
+void uniauth_arena_release(struct uniauth_arena* arena)
+{
+    if (--arena->refcount == 0) {
+        efree(arena);
+    }
+}
+
+char* uniauth_field_new(const char* src,size_t n)
+{
+    char* field;
+    struct uniauth_arena* arena;
+
+    arena = uniauth_arena_new(n,1);
+    field = uniauth_arena_field(arena,src,n);
+    uniauth_arena_release(arena);
+    return field;
+}
+
+char* uniauth_field_copy(const char* field)
+{
+    if (field == NULL) {
+        return NULL;
+    }
+
+    arena_of(field)->refcount += 1;
+    return (char*)field;
+}
+
+void uniauth_field_free(char* field)
+{
+    if (field != NULL) {
+        uniauth_arena_release(arena_of(field));
+    }
+}
+
+char* uniauth_user_field_new(const char* src,size_t n)
+{
+    return ZSTR_VAL(zend_string_init(src,n,0));
+}
+
+char* uniauth_user_field_copy(const char* field)
+{
+    if (field == NULL) {
+        return NULL;
+    }
+
+    return ZSTR_VAL(zend_string_copy(UNIAUTH_USER_FIELD_STR(field)));
+}
+
+void uniauth_user_field_free(char* field)
+{
+    if (field != NULL) {
+        zend_string_release(UNIAUTH_USER_FIELD_STR(field));
+    }
 }
 
 ZEND_DECLARE_MODULE_GLOBALS(uniauth);
 
+/* Describes what the daemon at the other end of a connection speaks: the
+ * protocol version and the optional operations it supports, and whether the
+ * connection uses the packet transport or the ring transport (in which case
+ * messages go through 'ring' instead of the socket). 'timeout' is the kernel
+ * timeout (in milliseconds, 0 for none) set on the socket's blocking I/O.
+ */
+struct uniauth_peer
+{
+    int version;
+    int features;
+    bool packet;
+    struct uniauth_ring* ring;
+    int timeout;
+};
+
+/* Shards: uniauth.socket_path may list several daemons (separated by commas),
+ * each keeping its own part of the sessions. A session key always goes to the
+ * same daemon, picked by rendezvous hashing: every daemon gets a score for the
+ * key and the highest score wins. Adding a daemon only moves the keys it now
+ * wins (about 1/n of them), and the choice does not depend on the order of
+ * the list. A daemon is identified by its path without a transport prefix, so
+ * changing the transport moves no keys.
+ */
+
+struct uniauth_shard
+{
+    char* path;
+    uint64_t seed;           /* hash of the path without transport prefix */
+};
+
+static struct uniauth_shard* shards = NULL;
+static size_t shardCount = 0;
+
+/* The per-thread state of a shard: an idle connection to it (unless it is the
+ * one in the module globals), the reconnect backoff and whether its socket
+ * turned out not to be a packet socket even though one was configured.
+ */
+struct uniauth_shard_conn
+{
+    int fd;
+    struct uniauth_peer peer;
+    uint64_t retryAt;
+    bool packetFallback;
+};
+
+static uint64_t uniauth_clock_ms()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 static void php_uniauth_globals_ctor(zend_uniauth_globals* gbls)
 {
     gbls->conn = -1;
+    gbls->connVersion = UNIAUTH_PROTOCOL_V1;
+    gbls->connFeatures = 0;
+    gbls->connPacket = 0;
+    gbls->connRing = NULL;
+    gbls->connTimeout = 0;
+    gbls->connBusy = false;
+    gbls->prefetchKey = NULL;
+    gbls->prefetchKeySz = 0;
+    gbls->prefetchGeneration = 0;
+    gbls->spares = NULL;
+    gbls->spareCount = 0;
+    ZVAL_UNDEF(&gbls->waitHandler);
     gbls->useCookie = 0;
+    gbls->lifetime = 0;
+    gbls->socketPath = NULL;
+    gbls->reconnectBackoff = 0;
+    gbls->timeout = 0;
+    gbls->requestBudget = 0;
+    gbls->requestStart = 0;
+    gbls->protocol = UNIAUTH_PROTOCOL_V1;
+    gbls->protocolFallback = 0;
+    gbls->keyDigest = 0;
+    gbls->digestKey = NULL;
+    gbls->digestKeySz = 0;
+    gbls->prefetch = 0;
+    gbls->shmRing = 0;
+    gbls->connShard = 0;
+    gbls->shardConns = NULL;
+    gbls->records = NULL;
+    gbls->cacheHits = 0;
+    gbls->cacheMisses = 0;
+    gbls->shmHits = 0;
+    gbls->shmMisses = 0;
 }
 
 static void php_uniauth_globals_dtor(zend_uniauth_globals* gbls)
 {
+    size_t i;
+
+    if (gbls->shardConns != NULL) {
+        for (i = 0;i < shardCount;++i) {
+            struct uniauth_shard_conn* state = gbls->shardConns + i;
+
+            if (state->fd != -1) {
+                if (state->peer.ring != NULL) {
+                    uniauth_ring_detach(state->peer.ring);
+                }
+                close(state->fd);
+            }
+        }
+        pefree(gbls->shardConns,1);
+    }
+    if (gbls->connRing != NULL) {
+        uniauth_ring_detach(gbls->connRing);
+    }
     if (gbls->conn != -1) {
         close(gbls->conn);
     }
@@ -61,6 +296,37 @@ void uniauth_globals_init()
 void uniauth_globals_request_init()
 {
     UNIAUTH_G(useCookie) = 0;
+    UNIAUTH_G(requestStart) = uniauth_clock_ms();
+    UNIAUTH_G(cacheHits) = 0;
+    UNIAUTH_G(cacheMisses) = 0;
+    UNIAUTH_G(shmHits) = 0;
+    UNIAUTH_G(shmMisses) = 0;
+}
+
+static void uniauth_conn_request_shutdown();
+
+void uniauth_globals_request_shutdown()
+{
+    uniauth_conn_request_shutdown();
+
+    if (!Z_ISUNDEF(UNIAUTH_G(waitHandler))) {
+        zval_ptr_dtor(&UNIAUTH_G(waitHandler));
+        ZVAL_UNDEF(&UNIAUTH_G(waitHandler));
+    }
+
+    if (UNIAUTH_G(digestKey) != NULL) {
+        efree(UNIAUTH_G(digestKey));
+        UNIAUTH_G(digestKey) = NULL;
+    }
+
+    /* The record cache uses per-request memory, so it must not outlive the
+     * request.
+     */
+    if (UNIAUTH_G(records) != NULL) {
+        zend_hash_destroy(UNIAUTH_G(records));
+        FREE_HASHTABLE(UNIAUTH_G(records));
+        UNIAUTH_G(records) = NULL;
+    }
 }
 
 void uniauth_globals_shutdown()
@@ -70,542 +336,4113 @@ void uniauth_globals_shutdown()
 #endif
 }
 
-/* NOTE: the following functions implement the uniauth connect api used by this
- * module's PHP functions. If an error occurs, we use php_error() to raise the
- * error, which bails out of the current script.
+/* Request record cache: a page typically looks up the same session several
+ * times (e.g. uniauth_cookie() followed by uniauth()). We keep a copy of every
+ * decoded record (or the fact that no record exists) for the duration of the
+ * request so that only the first lookup goes to the daemon. Callers always
+ * receive their own copy since they are free to modify and delete it. A record
+ * from a projected lookup only serves lookups for the fields it has.
  */
 
-/* Helper functions */
-
-static int uniauth_connect()
+struct uniauth_cache_entry
 {
-    int sock;
-    struct sockaddr_un addr;
-    socklen_t len;
-    int* psock = &UNIAUTH_G(conn);
-    struct pollfd pollInfo;
+    bool found;                  /* false if the daemon had no record */
+    uint32_t fields;             /* UNIAUTH_FIELD_BIT mask of fields known */
+    struct uniauth_storage stor; /* decoded record; key is always set */
+};
 
-    /* See if we already have a connection. */
-    sock = *psock;
-    if (sock != -1) {
-        /* Make sure the socket is still alive. If an event happens on the
-         * socket then either the descriptor is invalid, an error occurred or a
-         * hang up occurred on the connection.
-         */
-        pollInfo.fd = sock;
-        pollInfo.events = 0;
-        pollInfo.revents = 0;
-        if (poll(&pollInfo,1,0) > 0) {
-            php_error(E_WARNING,"connection to uniauth daemon lost: attempting reconnect");
-            close(sock);
-        }
-        else {
-            return sock;
-        }
-    }
+static void uniauth_storage_copy(struct uniauth_storage* dst,
+    const struct uniauth_storage* src)
+{
+    *dst = *src;
+    dst->key = uniauth_field_copy(src->key);
+    dst->username = uniauth_user_field_copy(src->username);
+    dst->displayName = uniauth_user_field_copy(src->displayName);
+    dst->redirect = uniauth_field_copy(src->redirect);
+    dst->tag = uniauth_field_copy(src->tag);
+    dst->dirty = 0;
+}
 
-    /* Since we do not have a connection, attempt a connect to the uniauth
-     * daemon.
+static inline bool uniauth_storage_applies(const struct uniauth_storage* stor,
+    int field,bool set)
+{
+    /* Determine whether a write of the record changes the field: a delta
+     * changes its dirty fields, otherwise every field that is set.
      */
-    sock = socket(AF_UNIX,SOCK_STREAM,0);
-    if (sock == -1) {
-        php_error(E_ERROR,"fail socket(): %s",strerror(errno));
-        return -1;
+    if (stor->dirty != 0) {
+        return (stor->dirty & UNIAUTH_DIRTY(field)) != 0;
     }
+    return set;
+}
 
-    /* Do connect. */
-    memset(&addr,0,sizeof(struct sockaddr_un));
-    addr.sun_family = AF_UNIX;
-    strncpy(addr.sun_path,SOCKET_PATH,sizeof(SOCKET_PATH)-1);
-    if (addr.sun_path[0] == '@') {
-        addr.sun_path[0] = 0;
-        len = offsetof(struct sockaddr_un,sun_path) + sizeof(SOCKET_PATH) - 1;
-    }
-    else {
-        len = sizeof(struct sockaddr_un);
-    }
-    if (connect(sock,(struct sockaddr*)&addr,len) == -1) {
-        php_error(E_ERROR,"could not connect to uniauth daemon: %s",strerror(errno));
-        return -1;
-    }
+static void uniauth_storage_merge_string(char** dst,size_t* dstsz,
+    const char* src,size_t srcsz)
+{
+    uniauth_field_free(*dst);
+    *dst = uniauth_field_copy(src);
+    *dstsz = srcsz;
+}
 
-    /* Assign socket to globals so we can look it back up later. */
-    *psock = sock;
-    return sock;
+static void uniauth_storage_merge_user(char** dst,size_t* dstsz,
+    const char* src,size_t srcsz)
+{
+    uniauth_user_field_free(*dst);
+    *dst = uniauth_user_field_copy(src);
+    *dstsz = srcsz;
 }
 
-static int uniauth_connect_recv(int sock,char* buffer,size_t maxsz,size_t* iter)
+static void uniauth_storage_merge(struct uniauth_storage* dst,
+    const struct uniauth_storage* src)
 {
-    /* This function does a blocking read on the connect socket. When it gets
-     * data back, it determines the state of the input buffer:
-     *  0=complete
-     *  1=incomplete
-     *  2=error
+    /* Apply the fields that a commit would send to the daemon (see
+     * request_storage_record()) onto an existing record.
      */
 
-    size_t i = 0;
-    size_t it = *iter;
-    ssize_t r = read(sock,buffer+it,maxsz-it);
-
-    if (r == -1) {
-        php_error(E_ERROR,"could not read from uniauth daemon: %s",strerror(errno));
-        return 2; /* control would have jumped out of here */
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_ID,src->id != 0)) {
+        dst->id = src->id;
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_USER,src->username != NULL)) {
+        uniauth_storage_merge_user(&dst->username,&dst->usernameSz,
+            src->username,src->usernameSz);
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_DISPLAY,src->displayName != NULL)) {
+        uniauth_storage_merge_user(&dst->displayName,&dst->displayNameSz,
+            src->displayName,src->displayNameSz);
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_EXPIRE,src->expire != 0)) {
+        dst->expire = src->expire;
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_REDIRECT,src->redirect != NULL)) {
+        uniauth_storage_merge_string(&dst->redirect,&dst->redirectSz,
+            src->redirect,src->redirectSz);
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_TAG,src->tag != NULL)) {
+        uniauth_storage_merge_string(&dst->tag,&dst->tagSz,src->tag,src->tagSz);
+    }
+    if (uniauth_storage_applies(src,UNIAUTH_PROTO_FIELD_LIFETIME,src->lifetime != 0)) {
+        dst->lifetime = src->lifetime;
     }
-    it += r;
-    *iter += r;
 
-    /* Walk through the input buffer to determine if it is complete. We do some
-     * quick checks to make sure the data is formatted correctly.
-     */
+    /* The write gave the record a revision we do not know. */
+    dst->revision = 0;
+}
 
-    if (buffer[i] == UNIAUTH_PROTO_RESPONSE_MESSAGE
-        || buffer[i] == UNIAUTH_PROTO_RESPONSE_ERROR)
-    {
-        /* Seek past null-terminated string. */
+static void uniauth_cache_entry_dtor(zval* zv)
+{
+    struct uniauth_cache_entry* entry = Z_PTR_P(zv);
 
-        i += 1;
-        while (i < it) {
-           if (buffer[i] == 0) {
-               break;
-           }
-           i += 1;
-        }
+    uniauth_storage_delete(&entry->stor);
+    efree(entry);
+}
+
+static inline struct uniauth_cache_entry* uniauth_cache_find(const char* key,
+    size_t keylen)
+{
+    HashTable* records = UNIAUTH_G(records);
 
-        return (i >= it);
+    if (records == NULL) {
+        return NULL;
     }
+    return zend_hash_str_find_ptr(records,key,keylen);
+}
 
-    if (buffer[i] == UNIAUTH_PROTO_RESPONSE_RECORD) {
-        i += 1;
-        while (i < it) {
-            /* We have a complete message if we find the end field. */
-            if (buffer[i] == UNIAUTH_PROTO_FIELD_END) {
-                return 0;
-            }
+static void uniauth_cache_store(const char* key,size_t keylen,
+    const struct uniauth_storage* stor,uint32_t fields)
+{
+    struct uniauth_cache_entry* entry;
+    HashTable* records = UNIAUTH_G(records);
 
-            /* Scan through the field. */
-            switch (buffer[i++]) {
-            case UNIAUTH_PROTO_FIELD_KEY:
-            case UNIAUTH_PROTO_FIELD_USER:
-            case UNIAUTH_PROTO_FIELD_DISPLAY:
-            case UNIAUTH_PROTO_FIELD_REDIRECT:
-            case UNIAUTH_PROTO_FIELD_TAG:
-                /* Seek past null-terminated string. */
-                while (true) {
-                    if (i >= it) {
-                        return 1;
-                    }
-                    if (buffer[i] == 0) {
-                        break;
-                    }
-                    i += 1;
-                }
+    if (records == NULL) {
+        ALLOC_HASHTABLE(records);
+        zend_hash_init(records,8,NULL,uniauth_cache_entry_dtor,0);
+        UNIAUTH_G(records) = records;
+    }
 
-                /* Seek past null terminator byte. */
-                i += 1;
-                break;
-            case UNIAUTH_PROTO_FIELD_ID:
-            case UNIAUTH_PROTO_FIELD_LIFETIME:
-                i += 4;
-                break;
-            case UNIAUTH_PROTO_FIELD_EXPIRE:
-                i += 8;
-                break;
-            default:
-                return 2;
-            }
-        }
+    entry = emalloc(sizeof(struct uniauth_cache_entry));
+    entry->fields = fields;
+    if (stor != NULL) {
+        entry->found = true;
+        uniauth_storage_copy(&entry->stor,stor);
+    }
+    else {
+        entry->found = false;
+        memset(&entry->stor,0,sizeof(struct uniauth_storage));
+    }
 
-        return 1;
+    /* The daemon is not required to echo the key back, but the cache always
+     * knows it.
+     */
+    if (entry->stor.key == NULL) {
+        entry->stor.key = uniauth_field_new(key,keylen);
+        entry->stor.keySz = keylen;
     }
 
-    return 2;
+    zend_hash_str_update_ptr(records,key,keylen,entry);
 }
 
-static bool buffer_field_string(char* buffer,size_t maxsz,size_t* iter,
-    int fieldType,const char* field,size_t fieldsz)
+static inline void uniauth_cache_invalidate(const char* key,size_t keylen)
 {
-    size_t it = *iter;
-    if (it + fieldsz + 2 <= maxsz) {
-        buffer[it++] = fieldType;
-        strncpy(buffer+it,field,fieldsz);
-        it += fieldsz;
-        buffer[it++] = 0;
-        *iter = it;
-        return true;
+    if (UNIAUTH_G(records) != NULL) {
+        zend_hash_str_del(UNIAUTH_G(records),key,keylen);
     }
-    return false;
 }
 
-static bool buffer_field_integer(char* buffer,size_t maxsz,size_t* iter,
-    int fieldType,int32_t value)
+static int uniauth_cache_evict_alias(zval* zv,void* arg)
 {
-    int i;
-    size_t it = *iter;
-    if (it + 6 <= maxsz) {
-        buffer[it++] = fieldType;
+    struct uniauth_cache_entry* entry = Z_PTR_P(zv);
+    const struct uniauth_storage* stor = arg;
 
-        /* Write the value using little endian. */
-        for (i = 0;i < UNIAUTH_INT_SZ;++i) {
-            buffer[it++] = (value >> (i*8)) & 0xff;
-        }
-        *iter = it;
-        return true;
+    /* Several session keys may reference the same registration on the daemon,
+     * so a write to one key may change what another key looks up. We cannot
+     * tell which keys are aliases, so any other existing record is dropped.
+     */
+    if (entry->found && (entry->stor.keySz != stor->keySz
+            || memcmp(entry->stor.key,stor->key,stor->keySz) != 0))
+    {
+        return ZEND_HASH_APPLY_REMOVE;
     }
-    return false;
+
+    return ZEND_HASH_APPLY_KEEP;
 }
 
-static bool buffer_field_time(char* buffer,size_t maxsz,size_t* iter,
-    int fieldType,int64_t value)
+static void uniauth_cache_commit(const struct uniauth_storage* stor,bool create)
 {
-    int i;
-    size_t it = *iter;
-    if (it + 10 <= maxsz) {
-        buffer[it++] = fieldType;
+    struct uniauth_cache_entry* entry;
 
-        /* Write the value using little endian. */
-        for (i = 0;i < UNIAUTH_TIME_SZ;++i) {
-            buffer[it++] = (value >> (i*8)) & 0xff;
-        }
-        *iter = it;
-        return true;
+    if (UNIAUTH_G(records) == NULL || stor->key == NULL) {
+        return;
     }
-    return false;
-}
 
-static inline bool buffer_field_end(char* buffer,size_t maxsz,size_t* iter)
-{
-    size_t i = *iter;
-    if (i < maxsz) {
-        buffer[i] = UNIAUTH_PROTO_FIELD_END;
-        *iter = i + 1;
-        return true;
+    if (!create) {
+        zend_hash_apply_with_argument(UNIAUTH_G(records),
+            uniauth_cache_evict_alias,(void*)stor);
     }
-    return false;
-}
 
-static bool buffer_storage_record(char* buffer,size_t maxsz,size_t* iter,
-    const struct uniauth_storage* stor)
-{
-    /* Write the uniauth structure fields into the buffer. All fields are
-     * optional (except maybe key).
+    /* The daemon does not tell us the revision a write gave the record, so
+     * lookups that need it (e.g. for a later CAS) must not be served from the
+     * cache.
      */
+    entry = uniauth_cache_find(stor->key,stor->keySz);
+    if (entry != NULL && entry->found) {
+        uniauth_storage_merge(&entry->stor,stor);
+        entry->fields &= ~UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REVISION);
+    }
+    else if (create) {
+        uniauth_cache_store(stor->key,stor->keySz,stor,
+            UNIAUTH_FIELDS_RECORD & ~UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REVISION));
+    }
+    else {
+        uniauth_cache_invalidate(stor->key,stor->keySz);
+    }
+}
 
-    return ! ((stor->key != NULL && !buffer_field_string(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_KEY,stor->key,stor->keySz))
-        || (stor->id != 0 && !buffer_field_integer(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_ID,stor->id))
-        || (stor->username != NULL && !buffer_field_string(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_USER,stor->username,stor->usernameSz))
-        || (stor->displayName != NULL && !buffer_field_string(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_DISPLAY,stor->displayName,stor->displayNameSz))
-        || (stor->expire != 0 && !buffer_field_time(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_EXPIRE,stor->expire))
-        || (stor->redirect != NULL && !buffer_field_string(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_REDIRECT,stor->redirect,stor->redirectSz))
-        || (stor->tag != NULL && !buffer_field_string(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_TAG,stor->tag,stor->tagSz))
-        || (stor->lifetime != 0 && !buffer_field_integer(buffer,maxsz,iter,
-                UNIAUTH_PROTO_FIELD_LIFETIME,stor->lifetime))
-        || !buffer_field_end(buffer,maxsz,iter));
- }
-
- static size_t read_field_string(char* buffer,size_t sz,char** dst,size_t* dstsz)
- {
-     size_t n = 0;
-     char* result;
+/* Keep the shared cache coherent with writes made by this host. This must be
+ * done after the daemon has applied the write so that a lookup racing with it
+ * cannot repopulate the cache with the old record.
+ */
+static void uniauth_shared_invalidate(const struct uniauth_storage* stor)
+{
+    struct uniauth_cache_entry* entry;
 
-     while (n < sz && buffer[n] != 0) {
-         n += 1;
-     }
+    if (!uniauth_shmcache_active() || stor->key == NULL) {
+        return;
+    }
 
-     if (n >= sz) {
-         return 0;
-     }
+    uniauth_shmcache_invalidate(stor->key,stor->keySz);
 
-     result = emalloc(n+1);
-     memcpy(result,buffer,n);
-     result[n] = 0;
+    /* Writes that change the login state also change what every other key
+     * sharing the registration looks up. We identify those by user name, both
+     * the one on record (if we looked it up) and the one being written.
+     */
+    if (uniauth_storage_applies(stor,UNIAUTH_PROTO_FIELD_ID,stor->id != 0)
+        || uniauth_storage_applies(stor,UNIAUTH_PROTO_FIELD_USER,stor->username != NULL))
+    {
+        entry = uniauth_cache_find(stor->key,stor->keySz);
+        if (entry != NULL && entry->found && entry->stor.username != NULL) {
+            uniauth_shmcache_invalidate_user(entry->stor.username,
+                entry->stor.usernameSz);
+            if (stor->username != NULL && stor->usernameSz == entry->stor.usernameSz
+                && memcmp(stor->username,entry->stor.username,stor->usernameSz) == 0)
+            {
+                return;
+            }
+        }
+        if (stor->username != NULL) {
+            uniauth_shmcache_invalidate_user(stor->username,stor->usernameSz);
+        }
+    }
+}
 
-     *dst = result;
-     *dstsz = n;
-     return n+1;
- }
+/* NOTE: the following functions implement the uniauth connect api used by this
+ * module's PHP functions. If an error occurs, we use php_error() to raise the
+ * error, which bails out of the current script.
+ */
 
- static size_t read_field_integer(unsigned char* buffer,size_t sz,int32_t* dst)
- {
-     int i;
-     uint32_t value = 0;
+/* Helper functions */
 
-     if (sz < UNIAUTH_INT_SZ) {
-         return 0;
-     }
+/* The I/O routines return this (without raising an error) when the daemon
+ * closed or reset the connection before any part of the current exchange went
+ * through, which typically means the daemon was restarted while the connection
+ * sat idle. The caller may reconnect and try again.
+ */
+#define UNIAUTH_CONN_LOST -2
 
-     for (i = 0;i < UNIAUTH_INT_SZ;++i) {
-         value |= ((uint32_t)buffer[i] << (i*8));
-     }
+/* Returned by uniauth_transact() for a request the daemon does not support. */
+#define UNIAUTH_UNSUPPORTED -3
 
-     *dst = value;
-     return UNIAUTH_INT_SZ;
- }
+/* Returned when a request cannot go over a shared connection (see
+ * uniauth_share_transact()).
+ */
+#define UNIAUTH_SHARE_FALLBACK -4
 
- static size_t read_field_time(unsigned char* buffer,size_t sz,int64_t* dst)
- {
-     int i;
-     uint64_t value = 0;
+static inline bool uniauth_conn_lost_errno(int err)
+{
+    return err == EPIPE || err == ECONNRESET || err == ENOTCONN;
+}
 
-     if (sz < UNIAUTH_TIME_SZ) {
-         return 0;
-     }
+/* A socket path with this prefix selects the packet transport (see
+ * UNIAUTH_MAX_PACKET).
+ */
+#define UNIAUTH_SEQPACKET_PREFIX "seqpacket:"
 
-     for (i = 0;i < UNIAUTH_INT_SZ;++i) {
-         value |= ((uint64_t)buffer[i] << (i*8));
-     }
+/* A socket path of the form "tcp://host:port" names a daemon on another node
+ * (the host may be a name, an IPv4 address or an IPv6 address in brackets).
+ * Idle connections are probed with keepalives so that a peer that vanished
+ * without closing the connection is noticed; the values are in seconds.
+ */
+#define UNIAUTH_TCP_PREFIX "tcp://"
+#define UNIAUTH_TCP_KEEPIDLE 30
+#define UNIAUTH_TCP_KEEPINTVL 10
+#define UNIAUTH_TCP_KEEPCNT 3
 
-     *dst = value;
-     return UNIAUTH_TIME_SZ;
- }
+static inline uint64_t uniauth_hash64(const char* data,size_t n,uint64_t h)
+{
+    /* FNV-1a followed by a finalizer so that the scores of similar keys are
+     * unrelated.
+     */
+    size_t i;
 
- static void read_storage_record(char* buffer,size_t sz,struct uniauth_storage* stor)
- {
-     /* Assume the message is a RESPONSE_RECORD and begin reading its fields
-      * (which start at offset=1).
-      */
-
-     size_t iter = 1;
-
-     while (iter < sz) {
-         size_t n = 0;
-         char* p;
-         size_t z;
-
-         if (buffer[iter] == UNIAUTH_PROTO_FIELD_END) {
-             break;
-         }
-
-         /* Calculate address and length of next field in buffer. */
-         p = buffer + iter + 1;
-         z = sz - iter - 1;
-
-         /* Read field. */
-         switch (buffer[iter++]) {
-         case UNIAUTH_PROTO_FIELD_KEY:
-             n = read_field_string(p,z,&stor->key,&stor->keySz);
-             break;
-         case UNIAUTH_PROTO_FIELD_ID:
-             n = read_field_integer((unsigned char*)p,z,&stor->id);
-             break;
-         case UNIAUTH_PROTO_FIELD_USER:
-             n = read_field_string(p,z,&stor->username,&stor->usernameSz);
-             break;
-         case UNIAUTH_PROTO_FIELD_DISPLAY:
-             n = read_field_string(p,z,&stor->displayName,&stor->displayNameSz);
-             break;
-         case UNIAUTH_PROTO_FIELD_EXPIRE:
-             n = read_field_time((unsigned char*)p,z,&stor->expire);
-             break;
-         case UNIAUTH_PROTO_FIELD_REDIRECT:
-             n = read_field_string(p,z,&stor->redirect,&stor->redirectSz);
-             break;
-         case UNIAUTH_PROTO_FIELD_TAG:
-             n = read_field_string(p,z,&stor->tag,&stor->tagSz);
-             break;
-         case UNIAUTH_PROTO_FIELD_LIFETIME:
-             n = read_field_integer((unsigned char*)p,z,&stor->lifetime);
-             break;
-         }
-
-         /* Handle protocol errors. */
-         if (n == 0) {
-             php_error(E_ERROR,"read_storage_record(): communication error: server"
-                 " did not respond properly");
-             break;
-         }
-
-         iter += n;
-     }
- }
+    for (i = 0;i < n;++i) {
+        h = (h ^ (unsigned char)data[i]) * 0x100000001b3ULL;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
 
- /* Connect API implementations */
+#define UNIAUTH_HASH_BASIS 0xcbf29ce484222325ULL
 
- struct uniauth_storage* uniauth_connect_lookup(const char* key,size_t keylen,
-     struct uniauth_storage* backing)
- {
-     int sock;
-     int status;
-     char buffer[UNIAUTH_MAX_MESSAGE];
-     size_t iter = 1;
-     size_t sz = 0;
-
-     /* Perform a lookup on the remote uniauth daemon. */
-     buffer[0] = UNIAUTH_PROTO_LOOKUP;
-     if (!buffer_field_string(buffer,sizeof(buffer),&iter,
-             UNIAUTH_PROTO_FIELD_KEY,key,keylen)
-         || !buffer_field_end(buffer,sizeof(buffer),&iter))
-     {
-         php_error(E_ERROR,"protocol message is too large");
-         return NULL;
-     }
-     sock = uniauth_connect();
-     if (write(sock,buffer,iter) == -1) {
-         php_error(E_ERROR,"fail write(): %s",strerror(errno));
-         return NULL;
-     }
+int uniauth_connect_shards_init(const char* paths)
+{
+    const char* iter = paths;
 
-     /* Wait for and read the response. Hopefully this loop should never
-      * reiterate.
-      */
-     do {
-         status = uniauth_connect_recv(sock,buffer,sizeof(buffer),&sz);
-
-         if (status == 2) {
-             php_error(E_ERROR,"protocol error: server message incorrectly formatted");
-             return NULL;
-         }
-     } while (status != 0);
-
-     /* An error response always means the record was not found. */
-     if (buffer[0] == UNIAUTH_PROTO_RESPONSE_MESSAGE
-         || buffer[0] == UNIAUTH_PROTO_RESPONSE_ERROR)
-     {
-         return NULL;
-     }
+    while (true) {
+        const char* end = strchr(iter,',');
+        const char* path = iter;
+        size_t n = (end != NULL) ? (size_t)(end - iter) : strlen(iter);
 
-     /* If we get here then response kind must be RESPONSE_RECORD. We'll now copy
-      * the available fields into the uniauth_storage buffer provided and return
-      * a pointer to it that indicates success.
-      */
-     memset(backing,0,sizeof(struct uniauth_storage));
-     read_storage_record(buffer,sz,backing);
-     return backing;
- }
+        /* Ignore whitespace around each path. */
+        while (n > 0 && isspace((unsigned char)*path)) {
+            path += 1;
+            n -= 1;
+        }
+        while (n > 0 && isspace((unsigned char)path[n-1])) {
+            n -= 1;
+        }
 
- int uniauth_connect_commit(struct uniauth_storage* stor)
- {
-     int sock;
-     int status;
-     char buffer[UNIAUTH_MAX_MESSAGE];
-     size_t iter = 1;
-     size_t sz = 0;
-
-     /* Prepare the commit message buffer to send to the uniauth daemon. */
-     buffer[0] = UNIAUTH_PROTO_COMMIT;
-     if (!buffer_storage_record(buffer,sizeof(buffer),&iter,stor)) {
-         php_error(E_ERROR,"protocol message is too large");
-         return -1;
-     }
+        if (n > 0) {
+            struct uniauth_shard* shard;
+            const char* id = path;
+            size_t idlen = n;
 
-    /* Send the request message to the uniauth daemon. */
-    sock = uniauth_connect();
-    if (write(sock,buffer,iter) == -1) {
-        php_error(E_ERROR,"fail write(): %s",strerror(errno));
-    }
+            if (idlen >= sizeof(UNIAUTH_SEQPACKET_PREFIX)-1
+                && strncmp(id,UNIAUTH_SEQPACKET_PREFIX,sizeof(UNIAUTH_SEQPACKET_PREFIX)-1) == 0)
+            {
+                id += sizeof(UNIAUTH_SEQPACKET_PREFIX)-1;
+                idlen -= sizeof(UNIAUTH_SEQPACKET_PREFIX)-1;
+            }
 
-    /* Wait for and read the response. Hopefully this loop should never
-     * reiterate.
-     */
-    do {
-        status = uniauth_connect_recv(sock,buffer,sizeof(buffer),&sz);
+            shards = perealloc(shards,(shardCount+1) * sizeof(struct uniauth_shard),1);
+            shard = shards + shardCount++;
+            shard->path = pestrndup(path,n,1);
+            shard->seed = uniauth_hash64(id,idlen,UNIAUTH_HASH_BASIS);
+        }
 
-        if (status == 2) {
-            php_error(E_ERROR,"protocol error: server message incorrectly formatted");
-            return -1;
+        if (end == NULL) {
+            break;
         }
-    } while (status != 0);
+        iter = end + 1;
+    }
 
-    /* We should get pack RESPONSE_MESSAGE upon success. */
-    if (buffer[0] == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+    if (shardCount == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+void uniauth_connect_shards_shutdown()
+{
+    size_t i;
+
+    for (i = 0;i < shardCount;++i) {
+        pefree(shards[i].path,1);
+    }
+    if (shards != NULL) {
+        pefree(shards,1);
+        shards = NULL;
+    }
+    shardCount = 0;
+}
+
+size_t uniauth_connect_shard_count()
+{
+    return shardCount;
+}
+
+static size_t uniauth_shard_of(const char* key,size_t keylen)
+{
+    size_t i;
+    size_t best = 0;
+    uint64_t h;
+    uint64_t top = 0;
+
+    if (shardCount <= 1 || key == NULL) {
+        return 0;
+    }
+
+    h = uniauth_hash64(key,keylen,UNIAUTH_HASH_BASIS);
+    for (i = 0;i < shardCount;++i) {
+        uint64_t score = uniauth_hash64((const char*)&shards[i].seed,
+            sizeof(uint64_t),h);
+
+        if (i == 0 || score > top) {
+            top = score;
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+bool uniauth_connect_same_shard(const char* a,size_t alen,const char* b,
+    size_t blen)
+{
+    return uniauth_shard_of(a,alen) == uniauth_shard_of(b,blen);
+}
+
+static struct uniauth_shard_conn* uniauth_shard_conn(size_t shard)
+{
+    /* The state lives as long as the thread, like the persistent connection. */
+    if (UNIAUTH_G(shardConns) == NULL) {
+        size_t i;
+
+        UNIAUTH_G(shardConns) = pecalloc(shardCount,sizeof(struct uniauth_shard_conn),1);
+        for (i = 0;i < shardCount;++i) {
+            UNIAUTH_G(shardConns)[i].fd = -1;
+        }
+    }
+
+    return UNIAUTH_G(shardConns) + shard;
+}
+
+static inline bool uniauth_shard_remote(size_t shard)
+{
+    return strncmp(shards[shard].path,UNIAUTH_TCP_PREFIX,sizeof(UNIAUTH_TCP_PREFIX)-1) == 0;
+}
+
+static int uniauth_connect_wait(int sock)
+{
+    /* Wait for a non-blocking connect to complete. The wait is bounded by
+     * uniauth.timeout_ms since the kernel would otherwise keep retrying an
+     * unreachable host for minutes.
+     */
+
+    int r;
+    int err;
+    socklen_t len = sizeof(int);
+    struct pollfd pollInfo;
+    int timeout = UNIAUTH_G(timeout) > 0 ? (int)UNIAUTH_G(timeout) : -1;
+
+    pollInfo.fd = sock;
+    pollInfo.events = POLLOUT;
+    pollInfo.revents = 0;
+    do {
+        r = poll(&pollInfo,1,timeout);
+    } while (r == -1 && errno == EINTR);
+    if (r == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+    }
+    if (r == -1) {
+        return -1;
+    }
+
+    if (getsockopt(sock,SOL_SOCKET,SO_ERROR,&err,&len) == -1) {
+        return -1;
+    }
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+static int uniauth_connect_tcp(const char* endpoint)
+{
+    /* Connect to "host:port", trying each address the host resolves to in
+     * turn. On failure, errno is left for the caller to report.
+     */
+
+    int r;
+    int sock = -1;
+    int err = EINVAL;
+    int on = 1;
+    char host[NI_MAXHOST];
+    const char* port;
+    size_t hostsz;
+    struct addrinfo hints;
+    struct addrinfo* res;
+    struct addrinfo* ai;
+
+    if (*endpoint == '[') {
+        const char* end = strchr(endpoint,']');
+
+        if (end == NULL || end[1] != ':') {
+            errno = EINVAL;
+            return -1;
+        }
+        hostsz = end - endpoint - 1;
+        endpoint += 1;
+        port = end + 2;
+    }
+    else {
+        port = strrchr(endpoint,':');
+        if (port == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        hostsz = port - endpoint;
+        port += 1;
+    }
+    if (hostsz == 0 || hostsz >= sizeof(host) || *port == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    memcpy(host,endpoint,hostsz);
+    host[hostsz] = 0;
+
+    memset(&hints,0,sizeof(struct addrinfo));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_NUMERICSERV | AI_ADDRCONFIG;
+    r = getaddrinfo(host,port,&hints,&res);
+    if (r != 0) {
+        if (r != EAI_SYSTEM) {
+            errno = EHOSTUNREACH;
+        }
+        return -1;
+    }
+
+    /* As with the UNIX socket, connect without blocking; here the connect
+     * completes asynchronously.
+     */
+    for (ai = res;ai != NULL;ai = ai->ai_next) {
+        sock = socket(ai->ai_family,ai->ai_socktype | SOCK_NONBLOCK,ai->ai_protocol);
+        if (sock == -1) {
+            err = errno;
+            continue;
+        }
+        if (connect(sock,ai->ai_addr,ai->ai_addrlen) == 0
+            || (errno == EINPROGRESS && uniauth_connect_wait(sock) == 0))
+        {
+            break;
+        }
+        err = errno;
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    if (sock == -1) {
+        errno = err;
+        return -1;
+    }
+
+    /* Requests are small and written whole, so they should go out at once
+     * rather than wait for the previous reply's ACK.
+     */
+    setsockopt(sock,IPPROTO_TCP,TCP_NODELAY,&on,sizeof(int));
+    setsockopt(sock,SOL_SOCKET,SO_KEEPALIVE,&on,sizeof(int));
+#ifdef TCP_KEEPIDLE
+    {
+        int idle = UNIAUTH_TCP_KEEPIDLE;
+        int intvl = UNIAUTH_TCP_KEEPINTVL;
+        int cnt = UNIAUTH_TCP_KEEPCNT;
+
+        setsockopt(sock,IPPROTO_TCP,TCP_KEEPIDLE,&idle,sizeof(int));
+        setsockopt(sock,IPPROTO_TCP,TCP_KEEPINTVL,&intvl,sizeof(int));
+        setsockopt(sock,IPPROTO_TCP,TCP_KEEPCNT,&cnt,sizeof(int));
+    }
+#endif
+
+    return sock;
+}
+
+static void uniauth_conn_timeout(int sock,struct uniauth_peer* peer)
+{
+    /* Bound blocking I/O on the socket by uniauth.timeout_ms. This is set once
+     * per connection (and again only if the setting changes), so exchanges
+     * need no extra syscalls to enforce the timeout.
+     */
+
+    struct timeval tv;
+    int ms = 0;
+
+    if (UNIAUTH_G(timeout) > 0) {
+        ms = UNIAUTH_G(timeout) < INT_MAX ? (int)UNIAUTH_G(timeout) : INT_MAX;
+    }
+    if (ms == peer->timeout) {
+        return;
+    }
+
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&tv,sizeof(struct timeval));
+    setsockopt(sock,SOL_SOCKET,SO_SNDTIMEO,&tv,sizeof(struct timeval));
+    peer->timeout = ms;
+}
+
+static int uniauth_connect_socket(size_t shard,struct uniauth_peer* peer)
+{
+    int sock;
+    struct sockaddr_un addr;
+    socklen_t len;
+    struct uniauth_shard_conn* state = uniauth_shard_conn(shard);
+    const char* path = shards[shard].path;
+    size_t pathsz;
+    uint64_t now = uniauth_clock_ms();
+
+    /* Attempt a connect to the shard's uniauth daemon. On failure, errno is
+     * left for the caller to report. After a failed attempt we do not try
+     * again until the reconnect backoff has elapsed so that a dead daemon is
+     * not hammered by every request.
+     */
+    if (now < state->retryAt) {
+        errno = ECONNREFUSED;
+        return -1;
+    }
+
+    peer->packet = false;
+    peer->timeout = 0;
+    if (uniauth_shard_remote(shard)) {
+        sock = uniauth_connect_tcp(path + sizeof(UNIAUTH_TCP_PREFIX)-1);
+        if (sock == -1) {
+            int err = errno;
+
+            if (UNIAUTH_G(reconnectBackoff) > 0) {
+                state->retryAt = now + UNIAUTH_G(reconnectBackoff);
+            }
+            errno = err;
+            return -1;
+        }
+
+        fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) & ~O_NONBLOCK);
+        uniauth_conn_timeout(sock,peer);
+        state->retryAt = 0;
+        return sock;
+    }
+    if (strncmp(path,UNIAUTH_SEQPACKET_PREFIX,sizeof(UNIAUTH_SEQPACKET_PREFIX)-1) == 0) {
+        path += sizeof(UNIAUTH_SEQPACKET_PREFIX)-1;
+        peer->packet = !state->packetFallback;
+    }
+    pathsz = strlen(path);
+    if (pathsz >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    sock = socket(AF_UNIX,(peer->packet ? SOCK_SEQPACKET : SOCK_STREAM) | SOCK_NONBLOCK,0);
+    if (sock == -1) {
+        return -1;
+    }
+
+    /* Do connect. The socket is non-blocking for the connect since a daemon
+     * that stopped accepting connections would otherwise hang us as soon as
+     * its listen backlog fills up (this fails with EAGAIN instead).
+     */
+    memset(&addr,0,sizeof(struct sockaddr_un));
+    addr.sun_family = AF_UNIX;
+    memcpy(addr.sun_path,path,pathsz);
+    if (addr.sun_path[0] == '@') {
+        addr.sun_path[0] = 0;
+        len = offsetof(struct sockaddr_un,sun_path) + pathsz;
+    }
+    else {
+        len = sizeof(struct sockaddr_un);
+    }
+    if (connect(sock,(struct sockaddr*)&addr,len) == -1) {
+        int err = errno;
+        close(sock);
+
+        /* A daemon listening on a stream socket refuses packet connections.
+         * Use the stream transport with it from now on.
+         */
+        if (err == EPROTOTYPE && peer->packet) {
+            state->packetFallback = true;
+            return uniauth_connect_socket(shard,peer);
+        }
+
+        if (UNIAUTH_G(reconnectBackoff) > 0) {
+            state->retryAt = now + UNIAUTH_G(reconnectBackoff);
+        }
+        errno = err;
+        return -1;
+    }
+
+    /* Regular I/O blocks unless it passes MSG_DONTWAIT (see uniauth_io_flags()). */
+    fcntl(sock,F_SETFL,fcntl(sock,F_GETFL) & ~O_NONBLOCK);
+    uniauth_conn_timeout(sock,peer);
+
+    state->retryAt = 0;
+    return sock;
+}
+
+static inline void uniauth_conn_peer(struct uniauth_peer* peer)
+{
+    /* Describes the persistent connection in the module globals. */
+    peer->version = UNIAUTH_G(connVersion);
+    peer->features = UNIAUTH_G(connFeatures);
+    peer->packet = UNIAUTH_G(connPacket);
+    peer->ring = UNIAUTH_G(connRing);
+    peer->timeout = UNIAUTH_G(connTimeout);
+}
+
+static inline void uniauth_conn_close(int sock,struct uniauth_ring* ring)
+{
+    if (ring != NULL) {
+        uniauth_ring_detach(ring);
+    }
+    close(sock);
+}
+
+static int uniauth_connect_handshake(int sock,struct uniauth_peer* peer);
+static int uniauth_connect_ring(int sock,struct uniauth_peer* peer);
+
+static int uniauth_connect_open(struct uniauth_peer* peer,size_t shard)
+{
+    int sock;
+    int result;
+
+    peer->ring = NULL;
+    sock = uniauth_connect_socket(shard,peer);
+    if (sock == -1) {
+        php_error(E_ERROR,"could not connect to uniauth daemon: %s",strerror(errno));
+        return -1;
+    }
+
+    /* Agree on a protocol version. A daemon that predates version negotiation
+     * may simply hang up on HELLO, in which case we reconnect and stick to
+     * version 1 from now on.
+     */
+    result = uniauth_connect_handshake(sock,peer);
+    if (result == UNIAUTH_CONN_LOST) {
+        close(sock);
+        UNIAUTH_G(protocolFallback) = true;
+        sock = uniauth_connect_socket(shard,peer);
+        if (sock == -1) {
+            php_error(E_ERROR,"could not connect to uniauth daemon: %s",strerror(errno));
+            return -1;
+        }
+        peer->version = UNIAUTH_PROTOCOL_V1;
+        peer->features = 0;
+    }
+    else if (result == -1) {
+        close(sock);
+        return -1;
+    }
+
+    /* The ring segment can only be passed to a local client. */
+    if (!uniauth_shard_remote(shard) && uniauth_connect_ring(sock,peer) == -1) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static int uniauth_connect(struct uniauth_peer* peer,size_t shard)
+{
+    int sock;
+    int* psock = &UNIAUTH_G(conn);
+    struct uniauth_shard_conn* state;
+
+    /* See if we already have a connection. We do not check that it is still
+     * alive here: a connection lost since it was last used is detected by the
+     * I/O performed on it (see uniauth_transact()).
+     */
+    sock = *psock;
+    if (sock != -1 && UNIAUTH_G(connShard) == shard) {
+        uniauth_conn_peer(peer);
+        uniauth_conn_timeout(sock,peer);
+        UNIAUTH_G(connTimeout) = peer->timeout;
+        return sock;
+    }
+
+    /* The persistent connection goes to another shard: park it and pick up
+     * the one to this shard, if we have one.
+     */
+    if (sock != -1) {
+        state = uniauth_shard_conn(UNIAUTH_G(connShard));
+        state->fd = sock;
+        uniauth_conn_peer(&state->peer);
+        *psock = -1;
+        UNIAUTH_G(connRing) = NULL;
+    }
+    state = uniauth_shard_conn(shard);
+    if (state->fd != -1) {
+        sock = state->fd;
+        *peer = state->peer;
+        state->fd = -1;
+        uniauth_conn_timeout(sock,peer);
+    }
+    else {
+        /* Since we do not have a connection, attempt a connect to the
+         * uniauth daemon.
+         */
+        sock = uniauth_connect_open(peer,shard);
+        if (sock == -1) {
+            return -1;
+        }
+    }
+
+    /* Assign socket to globals so we can look it back up later. */
+    *psock = sock;
+    UNIAUTH_G(connShard) = shard;
+    UNIAUTH_G(connVersion) = peer->version;
+    UNIAUTH_G(connFeatures) = peer->features;
+    UNIAUTH_G(connPacket) = peer->packet;
+    UNIAUTH_G(connRing) = peer->ring;
+    UNIAUTH_G(connTimeout) = peer->timeout;
+    return sock;
+}
+
+/* Connection ownership: an operation owns its connection from the moment it
+ * sends a request until it has read the complete reply. Normally that is the
+ * persistent connection in the module globals. When a fiber suspends in the
+ * middle of an operation, other fibers must not use that connection (their
+ * messages would interleave), so they borrow a spare connection instead. Spare
+ * connections are kept for the rest of the request.
+ */
+
+struct uniauth_spare_conn
+{
+    int fd;
+    size_t shard;
+    struct uniauth_peer peer;
+    bool busy;
+};
+
+static int uniauth_prefetch_complete();
+
+static int uniauth_conn_acquire(struct uniauth_peer* peer,size_t shard)
+{
+    int sock;
+    size_t i;
+    struct uniauth_spare_conn* spare = NULL;
+
+    /* A prefetched reply must be consumed before the connection can carry
+     * another exchange.
+     */
+    if (UNIAUTH_G(prefetchKey) != NULL && uniauth_prefetch_complete() == -1) {
+        return -1;
+    }
+
+    if (!UNIAUTH_G(connBusy)) {
+        /* Claim the connection first: opening it may suspend the fiber. */
+        UNIAUTH_G(connBusy) = true;
+        sock = uniauth_connect(peer,shard);
+        if (sock == -1) {
+            UNIAUTH_G(connBusy) = false;
+        }
+        return sock;
+    }
+
+    for (i = 0;i < UNIAUTH_G(spareCount);++i) {
+        struct uniauth_spare_conn* conn = UNIAUTH_G(spares) + i;
+
+        if (conn->fd != -1 && !conn->busy && conn->shard == shard) {
+            conn->busy = true;
+            uniauth_conn_timeout(conn->fd,&conn->peer);
+            *peer = conn->peer;
+            return conn->fd;
+        }
+        if (conn->fd == -1 && spare == NULL) {
+            spare = conn;
+        }
+    }
+
+    sock = uniauth_connect_open(peer,shard);
+    if (sock == -1) {
+        return -1;
+    }
+
+    if (spare == NULL) {
+        UNIAUTH_G(spares) = safe_erealloc(UNIAUTH_G(spares),UNIAUTH_G(spareCount)+1,
+            sizeof(struct uniauth_spare_conn),0);
+        spare = UNIAUTH_G(spares) + UNIAUTH_G(spareCount)++;
+    }
+    spare->fd = sock;
+    spare->shard = shard;
+    spare->peer = *peer;
+    spare->busy = true;
+
+    return sock;
+}
+
+static void uniauth_conn_release(int sock,bool broken)
+{
+    /* A connection is broken if an operation was abandoned part way through;
+     * we can no longer tell where the next reply begins so it is closed.
+     */
+
+    size_t i;
+
+    if (sock == UNIAUTH_G(conn)) {
+        UNIAUTH_G(connBusy) = false;
+        if (broken) {
+            uniauth_conn_close(sock,UNIAUTH_G(connRing));
+            UNIAUTH_G(conn) = -1;
+            UNIAUTH_G(connRing) = NULL;
+        }
+        return;
+    }
+
+    for (i = 0;i < UNIAUTH_G(spareCount);++i) {
+        struct uniauth_spare_conn* conn = UNIAUTH_G(spares) + i;
+
+        if (conn->fd == sock) {
+            conn->busy = false;
+            if (broken) {
+                uniauth_conn_close(sock,conn->peer.ring);
+                conn->fd = -1;
+            }
+            return;
+        }
+    }
+}
+
+static void uniauth_prefetch_drain();
+
+static void uniauth_conn_request_shutdown()
+{
+    size_t i;
+
+    /* An unused prefetch still has its reply in flight. */
+    if (UNIAUTH_G(prefetchKey) != NULL) {
+        uniauth_prefetch_drain();
+    }
+
+    /* An operation still owning the persistent connection was interrupted
+     * (e.g. by a fatal error or an abandoned fiber) so its state is unknown.
+     */
+    if (UNIAUTH_G(connBusy)) {
+        if (UNIAUTH_G(conn) != -1) {
+            uniauth_conn_close(UNIAUTH_G(conn),UNIAUTH_G(connRing));
+            UNIAUTH_G(conn) = -1;
+            UNIAUTH_G(connRing) = NULL;
+        }
+        UNIAUTH_G(connBusy) = false;
+    }
+
+    for (i = 0;i < UNIAUTH_G(spareCount);++i) {
+        if (UNIAUTH_G(spares)[i].fd != -1) {
+            uniauth_conn_close(UNIAUTH_G(spares)[i].fd,UNIAUTH_G(spares)[i].peer.ring);
+        }
+    }
+    if (UNIAUTH_G(spares) != NULL) {
+        efree(UNIAUTH_G(spares));
+        UNIAUTH_G(spares) = NULL;
+        UNIAUTH_G(spareCount) = 0;
+    }
+}
+
+/* Fiber support: when userspace registered a wait handler and a daemon
+ * operation runs inside a fiber, socket I/O is non-blocking. Instead of
+ * blocking the whole worker, the extension passes the socket to the handler,
+ * which suspends the fiber until the event loop reports the socket ready.
+ * Outside of fibers, or without a handler, I/O blocks as it always has.
+ */
+
+static inline bool uniauth_conn_suspendable()
+{
+#if PHP_VERSION_ID >= 80100
+    return EG(active_fiber) != NULL && !Z_ISUNDEF(UNIAUTH_G(waitHandler));
+#else
+    return false;
+#endif
+}
+
+/* Blocking I/O may overrun a deadline by this many milliseconds. */
+#define UNIAUTH_IO_SLACK_MS 10
+
+static inline int uniauth_io_flags(uint64_t deadline)
+{
+    /* Blocking I/O is bounded by the socket's kernel timeout, which is
+     * uniauth.timeout_ms (see uniauth_conn_timeout()), so an exchange normally
+     * costs a single syscall per read or write. Only when the deadline falls
+     * well short of that (the request budget is nearly used up, or the
+     * exchange has already spent part of its time) or inside fibers is the I/O
+     * non-blocking and the wait done by poll() instead.
+     */
+
+    if (uniauth_conn_suspendable()) {
+        return MSG_DONTWAIT;
+    }
+    if (deadline == 0) {
+        return 0;
+    }
+    if (UNIAUTH_G(timeout) <= 0
+        || deadline + UNIAUTH_IO_SLACK_MS < uniauth_clock_ms() + (uint64_t)UNIAUTH_G(timeout))
+    {
+        return MSG_DONTWAIT;
+    }
+    return 0;
+}
+
+static int uniauth_conn_suspend(int sock,bool writable,int timeout)
+{
+    int fd;
+    int result = 0;
+    php_stream* stream;
+    zval args[4];
+    zval retval;
+
+    /* The handler gets a stream wrapping a duplicate of the descriptor so that
+     * the event loop may keep or close it without affecting the connection.
+     */
+    fd = dup(sock);
+    if (fd == -1) {
+        php_error(E_ERROR,"fail dup(): %s",strerror(errno));
+        return -1;
+    }
+    stream = php_stream_sock_open_from_socket(fd,NULL);
+    if (stream == NULL) {
+        close(fd);
+        php_error(E_ERROR,"could not create stream for uniauth daemon socket");
+        return -1;
+    }
+
+    php_stream_to_zval(stream,&args[0]);
+    ZVAL_BOOL(&args[1],writable);
+    ZVAL_LONG(&args[2],sock);
+    if (timeout >= 0) {
+        ZVAL_LONG(&args[3],timeout);
+    }
+    else {
+        ZVAL_NULL(&args[3]);
+    }
+    ZVAL_UNDEF(&retval);
+
+    if (call_user_function(NULL,NULL,&UNIAUTH_G(waitHandler),&retval,4,args) == FAILURE
+        || EG(exception) != NULL)
+    {
+        result = -1;
+    }
+
+    zval_ptr_dtor(&retval);
+    zval_ptr_dtor(&args[0]);
+    return result;
+}
+
+/* Timeouts: every exchange with the daemon must complete within
+ * uniauth.timeout_ms, and all exchanges made by a request within
+ * uniauth.request_budget_ms of the request's start. An exchange computes its
+ * deadline (0 meaning none) up front and all waiting on the socket is bounded
+ * by it: blocking I/O by the socket's kernel timeout and anything else by
+ * poll(). Running out of time throws an UniauthTimeoutException; the
+ * connection is then closed since the reply may still arrive later.
+ */
+
+static uint64_t uniauth_deadline()
+{
+    uint64_t deadline = 0;
+
+    if (UNIAUTH_G(timeout) > 0) {
+        deadline = uniauth_clock_ms() + UNIAUTH_G(timeout);
+    }
+    if (UNIAUTH_G(requestBudget) > 0) {
+        uint64_t end = UNIAUTH_G(requestStart) + UNIAUTH_G(requestBudget);
+
+        if (deadline == 0 || end < deadline) {
+            deadline = end;
+        }
+    }
+
+    return deadline;
+}
+
+static int uniauth_timed_out()
+{
+    zend_throw_exception(uniauth_timeout_exception_ce,
+        "timed out waiting for uniauth daemon",0);
+    return -1;
+}
+
+static int uniauth_deadline_begin(uint64_t* deadline)
+{
+    /* Fail straight away if the request has used up its budget. */
+    *deadline = uniauth_deadline();
+    if (*deadline != 0 && uniauth_clock_ms() >= *deadline) {
+        return uniauth_timed_out();
+    }
+    return 0;
+}
+
+static int uniauth_conn_wait(int sock,bool writable,uint64_t deadline)
+{
+    int r;
+    int timeout = -1;
+    struct pollfd pollInfo;
+
+    if (deadline != 0) {
+        uint64_t now = uniauth_clock_ms();
+
+        if (now >= deadline) {
+            return uniauth_timed_out();
+        }
+        timeout = (int)(deadline - now);
+    }
+
+    if (uniauth_conn_suspendable()) {
+        return uniauth_conn_suspend(sock,writable,timeout);
+    }
+
+    pollInfo.fd = sock;
+    pollInfo.events = writable ? POLLOUT : POLLIN;
+    pollInfo.revents = 0;
+    r = poll(&pollInfo,1,timeout);
+    if (r == 0) {
+        return uniauth_timed_out();
+    }
+    if (r == -1 && errno != EINTR) {
+        php_error(E_ERROR,"fail poll(): %s",strerror(errno));
+        return -1;
+    }
+
+    /* On EINTR the caller retries the I/O and waits again if needed. */
+    return 0;
+}
+
+/* Ring transport: waiting on a ring cannot notice the daemon going away, so
+ * waits are done in slices of this many milliseconds. In between, the socket
+ * is checked for a hangup (the daemon sends nothing else on it). The ring
+ * waits in the kernel even if a fiber wait handler is registered.
+ */
+#define UNIAUTH_RING_CHECK_MS 100
+
+static int uniauth_ring_io_wait(int sock,struct uniauth_ring* ring,bool writable,
+    uint64_t deadline)
+{
+    int timeout = UNIAUTH_RING_CHECK_MS;
+    struct pollfd pollInfo;
+
+    if (deadline != 0) {
+        uint64_t now = uniauth_clock_ms();
+
+        if (now >= deadline) {
+            return uniauth_timed_out();
+        }
+        if (deadline - now < (uint64_t)timeout) {
+            timeout = (int)(deadline - now);
+        }
+    }
+
+    if (uniauth_ring_wait(ring,writable,timeout) == 0) {
+        return 0;
+    }
+
+    pollInfo.fd = sock;
+    pollInfo.events = POLLIN;
+    pollInfo.revents = 0;
+    if (poll(&pollInfo,1,0) == 1) {
+        return UNIAUTH_CONN_LOST;
+    }
+    return 0;
+}
+
+/* Response parsing: replies are parsed incrementally as they arrive. The
+ * parser keeps its position across reads so every byte is examined once, and
+ * the integer fields of a record are decoded into the target storage (if any)
+ * as soon as they are complete. String fields are only noted; once the whole
+ * message is in, they are copied into a single arena sized for them. Version 2
+ * messages announce their length up front, so their fields are only decoded
+ * once the whole message is in. Feeding the parser returns:
+ *  0=complete (the message length is left in 'pos')
+ *  1=incomplete
+ *  2=error
+ */
+
+struct uniauth_parser
+{
+    int framing;   /* protocol version of the connection */
+    bool packet;   /* connection uses the packet transport */
+    struct uniauth_ring* ring; /* ring of the connection (if any) */
+    size_t pos;    /* offset of the next byte to examine */
+    int kind;      /* response kind or -1 if not yet known */
+    int field;     /* field being read or -1 if between fields */
+    size_t start;  /* offset of the current field's value */
+    size_t total;  /* message length if known (version 2) or 0 */
+    int32_t version; /* VERSION field of the reply (see HELLO) */
+    int32_t features; /* FEATURES field of the reply (see HELLO) */
+    struct uniauth_storage* stor;
+
+    /* Offset and length of each string field of a record (indexed by field
+     * type) or an offset of 0 if the field was not seen.
+     */
+    struct {
+        size_t offset;
+        size_t len;
+    } strings[UNIAUTH_PROTO_FIELD_TAG + 1];
+};
+
+static inline void parser_init(struct uniauth_parser* parser,
+    struct uniauth_storage* stor,const struct uniauth_peer* peer)
+{
+    parser->framing = peer->version;
+    parser->packet = peer->packet;
+    parser->ring = peer->ring;
+    parser->pos = 0;
+    parser->kind = -1;
+    parser->field = -1;
+    parser->start = 0;
+    parser->total = 0;
+    parser->version = 0;
+    parser->features = 0;
+    parser->stor = stor;
+    memset(parser->strings,0,sizeof(parser->strings));
+    if (stor != NULL) {
+        memset(stor,0,sizeof(struct uniauth_storage));
+    }
+}
+
+static inline void parser_abort(struct uniauth_parser* parser)
+{
+    /* Free whatever part of a record was decoded by a failed exchange. */
+    if (parser->stor != NULL) {
+        uniauth_storage_delete(parser->stor);
+        memset(parser->stor,0,sizeof(struct uniauth_storage));
+    }
+}
+
+static inline uint32_t load_le32(const char* p)
+{
+    uint32_t value;
+
+    memcpy(&value,p,sizeof(uint32_t));
+    return le32toh(value);
+}
+
+static inline uint64_t load_le64(const char* p)
+{
+    uint64_t value;
+
+    memcpy(&value,p,sizeof(uint64_t));
+    return le64toh(value);
+}
+
+static inline void parser_string(struct uniauth_parser* parser,int field,
+    size_t offset,size_t n)
+{
+    if (field >= 0 && field <= UNIAUTH_PROTO_FIELD_TAG) {
+        parser->strings[field].offset = offset;
+        parser->strings[field].len = n;
+    }
+}
+
+static inline void parser_take(struct uniauth_parser* parser,
+    const char* buffer,struct uniauth_arena* arena,int field,
+    char** dst,size_t* dstsz)
+{
+    if (parser->strings[field].offset != 0) {
+        *dst = uniauth_arena_field(arena,buffer + parser->strings[field].offset,
+            parser->strings[field].len);
+        *dstsz = parser->strings[field].len;
+    }
+}
+
+static inline void parser_take_user(struct uniauth_parser* parser,
+    const char* buffer,int field,char** dst,size_t* dstsz)
+{
+    if (parser->strings[field].offset != 0) {
+        *dst = uniauth_user_field_new(buffer + parser->strings[field].offset,
+            parser->strings[field].len);
+        *dstsz = parser->strings[field].len;
+    }
+}
+
+static void parser_strings(struct uniauth_parser* parser,const char* buffer)
+{
+    /* Copy the string fields of a complete record: the user information into
+     * zend_strings of their own and the rest into one arena.
+     */
+
+    int i;
+    int count = 0;
+    size_t len = 0;
+    struct uniauth_arena* arena;
+    struct uniauth_storage* stor = parser->stor;
+
+    parser_take_user(parser,buffer,UNIAUTH_PROTO_FIELD_USER,
+        &stor->username,&stor->usernameSz);
+    parser_take_user(parser,buffer,UNIAUTH_PROTO_FIELD_DISPLAY,
+        &stor->displayName,&stor->displayNameSz);
+
+    for (i = 0;i <= UNIAUTH_PROTO_FIELD_TAG;++i) {
+        if (i != UNIAUTH_PROTO_FIELD_USER && i != UNIAUTH_PROTO_FIELD_DISPLAY
+            && parser->strings[i].offset != 0)
+        {
+            len += parser->strings[i].len;
+            count += 1;
+        }
+    }
+    if (count == 0) {
+        return;
+    }
+
+    arena = uniauth_arena_new(len,count);
+    parser_take(parser,buffer,arena,UNIAUTH_PROTO_FIELD_KEY,
+        &stor->key,&stor->keySz);
+    parser_take(parser,buffer,arena,UNIAUTH_PROTO_FIELD_REDIRECT,
+        &stor->redirect,&stor->redirectSz);
+    parser_take(parser,buffer,arena,UNIAUTH_PROTO_FIELD_TAG,
+        &stor->tag,&stor->tagSz);
+    uniauth_arena_release(arena);
+}
+
+static void parser_integer(struct uniauth_parser* parser,int field,
+    int64_t value)
+{
+    struct uniauth_storage* stor = parser->stor;
+
+    if (field == UNIAUTH_PROTO_FIELD_VERSION) {
+        parser->version = (int32_t)value;
+        return;
+    }
+    if (field == UNIAUTH_PROTO_FIELD_FEATURES) {
+        parser->features = (int32_t)value;
+        return;
+    }
+    if (stor == NULL) {
+        return;
+    }
+
+    switch (field) {
+    case UNIAUTH_PROTO_FIELD_ID:
+        stor->id = (int32_t)value;
+        break;
+    case UNIAUTH_PROTO_FIELD_LIFETIME:
+        stor->lifetime = (int32_t)value;
+        break;
+    case UNIAUTH_PROTO_FIELD_EXPIRE:
+        stor->expire = value;
+        break;
+    case UNIAUTH_PROTO_FIELD_REVISION:
+        stor->revision = value;
+        break;
+    }
+}
+
+static inline bool parser_kind(int kind)
+{
+    return kind == UNIAUTH_PROTO_RESPONSE_MESSAGE
+        || kind == UNIAUTH_PROTO_RESPONSE_ERROR
+        || kind == UNIAUTH_PROTO_RESPONSE_RECORD
+        || kind == UNIAUTH_PROTO_RESPONSE_NOT_MODIFIED;
+}
+
+static inline bool parser_text(int kind)
+{
+    return kind == UNIAUTH_PROTO_RESPONSE_MESSAGE
+        || kind == UNIAUTH_PROTO_RESPONSE_ERROR;
+}
+
+static int parser_feed_v2(struct uniauth_parser* parser,const char* buffer,
+    size_t sz)
+{
+    size_t n;
+
+    /* The header gives the kind and the length of the message. */
+    if (parser->kind == -1) {
+        if (sz < UNIAUTH_PROTO_V2_HEADER) {
+            return 1;
+        }
+
+        parser->kind = (unsigned char)buffer[0];
+        n = load_le32(buffer + 4);
+        if (!parser_kind(parser->kind)
+            || n > UNIAUTH_MAX_MESSAGE_V2 - UNIAUTH_PROTO_V2_HEADER)
+        {
+            return 2;
+        }
+        parser->total = UNIAUTH_PROTO_V2_HEADER + n;
+        parser->pos = UNIAUTH_PROTO_V2_HEADER;
+    }
+
+    if (sz < parser->total) {
+        return 1;
+    }
+
+    /* Messages and errors carry only text, which we do not use. The fields of
+     * a record are each a type byte, a 32-bit length and the value.
+     */
+    while (parser->kind == UNIAUTH_PROTO_RESPONSE_RECORD
+        && parser->pos < parser->total)
+    {
+        int field;
+
+        if (parser->total - parser->pos < 1 + UNIAUTH_INT_SZ) {
+            return 2;
+        }
+        field = (unsigned char)buffer[parser->pos];
+        n = load_le32(buffer + parser->pos + 1);
+        parser->pos += 1 + UNIAUTH_INT_SZ;
+        if (n > parser->total - parser->pos) {
+            return 2;
+        }
+
+        switch (field) {
+        case UNIAUTH_PROTO_FIELD_ID:
+        case UNIAUTH_PROTO_FIELD_LIFETIME:
+        case UNIAUTH_PROTO_FIELD_VERSION:
+        case UNIAUTH_PROTO_FIELD_FEATURES:
+        case UNIAUTH_PROTO_FIELD_THRESHOLD:
+            if (n != UNIAUTH_INT_SZ) {
+                return 2;
+            }
+            parser_integer(parser,field,(int32_t)load_le32(buffer + parser->pos));
+            break;
+        case UNIAUTH_PROTO_FIELD_EXPIRE:
+        case UNIAUTH_PROTO_FIELD_REVISION:
+            if (n != UNIAUTH_TIME_SZ) {
+                return 2;
+            }
+            parser_integer(parser,field,(int64_t)load_le64(buffer + parser->pos));
+            break;
+        default:
+            /* Unknown fields are skipped since their length is known. */
+            parser_string(parser,field,parser->pos,n);
+            break;
+        }
+
+        parser->pos += n;
+    }
+
+    if (parser->stor != NULL && parser->kind == UNIAUTH_PROTO_RESPONSE_RECORD) {
+        parser_strings(parser,buffer);
+    }
+    parser->pos = parser->total;
+    return 0;
+}
+
+static int parser_feed(struct uniauth_parser* parser,const char* buffer,size_t sz)
+{
+    const char* nul;
+
+    if (parser->framing >= UNIAUTH_PROTOCOL_V2) {
+        return parser_feed_v2(parser,buffer,sz);
+    }
+
+    while (parser->pos < sz) {
+        /* The first byte determines the kind of response. */
+        if (parser->kind == -1) {
+            parser->kind = (unsigned char)buffer[parser->pos++];
+            if (!parser_kind(parser->kind)) {
+                return 2;
+            }
+            continue;
+        }
+
+        /* Messages and errors are a single null-terminated string. */
+        if (parser_text(parser->kind)) {
+            nul = memchr(buffer + parser->pos,0,sz - parser->pos);
+            if (nul == NULL) {
+                parser->pos = sz;
+                return 1;
+            }
+            parser->pos = nul - buffer + 1;
+            return 0;
+        }
+
+        /* Otherwise we are between the fields of a record (a not-modified
+         * reply is an empty one). We have a complete message if we find the
+         * end field.
+         */
+        if (parser->field == -1) {
+            parser->field = (unsigned char)buffer[parser->pos++];
+            parser->start = parser->pos;
+
+            switch (parser->field) {
+            case (unsigned char)UNIAUTH_PROTO_FIELD_END:
+                parser->field = -1;
+                if (parser->stor != NULL) {
+                    parser_strings(parser,buffer);
+                }
+                return 0;
+            case UNIAUTH_PROTO_FIELD_KEY:
+            case UNIAUTH_PROTO_FIELD_USER:
+            case UNIAUTH_PROTO_FIELD_DISPLAY:
+            case UNIAUTH_PROTO_FIELD_REDIRECT:
+            case UNIAUTH_PROTO_FIELD_TAG:
+            case UNIAUTH_PROTO_FIELD_ID:
+            case UNIAUTH_PROTO_FIELD_LIFETIME:
+            case UNIAUTH_PROTO_FIELD_VERSION:
+            case UNIAUTH_PROTO_FIELD_FEATURES:
+            case UNIAUTH_PROTO_FIELD_THRESHOLD:
+            case UNIAUTH_PROTO_FIELD_EXPIRE:
+            case UNIAUTH_PROTO_FIELD_REVISION:
+                continue;
+            default:
+                return 2;
+            }
+        }
+
+        /* Read the value of the current field. */
+        switch (parser->field) {
+        case UNIAUTH_PROTO_FIELD_ID:
+        case UNIAUTH_PROTO_FIELD_LIFETIME:
+        case UNIAUTH_PROTO_FIELD_VERSION:
+        case UNIAUTH_PROTO_FIELD_FEATURES:
+        case UNIAUTH_PROTO_FIELD_THRESHOLD:
+            if (sz - parser->start < UNIAUTH_INT_SZ) {
+                parser->pos = sz;
+                return 1;
+            }
+            parser_integer(parser,parser->field,
+                (int32_t)load_le32(buffer + parser->start));
+            parser->pos = parser->start + UNIAUTH_INT_SZ;
+            break;
+        case UNIAUTH_PROTO_FIELD_EXPIRE:
+        case UNIAUTH_PROTO_FIELD_REVISION:
+            if (sz - parser->start < UNIAUTH_TIME_SZ) {
+                parser->pos = sz;
+                return 1;
+            }
+            parser_integer(parser,parser->field,
+                (int64_t)load_le64(buffer + parser->start));
+            parser->pos = parser->start + UNIAUTH_TIME_SZ;
+            break;
+        default:
+            /* Seek past null-terminated string. */
+            nul = memchr(buffer + parser->pos,0,sz - parser->pos);
+            if (nul == NULL) {
+                parser->pos = sz;
+                return 1;
+            }
+            parser_string(parser,parser->field,parser->start,
+                nul - buffer - parser->start);
+            parser->pos = nul - buffer + 1;
+            break;
+        }
+
+        parser->field = -1;
+    }
+
+    return 1;
+}
+
+/* Receive buffer: replies are read into a buffer on the stack that is big
+ * enough for any version 1 message. A version 2 reply may be larger, in which
+ * case the buffer moves to the heap once the reply's header says how much room
+ * it needs.
+ */
+
+struct uniauth_buffer
+{
+    char* data;
+    size_t size;
+    size_t cap;
+    char local[UNIAUTH_MAX_MESSAGE];
+};
+
+static inline void buffer_init(struct uniauth_buffer* buf)
+{
+    buf->data = buf->local;
+    buf->size = 0;
+    buf->cap = sizeof(buf->local);
+}
+
+static void buffer_reserve(struct uniauth_buffer* buf,size_t n)
+{
+    if (n <= buf->cap) {
+        return;
+    }
+
+    if (buf->data == buf->local) {
+        buf->data = emalloc(n);
+        memcpy(buf->data,buf->local,buf->size);
+    }
+    else {
+        buf->data = erealloc(buf->data,n);
+    }
+    buf->cap = n;
+}
+
+static inline void buffer_prepare(struct uniauth_buffer* buf,
+    const struct uniauth_parser* parser)
+{
+    /* Make room for the rest of the message if its length is known. A read
+     * from a packet connection returns a whole packet, which must fit.
+     */
+    size_t n = parser->total;
+
+    if (parser->packet && n < buf->size + UNIAUTH_MAX_PACKET) {
+        n = buf->size + UNIAUTH_MAX_PACKET;
+    }
+    buffer_reserve(buf,n);
+}
+
+static inline void buffer_consume(struct uniauth_buffer* buf,size_t n)
+{
+    buf->size -= n;
+    memmove(buf->data,buf->data + n,buf->size);
+}
+
+static inline void buffer_free(struct uniauth_buffer* buf)
+{
+    if (buf->data != buf->local) {
+        efree(buf->data);
+    }
+}
+
+static ssize_t uniauth_recv_fd(int sock,char* dst,size_t n,int flags,int* fd)
+{
+    /* Like recv() but also takes a descriptor passed with SCM_RIGHTS, storing
+     * it in '*fd' if that is still -1. Any other descriptors are closed.
+     */
+
+    ssize_t r;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    union {
+        struct cmsghdr hdr;
+        char data[CMSG_SPACE(4 * sizeof(int))];
+    } control;
+
+    iov.iov_base = dst;
+    iov.iov_len = n;
+    memset(&msg,0,sizeof(struct msghdr));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data;
+    msg.msg_controllen = sizeof(control.data);
+
+    r = recvmsg(sock,&msg,flags | MSG_CMSG_CLOEXEC);
+    if (r == -1) {
+        return -1;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg);cmsg != NULL;cmsg = CMSG_NXTHDR(&msg,cmsg)) {
+        size_t i;
+        size_t count;
+        int passed;
+
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+            continue;
+        }
+
+        count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (i = 0;i < count;++i) {
+            memcpy(&passed,CMSG_DATA(cmsg) + i * sizeof(int),sizeof(int));
+            if (*fd == -1) {
+                *fd = passed;
+            }
+            else {
+                close(passed);
+            }
+        }
+    }
+
+    return r;
+}
+
+static int uniauth_connect_recvfd(int sock,struct uniauth_buffer* buf,
+    struct uniauth_parser* parser,uint64_t deadline,int* fd)
+{
+    /* This function reads from the connect socket (or the connection's ring),
+     * waiting until data is available. When it gets data back, it feeds the
+     * new bytes to the parser and returns the parser's status. A value of -1
+     * means the read failed and an error was raised. If the connection was
+     * lost before anything was read, UNIAUTH_CONN_LOST is returned instead.
+     * If 'fd' is not NULL, a descriptor passed along with the data is stored
+     * there (see uniauth_recv_fd()).
+     */
+
+    ssize_t r;
+    size_t room;
+
+    buffer_prepare(buf,parser);
+    if (buf->size >= buf->cap) {
+        return 2;
+    }
+    room = buf->cap - buf->size;
+
+    if (parser->ring != NULL) {
+        while ((r = uniauth_ring_read(parser->ring,buf->data+buf->size,room)) == 0) {
+            int status = uniauth_ring_io_wait(sock,parser->ring,false,deadline);
+
+            if (status == UNIAUTH_CONN_LOST && buf->size > 0) {
+                php_error(E_ERROR,"could not read from uniauth daemon: connection closed");
+                return -1;
+            }
+            if (status != 0) {
+                return status;
+            }
+        }
+        if (r == -1) {
+            return 2;
+        }
+        buf->size += r;
+
+        return parser_feed(parser,buf->data,buf->size);
+    }
+
+    /* A packet connection reports the full length of a packet that did not
+     * fit (and drops the rest), which can only be a protocol error.
+     */
+    while (true) {
+        int flags = uniauth_io_flags(deadline) | (parser->packet ? MSG_TRUNC : 0);
+
+        if (fd != NULL) {
+            r = uniauth_recv_fd(sock,buf->data+buf->size,room,flags,fd);
+        }
+        else {
+            r = recv(sock,buf->data+buf->size,room,flags);
+        }
+        if (r != -1) {
+            break;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            if (uniauth_conn_wait(sock,false,deadline) == -1) {
+                return -1;
+            }
+        }
+        else if (buf->size == 0 && uniauth_conn_lost_errno(errno)) {
+            return UNIAUTH_CONN_LOST;
+        }
+        else if (errno != EINTR) {
+            php_error(E_ERROR,"could not read from uniauth daemon: %s",strerror(errno));
+            return -1;
+        }
+    }
+
+    if (r == 0) {
+        if (buf->size == 0) {
+            return UNIAUTH_CONN_LOST;
+        }
+        php_error(E_ERROR,"could not read from uniauth daemon: connection closed");
+        return -1;
+    }
+    if ((size_t)r > room) {
+        return 2;
+    }
+    buf->size += r;
+
+    return parser_feed(parser,buf->data,buf->size);
+}
+
+static inline int uniauth_connect_recv(int sock,struct uniauth_buffer* buf,
+    struct uniauth_parser* parser,uint64_t deadline)
+{
+    return uniauth_connect_recvfd(sock,buf,parser,deadline,NULL);
+}
+
+static int uniauth_connect_send(int sock,const char* buffer,size_t sz,
+    uint64_t deadline)
+{
+    /* Write the entire buffer, resuming after partial writes. If the daemon
+     * went away before any of it was written, UNIAUTH_CONN_LOST is returned
+     * without raising an error.
+     */
+
+    size_t total = sz;
+
+    while (sz > 0) {
+        ssize_t r = send(sock,buffer,sz,uniauth_io_flags(deadline) | MSG_NOSIGNAL);
+
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (uniauth_conn_wait(sock,true,deadline) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (sz == total && uniauth_conn_lost_errno(errno)) {
+                return UNIAUTH_CONN_LOST;
+            }
+            php_error(E_ERROR,"fail write(): %s",strerror(errno));
+            return -1;
+        }
+
+        buffer += r;
+        sz -= r;
+    }
+
+    return 0;
+}
+
+/* Messages written by a single sendmmsg() call. */
+#define UNIAUTH_SENDMMSG_VLEN 64
+
+static int uniauth_connect_sendm(int sock,const char* buffer,const size_t* sizes,
+    size_t count,uint64_t deadline)
+{
+    /* Write consecutive messages from the buffer as one packet each, several
+     * at a time. Like uniauth_connect_send(), UNIAUTH_CONN_LOST means that
+     * nothing was written.
+     */
+
+    struct mmsghdr hdrs[UNIAUTH_SENDMMSG_VLEN];
+    struct iovec vec[UNIAUTH_SENDMMSG_VLEN];
+    bool partial = false;
+
+    memset(hdrs,0,sizeof(hdrs));
+    while (count > 0) {
+        int i;
+        int n = 0;
+        int r;
+        const char* iter = buffer;
+
+        while ((size_t)n < count && n < UNIAUTH_SENDMMSG_VLEN) {
+            vec[n].iov_base = (char*)iter;
+            vec[n].iov_len = sizes[n];
+            hdrs[n].msg_hdr.msg_iov = vec + n;
+            hdrs[n].msg_hdr.msg_iovlen = 1;
+            iter += sizes[n];
+            n += 1;
+        }
+
+        r = sendmmsg(sock,hdrs,n,uniauth_io_flags(deadline) | MSG_NOSIGNAL);
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (uniauth_conn_wait(sock,true,deadline) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!partial && uniauth_conn_lost_errno(errno)) {
+                return UNIAUTH_CONN_LOST;
+            }
+            php_error(E_ERROR,"fail sendmmsg(): %s",strerror(errno));
+            return -1;
+        }
+        partial = true;
+
+        /* Packets are written whole, so skip over the ones that went out. */
+        for (i = 0;i < r;++i) {
+            buffer += sizes[i];
+        }
+        sizes += r;
+        count -= r;
+    }
+
+    return 0;
+}
+
+static int uniauth_ring_sendv(int sock,struct uniauth_ring* ring,
+    const struct iovec* iov,int iovcnt,uint64_t deadline)
+{
+    /* Write an entire message to the request ring, waiting for space as
+     * needed. As with uniauth_connect_send(), UNIAUTH_CONN_LOST means that
+     * nothing was written.
+     */
+
+    int i;
+    bool partial = false;
+
+    for (i = 0;i < iovcnt;++i) {
+        const char* src = iov[i].iov_base;
+        size_t n = iov[i].iov_len;
+
+        while (n > 0) {
+            size_t w = uniauth_ring_write(ring,src,n);
+
+            if (w == 0) {
+                int status = uniauth_ring_io_wait(sock,ring,true,deadline);
+
+                if (status == UNIAUTH_CONN_LOST && partial) {
+                    php_error(E_ERROR,"connection to uniauth daemon lost");
+                    return -1;
+                }
+                if (status != 0) {
+                    return status;
+                }
+                continue;
+            }
+
+            partial = true;
+            src += w;
+            n -= w;
+        }
+    }
+
+    return 0;
+}
+
+/* Request messages carry at most this many fields. Encoded, they take at most
+ * two iovecs per field plus one for the trailing header bytes.
+ */
+#define UNIAUTH_REQUEST_FIELDS 10
+#define UNIAUTH_REQUEST_IOV    (UNIAUTH_REQUEST_FIELDS * 2 + 1)
+
+static int uniauth_connect_sendv(int sock,const struct iovec* iov,int iovcnt,
+    size_t limit,uint64_t deadline)
+{
+    /* Write an entire scatter-gather message, resuming after partial writes.
+     * The caller's array is left untouched so the message can be sent again.
+     * As with uniauth_connect_send(), UNIAUTH_CONN_LOST means that nothing was
+     * written. A nonzero 'limit' caps the size of each write: on a packet
+     * connection every write is one packet.
+     */
+
+    struct iovec vec[UNIAUTH_REQUEST_IOV];
+    struct msghdr msg;
+    struct iovec* cur = vec;
+    bool partial = false;
+
+    memcpy(vec,iov,iovcnt * sizeof(struct iovec));
+    memset(&msg,0,sizeof(struct msghdr));
+
+    while (iovcnt > 0) {
+        ssize_t r;
+        int n = 0;
+        size_t total = 0;
+        size_t saved = 0;
+
+        /* Trim the iovecs to the limit, remembering the length of the last
+         * one so it can be restored afterwards.
+         */
+        while (n < iovcnt && (limit == 0 || total < limit)) {
+            total += cur[n++].iov_len;
+        }
+        if (limit != 0 && total > limit) {
+            saved = cur[n-1].iov_len;
+            cur[n-1].iov_len -= total - limit;
+        }
+
+        msg.msg_iov = cur;
+        msg.msg_iovlen = n;
+        r = sendmsg(sock,&msg,uniauth_io_flags(deadline) | MSG_NOSIGNAL);
+
+        if (saved != 0) {
+            cur[n-1].iov_len = saved;
+        }
+
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (uniauth_conn_wait(sock,true,deadline) == -1) {
+                    return -1;
+                }
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (!partial && uniauth_conn_lost_errno(errno)) {
+                return UNIAUTH_CONN_LOST;
+            }
+            php_error(E_ERROR,"fail sendmsg(): %s",strerror(errno));
+            return -1;
+        }
+        partial = true;
+
+        /* Skip over what was written. */
+        while (iovcnt > 0 && (size_t)r >= cur->iov_len) {
+            r -= cur->iov_len;
+            cur += 1;
+            iovcnt -= 1;
+        }
+        if (iovcnt > 0) {
+            cur->iov_base = (char*)cur->iov_base + r;
+            cur->iov_len -= r;
+        }
+    }
+
+    return 0;
+}
+
+/* Request encoding: a request is built up as a list of fields and encoded for
+ * the protocol version of the connection it goes out on (which is only known
+ * once the connection is acquired). The encoded message is described by an
+ * array of iovecs that point directly at the caller's strings, so nothing is
+ * copied before it is written to the socket. The op byte, field headers,
+ * string terminators and integer values go in a small header area inside the
+ * structure, which therefore must not move once it has been encoded.
+ * Consecutive header bytes share a single iovec.
+ */
+
+#define UNIAUTH_REQUEST_HDR \
+    (UNIAUTH_PROTO_V2_HEADER + UNIAUTH_REQUEST_FIELDS * (1 + UNIAUTH_INT_SZ + UNIAUTH_TIME_SZ))
+
+struct uniauth_request_field
+{
+    int type;
+    const char* str;  /* string value or NULL for integers */
+    size_t len;       /* string length or integer size */
+    int64_t value;
+    bool clear;       /* send as cleared if the daemon supports it */
+    int feature;      /* only sent if the daemon supports this feature (or 0) */
+    bool key;         /* session key; send 'digest' if the daemon supports it */
+    unsigned char digest[UNIAUTH_KEY_DIGEST_SZ];
+};
+
+struct uniauth_request
+{
+    int op;
+    int feature;      /* optional operation (UNIAUTH_FEATURE_*) or 0 */
+    int features;     /* features of the daemon it was last encoded for */
+    int nfields;
+    struct uniauth_request_field fields[UNIAUTH_REQUEST_FIELDS];
+
+    struct iovec iov[UNIAUTH_REQUEST_IOV];
+    int iovcnt;
+    size_t size;
+
+    unsigned char hdr[UNIAUTH_REQUEST_HDR];
+    size_t hdrsz;
+    size_t hdrmark;
+};
+
+static inline void request_init(struct uniauth_request* req,int op)
+{
+    req->op = op;
+    req->feature = 0;
+    req->features = 0;
+    req->nfields = 0;
+}
+
+static bool request_field(struct uniauth_request* req,int fieldType,
+    const char* str,size_t len,int64_t value,bool clear)
+{
+    struct uniauth_request_field* field;
+
+    if (req->nfields >= UNIAUTH_REQUEST_FIELDS) {
+        return false;
+    }
+
+    field = req->fields + req->nfields++;
+    field->type = fieldType;
+    field->str = str;
+    field->len = len;
+    field->value = value;
+    field->clear = clear;
+    field->feature = 0;
+    field->key = false;
+    return true;
+}
+
+static inline bool request_field_string(struct uniauth_request* req,int fieldType,
+    const char* field,size_t fieldsz)
+{
+    return request_field(req,fieldType,field,fieldsz,0,false);
+}
+
+static inline bool request_field_integer(struct uniauth_request* req,int fieldType,
+    int32_t value)
+{
+    return request_field(req,fieldType,NULL,UNIAUTH_INT_SZ,value,false);
+}
+
+static inline bool request_field_time(struct uniauth_request* req,int fieldType,
+    int64_t value)
+{
+    return request_field(req,fieldType,NULL,UNIAUTH_TIME_SZ,value,false);
+}
+
+static const unsigned char* uniauth_key_digest(const char* key,size_t keylen)
+{
+    /* A request mostly deals with a single session, so the digest of the last
+     * key is kept.
+     */
+    if (UNIAUTH_G(digestKey) == NULL || UNIAUTH_G(digestKeySz) != keylen
+        || memcmp(UNIAUTH_G(digestKey),key,keylen) != 0)
+    {
+        if (UNIAUTH_G(digestKey) != NULL) {
+            efree(UNIAUTH_G(digestKey));
+        }
+        UNIAUTH_G(digestKey) = estrndup(key,keylen);
+        UNIAUTH_G(digestKeySz) = keylen;
+        uniauth_digest(UNIAUTH_G(keyDigestSecret),key,keylen,UNIAUTH_G(digest));
+    }
+
+    return UNIAUTH_G(digest);
+}
+
+static bool request_field_key(struct uniauth_request* req,int fieldType,
+    const char* key,size_t keylen)
+{
+    struct uniauth_request_field* field;
+
+    if (!request_field_string(req,fieldType,key,keylen)) {
+        return false;
+    }
+
+    if (UNIAUTH_G(keyDigest)) {
+        field = req->fields + req->nfields - 1;
+        field->key = true;
+        memcpy(field->digest,uniauth_key_digest(key,keylen),UNIAUTH_KEY_DIGEST_SZ);
+    }
+    return true;
+}
+
+static size_t request_shard(const struct uniauth_request* req)
+{
+    /* A request goes to the shard of the first session key it names. */
+    int i;
+
+    for (i = 0;i < req->nfields;++i) {
+        const struct uniauth_request_field* field = req->fields + i;
+
+        if (field->type == UNIAUTH_PROTO_FIELD_KEY
+            || field->type == UNIAUTH_PROTO_FIELD_TRANSSRC)
+        {
+            return uniauth_shard_of(field->str,field->len);
+        }
+    }
+
+    return 0;
+}
+
+static inline void request_field_mask(struct uniauth_request* req,
+    uint32_t fields)
+{
+    /* Ask for just the specified fields of a record if the daemon supports
+     * projections. The whole record is the default.
+     */
+    if (fields != UNIAUTH_FIELDS_RECORD
+        && request_field(req,UNIAUTH_PROTO_FIELD_MASK,NULL,UNIAUTH_INT_SZ,
+            fields,false))
+    {
+        req->fields[req->nfields-1].feature = UNIAUTH_FEATURE_PROJECTION;
+    }
+}
+
+static inline uint32_t request_projection(const struct uniauth_request* req,
+    uint32_t fields)
+{
+    /* Determine which fields the reply to a lookup holds. */
+    if ((req->features & UNIAUTH_FEATURE_PROJECTION) != 0) {
+        return fields;
+    }
+    return UNIAUTH_FIELDS_RECORD;
+}
+
+static bool request_record_string(struct uniauth_request* req,
+    const struct uniauth_storage* stor,int fieldType,const char* field,
+    size_t fieldsz)
+{
+    if (!uniauth_storage_applies(stor,fieldType,field != NULL)) {
+        return true;
+    }
+    if (field == NULL) {
+        return request_field(req,fieldType,"",0,0,true);
+    }
+    return request_field_string(req,fieldType,field,fieldsz);
+}
+
+static bool request_record_integer(struct uniauth_request* req,
+    const struct uniauth_storage* stor,int fieldType,size_t size,int64_t value)
+{
+    if (!uniauth_storage_applies(stor,fieldType,value != 0)) {
+        return true;
+    }
+    return request_field(req,fieldType,NULL,size,value,value == 0);
+}
+
+static bool request_storage_record(struct uniauth_request* req,
+    const struct uniauth_storage* stor)
+{
+    /* Add the uniauth structure fields to the request. All fields are
+     * optional (except maybe key). A delta only carries the key and the dirty
+     * fields.
+     */
+
+    return ! ((stor->key != NULL && !request_field_key(req,
+                UNIAUTH_PROTO_FIELD_KEY,stor->key,stor->keySz))
+        || !request_record_integer(req,stor,UNIAUTH_PROTO_FIELD_ID,
+                UNIAUTH_INT_SZ,stor->id)
+        || !request_record_string(req,stor,UNIAUTH_PROTO_FIELD_USER,
+                stor->username,stor->usernameSz)
+        || !request_record_string(req,stor,UNIAUTH_PROTO_FIELD_DISPLAY,
+                stor->displayName,stor->displayNameSz)
+        || !request_record_integer(req,stor,UNIAUTH_PROTO_FIELD_EXPIRE,
+                UNIAUTH_TIME_SZ,stor->expire)
+        || !request_record_string(req,stor,UNIAUTH_PROTO_FIELD_REDIRECT,
+                stor->redirect,stor->redirectSz)
+        || !request_record_string(req,stor,UNIAUTH_PROTO_FIELD_TAG,
+                stor->tag,stor->tagSz)
+        || !request_record_integer(req,stor,UNIAUTH_PROTO_FIELD_LIFETIME,
+                UNIAUTH_INT_SZ,stor->lifetime));
+}
+
+static inline void request_push(struct uniauth_request* req,const void* base,
+    size_t len)
+{
+    req->iov[req->iovcnt].iov_base = (void*)base;
+    req->iov[req->iovcnt].iov_len = len;
+    req->iovcnt += 1;
+}
+
+static inline void request_flush(struct uniauth_request* req)
+{
+    /* Emit header bytes written since the last flush. */
+    if (req->hdrmark < req->hdrsz) {
+        request_push(req,req->hdr + req->hdrmark,req->hdrsz - req->hdrmark);
+        req->hdrmark = req->hdrsz;
+    }
+}
+
+static inline void request_le(unsigned char* dst,uint64_t value,size_t n)
+{
+    size_t i;
+
+    /* Write the value using little endian. */
+    for (i = 0;i < n;++i) {
+        dst[i] = (value >> (i*8)) & 0xff;
+    }
+}
+
+static bool request_encode(struct uniauth_request* req,
+    const struct uniauth_peer* peer)
+{
+    /* Encode the request for the protocol version and features of the
+     * specified daemon. This fails if the message would exceed the version's
+     * size limit.
+     */
+
+    int i;
+    bool v2 = (peer->version >= UNIAUTH_PROTOCOL_V2);
+    bool clear = (peer->features & UNIAUTH_FEATURE_CLEAR) != 0;
+
+    req->features = peer->features;
+    req->iovcnt = 0;
+    req->hdrmark = 0;
+    req->hdr[0] = req->op;
+    if (v2) {
+        /* Flags and reserved bytes; the length is filled in at the end. */
+        memset(req->hdr + 1,0,UNIAUTH_PROTO_V2_HEADER - 1);
+        req->hdrsz = UNIAUTH_PROTO_V2_HEADER;
+    }
+    else {
+        req->hdrsz = 1;
+    }
+
+    for (i = 0;i < req->nfields;++i) {
+        const struct uniauth_request_field* field = req->fields + i;
+        size_t n = field->len;
+
+        /* Leave out fields the daemon would not understand. */
+        if ((field->feature & ~peer->features) != 0) {
+            continue;
+        }
+
+        if (field->key && (peer->features & UNIAUTH_FEATURE_KEY_DIGEST) != 0) {
+            req->hdr[req->hdrsz++] = field->type | UNIAUTH_PROTO_FIELD_DIGEST;
+            if (v2) {
+                request_le(req->hdr + req->hdrsz,UNIAUTH_KEY_DIGEST_SZ,UNIAUTH_INT_SZ);
+                req->hdrsz += UNIAUTH_INT_SZ;
+            }
+            request_flush(req);
+            request_push(req,field->digest,UNIAUTH_KEY_DIGEST_SZ);
+            continue;
+        }
+
+        /* Otherwise a cleared field is sent as an empty string or 0. */
+        if (field->clear && clear) {
+            req->hdr[req->hdrsz++] = field->type | UNIAUTH_PROTO_FIELD_CLEAR;
+            if (v2) {
+                request_le(req->hdr + req->hdrsz,0,UNIAUTH_INT_SZ);
+                req->hdrsz += UNIAUTH_INT_SZ;
+            }
+            continue;
+        }
+
+        /* A version 1 string is sent up to its first null byte like it always
+         * was.
+         */
+        if (field->str != NULL && !v2) {
+            n = strnlen(field->str,n);
+        }
+
+        req->hdr[req->hdrsz++] = field->type;
+        if (v2) {
+            request_le(req->hdr + req->hdrsz,n,UNIAUTH_INT_SZ);
+            req->hdrsz += UNIAUTH_INT_SZ;
+        }
+
+        if (field->str == NULL) {
+            request_le(req->hdr + req->hdrsz,field->value,n);
+            req->hdrsz += n;
+        }
+        else {
+            if (n > 0) {
+                request_flush(req);
+                request_push(req,field->str,n);
+            }
+            if (!v2) {
+                req->hdr[req->hdrsz++] = 0;
+            }
+        }
+
+    }
+
+    if (!v2) {
+        req->hdr[req->hdrsz++] = UNIAUTH_PROTO_FIELD_END;
+    }
+    request_flush(req);
+
+    req->size = 0;
+    for (i = 0;i < req->iovcnt;++i) {
+        req->size += req->iov[i].iov_len;
+    }
+    if (v2) {
+        if (req->size > UNIAUTH_MAX_MESSAGE_V2) {
+            return false;
+        }
+        request_le(req->hdr + 4,req->size - UNIAUTH_PROTO_V2_HEADER,UNIAUTH_INT_SZ);
+        return true;
+    }
+
+    return req->size <= UNIAUTH_MAX_MESSAGE;
+}
+
+/* Shared connections: in a threaded build every thread would otherwise keep a
+ * connection of its own. With uniauth.shared_conns set, threads send their
+ * requests over a few connections shared by the whole process instead. Each
+ * request carries an ID (see UNIAUTH_FEATURE_MULTIPLEX) by which its reply is
+ * routed back. Whichever waiting thread finds nobody reading the socket reads
+ * on behalf of all of them, handing every reply to its thread, until its own
+ * reply is in; another waiting thread then takes over. One read thus often
+ * picks up the replies of several threads.
+ *
+ * A request is only in flight while its thread waits for it, so nothing in
+ * here may raise an error while holding a lock. If the daemon cannot tell
+ * requests apart, or all IDs of a connection are in use, threads go back to
+ * using their own connections.
+ */
+
+#ifdef ZTS
+
+/* Requests in flight per shared connection. An ID is the slot index plus a
+ * sequence number in the high byte, so a reply that arrives after its request
+ * was abandoned is not mistaken for the reply to the slot's next request.
+ */
+#define UNIAUTH_SHARE_SLOTS 256
+
+struct uniauth_share_slot
+{
+    bool used;
+    bool done;                 /* reply is in or the connection failed */
+    uint8_t seq;               /* high byte of the slot's request ID */
+    char* reply;               /* reply message or NULL if the connection failed */
+    size_t replySz;
+};
+
+struct uniauth_share_conn
+{
+    pthread_mutex_t lock;      /* guards everything but 'in' */
+    pthread_mutex_t sendLock;  /* held while writing a message */
+    pthread_cond_t cond;       /* a reply was routed or the reader left */
+    size_t shard;
+    int fd;
+    struct uniauth_peer peer;
+    bool broken;               /* shut down; closed once 'users' drops to 0 */
+    bool reading;              /* a thread is reading for everyone */
+    size_t users;              /* slots in use */
+    size_t next;               /* next slot to hand out */
+    struct uniauth_share_slot slots[UNIAUTH_SHARE_SLOTS];
+
+    /* Bytes read but not yet routed; only the reading thread touches them. */
+    char* in;
+    size_t inSz;
+    size_t inCap;
+};
+
+static struct uniauth_share_conn* shareConns = NULL;
+static size_t shareCount = 0;
+static size_t sharePerShard = 0;
+static size_t shareNext = 0;
+static bool shareDisabled = false;
+
+int uniauth_connect_share_init(size_t count)
+{
+    size_t i;
+    pthread_condattr_t attr;
+
+    /* Deadlines are taken from the monotonic clock. */
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr,CLOCK_MONOTONIC);
+
+    /* Each shard gets 'count' connections of its own. */
+    shareConns = pecalloc(count * shardCount,sizeof(struct uniauth_share_conn),1);
+    for (i = 0;i < count * shardCount;++i) {
+        struct uniauth_share_conn* conn = shareConns + i;
+
+        pthread_mutex_init(&conn->lock,NULL);
+        pthread_mutex_init(&conn->sendLock,NULL);
+        pthread_cond_init(&conn->cond,&attr);
+        conn->shard = i / count;
+        conn->fd = -1;
+    }
+    shareCount = count * shardCount;
+    sharePerShard = count;
+
+    pthread_condattr_destroy(&attr);
+    return 0;
+}
+
+void uniauth_connect_share_shutdown()
+{
+    size_t i;
+    int j;
+
+    for (i = 0;i < shareCount;++i) {
+        struct uniauth_share_conn* conn = shareConns + i;
+
+        if (conn->fd != -1) {
+            close(conn->fd);
+        }
+        for (j = 0;j < UNIAUTH_SHARE_SLOTS;++j) {
+            if (conn->slots[j].reply != NULL) {
+                pefree(conn->slots[j].reply,1);
+            }
+        }
+        if (conn->in != NULL) {
+            pefree(conn->in,1);
+        }
+        pthread_mutex_destroy(&conn->lock);
+        pthread_mutex_destroy(&conn->sendLock);
+        pthread_cond_destroy(&conn->cond);
+    }
+
+    if (shareConns != NULL) {
+        pefree(shareConns,1);
+        shareConns = NULL;
+    }
+    shareCount = 0;
+}
+
+size_t uniauth_connect_share_count()
+{
+    return __atomic_load_n(&shareDisabled,__ATOMIC_RELAXED) ? 0 : shareCount;
+}
+
+static inline bool uniauth_share_usable()
+{
+    /* A fiber waiting through the wait handler needs a connection it can
+     * poll on its own.
+     */
+    return uniauth_connect_share_count() > 0 && !uniauth_conn_suspendable();
+}
+
+static int uniauth_share_connect(struct uniauth_share_conn* conn)
+{
+    /* Open a shared connection. The lock is not held since the handshake may
+     * raise errors; if another thread connected in the meantime, ours is
+     * dropped.
+     */
+
+    int sock;
+    int result;
+    struct uniauth_peer peer;
+
+    sock = uniauth_connect_socket(conn->shard,&peer);
+    if (sock == -1) {
+        php_error(E_ERROR,"could not connect to uniauth daemon: %s",strerror(errno));
+        return -1;
+    }
+    peer.ring = NULL;
+
+    result = uniauth_connect_handshake(sock,&peer);
+    if (result == -1) {
+        close(sock);
+        return -1;
+    }
+    if (result != 0 || peer.version < UNIAUTH_PROTOCOL_V2
+        || (peer.features & UNIAUTH_FEATURE_MULTIPLEX) == 0)
+    {
+        /* The daemon cannot tell requests apart. */
+        close(sock);
+        __atomic_store_n(&shareDisabled,true,__ATOMIC_RELAXED);
+        return UNIAUTH_SHARE_FALLBACK;
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (conn->fd == -1) {
+        conn->fd = sock;
+        conn->peer = peer;
+        sock = -1;
+    }
+    pthread_mutex_unlock(&conn->lock);
+
+    if (sock != -1) {
+        close(sock);
+    }
+    return 0;
+}
+
+static void uniauth_share_break(struct uniauth_share_conn* conn)
+{
+    /* Fail every request in flight (with the lock held). The socket is shut
+     * down right away but only closed once no thread can be using it.
+     */
+
+    int i;
+
+    if (conn->broken) {
+        return;
+    }
+    conn->broken = true;
+    shutdown(conn->fd,SHUT_RDWR);
+    for (i = 0;i < UNIAUTH_SHARE_SLOTS;++i) {
+        if (conn->slots[i].used) {
+            conn->slots[i].done = true;
+        }
+    }
+    pthread_cond_broadcast(&conn->cond);
+}
+
+static void uniauth_share_leave(struct uniauth_share_conn* conn,
+    struct uniauth_share_slot* slot)
+{
+    /* Give up a slot (with the lock held). */
+    if (slot->reply != NULL) {
+        pefree(slot->reply,1);
+        slot->reply = NULL;
+    }
+    slot->used = false;
+    slot->done = false;
+
+    conn->users -= 1;
+    if (conn->broken && conn->users == 0) {
+        close(conn->fd);
+        conn->fd = -1;
+        conn->broken = false;
+        conn->inSz = 0;
+    }
+}
+
+static int uniauth_share_poll(int fd,short events,uint64_t deadline)
+{
+    /* Returns 0 once the socket may be ready, 1 on timeout or -1 if polling
+     * failed.
+     */
+
+    int r;
+    int timeout = -1;
+    struct pollfd pollInfo;
+
+    if (deadline != 0) {
+        uint64_t now = uniauth_clock_ms();
+
+        if (now >= deadline) {
+            return 1;
+        }
+        timeout = (int)(deadline - now);
+    }
+
+    pollInfo.fd = fd;
+    pollInfo.events = events;
+    pollInfo.revents = 0;
+    r = poll(&pollInfo,1,timeout);
+    if (r == 0) {
+        return 1;
+    }
+    if (r == -1 && errno != EINTR) {
+        return -1;
+    }
+    return 0;
+}
+
+static int uniauth_share_write(int fd,const char* buffer,size_t sz,bool packet,
+    uint64_t deadline)
+{
+    /* Write a whole message (with the send lock held). Returns 0 on success,
+     * 1 on timeout and -1 if the connection failed, or UNIAUTH_CONN_LOST if
+     * it failed before anything was written.
+     */
+
+    size_t total = sz;
+
+    while (sz > 0) {
+        size_t n = (packet && sz > UNIAUTH_MAX_PACKET) ? UNIAUTH_MAX_PACKET : sz;
+        ssize_t r = send(fd,buffer,n,MSG_DONTWAIT | MSG_NOSIGNAL);
+
+        if (r == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                int status = uniauth_share_poll(fd,POLLOUT,deadline);
+
+                if (status != 0) {
+                    return status;
+                }
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (sz == total && uniauth_conn_lost_errno(errno)) {
+                return UNIAUTH_CONN_LOST;
+            }
+            return -1;
+        }
+
+        buffer += r;
+        sz -= r;
+    }
+
+    return 0;
+}
+
+static int uniauth_share_recv(struct uniauth_share_conn* conn,int fd,
+    uint64_t deadline)
+{
+    /* Read whatever has arrived (as the reading thread, without the lock).
+     * Returns 0 once something was read, 1 on timeout and -1 if the
+     * connection failed.
+     */
+
+    size_t need = conn->inSz + UNIAUTH_MAX_PACKET;
+    size_t room;
+
+    /* Make room for the rest of the message if its length is known. A read
+     * from a packet connection returns a whole packet, which must fit.
+     */
+    if (conn->inSz >= UNIAUTH_PROTO_V2_HEADER) {
+        size_t total = UNIAUTH_PROTO_V2_HEADER + load_le32(conn->in + 4);
+
+        if (total > need) {
+            need = total;
+        }
+    }
+    if (need > conn->inCap) {
+        conn->in = perealloc(conn->in,need,1);
+        conn->inCap = need;
+    }
+    room = conn->inCap - conn->inSz;
+
+    while (true) {
+        int flags = MSG_DONTWAIT | (conn->peer.packet ? MSG_TRUNC : 0);
+        ssize_t r = recv(fd,conn->in + conn->inSz,room,flags);
+
+        if (r > 0) {
+            if ((size_t)r > room) {
+                return -1;
+            }
+            conn->inSz += r;
+            return 0;
+        }
+        if (r == 0) {
+            return -1;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            int status = uniauth_share_poll(fd,POLLIN,deadline);
+
+            if (status != 0) {
+                return status;
+            }
+        }
+        else if (errno != EINTR) {
+            return -1;
+        }
+    }
+}
+
+static int uniauth_share_route(struct uniauth_share_conn* conn)
+{
+    /* Hand each complete reply to the thread waiting for it (with the lock
+     * held). Replies nobody waits for any more are dropped. Returns -1 if the
+     * daemon sent garbage.
+     */
+
+    size_t pos = 0;
+
+    while (conn->inSz - pos >= UNIAUTH_PROTO_V2_HEADER) {
+        const char* msg = conn->in + pos;
+        size_t n = load_le32(msg + 4);
+        unsigned id = (unsigned char)msg[2] | (unsigned)(unsigned char)msg[3] << 8;
+        struct uniauth_share_slot* slot = conn->slots + id % UNIAUTH_SHARE_SLOTS;
+
+        if (n > UNIAUTH_MAX_MESSAGE_V2 - UNIAUTH_PROTO_V2_HEADER) {
+            return -1;
+        }
+        n += UNIAUTH_PROTO_V2_HEADER;
+        if (conn->inSz - pos < n) {
+            break;
+        }
+
+        if (slot->used && !slot->done && slot->seq == id / UNIAUTH_SHARE_SLOTS) {
+            slot->reply = pemalloc(n,1);
+            slot->replySz = n;
+            memcpy(slot->reply,msg,n);
+            slot->done = true;
+        }
+        pos += n;
+    }
+
+    conn->inSz -= pos;
+    memmove(conn->in,conn->in + pos,conn->inSz);
+    return 0;
+}
+
+static int uniauth_share_sleep(struct uniauth_share_conn* conn,uint64_t deadline)
+{
+    struct timespec ts;
+
+    if (deadline == 0) {
+        pthread_cond_wait(&conn->cond,&conn->lock);
+        return 0;
+    }
+
+    ts.tv_sec = deadline / 1000;
+    ts.tv_nsec = (long)(deadline % 1000) * 1000000;
+    return pthread_cond_timedwait(&conn->cond,&conn->lock,&ts) == ETIMEDOUT ? 1 : 0;
+}
+
+static int uniauth_share_wait(struct uniauth_share_conn* conn,
+    struct uniauth_share_slot* slot,int fd,uint64_t deadline)
+{
+    /* Wait for the reply to a request (with the lock held). If no thread is
+     * reading from the connection, this one does until its reply is in.
+     * Returns 0 once the slot is done or 1 on timeout.
+     */
+
+    int status;
+
+    while (!slot->done) {
+        if (conn->reading) {
+            if (uniauth_share_sleep(conn,deadline) == 1 && !slot->done) {
+                return 1;
+            }
+            continue;
+        }
+
+        conn->reading = true;
+        pthread_mutex_unlock(&conn->lock);
+        status = uniauth_share_recv(conn,fd,deadline);
+        pthread_mutex_lock(&conn->lock);
+        conn->reading = false;
+
+        if (status == 0) {
+            status = uniauth_share_route(conn);
+        }
+        if (status == -1) {
+            uniauth_share_break(conn);
+        }
+
+        /* Wake the others: their replies may be in, or one of them must take
+         * over reading.
+         */
+        pthread_cond_broadcast(&conn->cond);
+        if (status == 1 && !slot->done) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+static int uniauth_share_transact(struct uniauth_request* req,
+    struct uniauth_storage* record,bool idempotent)
+{
+    /* Like uniauth_transact() over a shared connection. UNIAUTH_SHARE_FALLBACK
+     * is returned without sending anything if the thread must use its own
+     * connection instead.
+     */
+
+    int i;
+    int fd;
+    int status;
+    unsigned id;
+    bool retried = false;
+    uint64_t deadline;
+    char local[UNIAUTH_MAX_MESSAGE];
+    char* msg;
+    char* iter;
+    char* reply;
+    size_t replySz;
+    struct uniauth_share_conn* conn;
+    struct uniauth_share_slot* slot;
+    struct uniauth_peer peer;
+    struct uniauth_parser parser;
+
+    if (uniauth_deadline_begin(&deadline) == -1) {
+        return -1;
+    }
+
+    conn = shareConns + request_shard(req) * sharePerShard
+        + __atomic_fetch_add(&shareNext,1,__ATOMIC_RELAXED) % sharePerShard;
+    while (true) {
+        /* Take a slot, connecting first if needed. */
+        pthread_mutex_lock(&conn->lock);
+        if (conn->fd == -1) {
+            pthread_mutex_unlock(&conn->lock);
+            status = uniauth_share_connect(conn);
+            if (status != 0) {
+                return status;
+            }
+            continue;
+        }
+
+        slot = NULL;
+        for (i = 0;i < UNIAUTH_SHARE_SLOTS && !conn->broken;++i) {
+            struct uniauth_share_slot* cand = conn->slots
+                + (conn->next + i) % UNIAUTH_SHARE_SLOTS;
+
+            if (!cand->used) {
+                slot = cand;
+                break;
+            }
+        }
+        if (slot == NULL) {
+            pthread_mutex_unlock(&conn->lock);
+            return UNIAUTH_SHARE_FALLBACK;
+        }
+
+        slot->used = true;
+        slot->done = false;
+        slot->seq = (slot->seq == 0xff) ? 1 : slot->seq + 1;
+        id = slot->seq * UNIAUTH_SHARE_SLOTS + (unsigned)(slot - conn->slots);
+        conn->next = (slot - conn->slots + 1) % UNIAUTH_SHARE_SLOTS;
+        conn->users += 1;
+        fd = conn->fd;
+        peer = conn->peer;
+        pthread_mutex_unlock(&conn->lock);
+
+        /* Let the caller fall back if the daemon lacks the operation. */
+        if ((req->feature & ~peer.features) != 0 || !request_encode(req,&peer)) {
+            pthread_mutex_lock(&conn->lock);
+            uniauth_share_leave(conn,slot);
+            pthread_mutex_unlock(&conn->lock);
+            if ((req->feature & ~peer.features) != 0) {
+                return UNIAUTH_UNSUPPORTED;
+            }
+            php_error(E_ERROR,"protocol message is too large");
+            return -1;
+        }
+
+        /* Tag the message with the ID and write it in one piece so it does not
+         * interleave with those of other threads.
+         */
+        request_le(req->hdr + 2,id,2);
+        msg = (req->size > sizeof(local)) ? emalloc(req->size) : local;
+        iter = msg;
+        for (i = 0;i < req->iovcnt;++i) {
+            memcpy(iter,req->iov[i].iov_base,req->iov[i].iov_len);
+            iter += req->iov[i].iov_len;
+        }
+
+        pthread_mutex_lock(&conn->sendLock);
+        status = uniauth_share_write(fd,msg,req->size,peer.packet,deadline);
+        pthread_mutex_unlock(&conn->sendLock);
+        if (msg != local) {
+            efree(msg);
+        }
+
+        /* A message that did not go out whole leaves the stream unusable. */
+        pthread_mutex_lock(&conn->lock);
+        if (status == 0) {
+            status = uniauth_share_wait(conn,slot,fd,deadline);
+        }
+        else {
+            uniauth_share_break(conn);
+        }
+        reply = slot->reply;
+        replySz = slot->replySz;
+        slot->reply = NULL;
+        uniauth_share_leave(conn,slot);
+        pthread_mutex_unlock(&conn->lock);
+
+        if (status == 1) {
+            return uniauth_timed_out();
+        }
+        if (reply != NULL) {
+            break;
+        }
+
+        /* The connection failed. Try once more over a new one, provided that
+         * cannot apply the request twice.
+         */
+        if (retried || (status != UNIAUTH_CONN_LOST && !idempotent)) {
+            php_error(E_ERROR,"connection to uniauth daemon lost");
+            return -1;
+        }
+        retried = true;
+    }
+
+    parser_init(&parser,record,&peer);
+    status = parser_feed(&parser,reply,replySz);
+    pefree(reply,1);
+    if (status != 0) {
+        parser_abort(&parser);
+        php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+        return -1;
+    }
+
+    return parser.kind;
+}
+
+#else
+
+static inline bool uniauth_share_usable()
+{
+    return false;
+}
+
+static inline int uniauth_share_transact(struct uniauth_request* req,
+    struct uniauth_storage* record,bool idempotent)
+{
+    return UNIAUTH_SHARE_FALLBACK;
+}
+
+#endif
+
+static int embedded_transact(const struct uniauth_request* req,
+    struct uniauth_storage* record)
+{
+    /* Perform a request against the embedded backend instead of the daemon.
+     * The backend works with the same fields, so they are simply handed over.
+     */
+
+    int i;
+    struct uniauth_embedded_op op;
+
+    if ((req->feature & ~UNIAUTH_EMBEDDED_FEATURES) != 0) {
+        return UNIAUTH_UNSUPPORTED;
+    }
+
+    memset(&op,0,sizeof(struct uniauth_embedded_op));
+    op.op = req->op;
+    for (i = 0;i < req->nfields;++i) {
+        const struct uniauth_request_field* field = req->fields + i;
+        uint32_t bit = UNIAUTH_FIELD_BIT(field->type);
+
+        switch (field->type) {
+        case UNIAUTH_PROTO_FIELD_KEY:
+            op.key = field->str;
+            op.keySz = field->len;
+            continue;
+        case UNIAUTH_PROTO_FIELD_TRANSSRC:
+            op.src = field->str;
+            op.srcSz = field->len;
+            continue;
+        case UNIAUTH_PROTO_FIELD_TRANSDST:
+            op.dst = field->str;
+            op.dstSz = field->len;
+            continue;
+        case UNIAUTH_PROTO_FIELD_USER:
+            op.fields.username = (char*)field->str;
+            op.fields.usernameSz = field->len;
+            break;
+        case UNIAUTH_PROTO_FIELD_DISPLAY:
+            op.fields.displayName = (char*)field->str;
+            op.fields.displayNameSz = field->len;
+            break;
+        case UNIAUTH_PROTO_FIELD_REDIRECT:
+            op.fields.redirect = (char*)field->str;
+            op.fields.redirectSz = field->len;
+            break;
+        case UNIAUTH_PROTO_FIELD_TAG:
+            op.fields.tag = (char*)field->str;
+            op.fields.tagSz = field->len;
+            break;
+        case UNIAUTH_PROTO_FIELD_ID:
+            op.fields.id = (int32_t)field->value;
+            break;
+        case UNIAUTH_PROTO_FIELD_EXPIRE:
+            op.fields.expire = field->value;
+            break;
+        case UNIAUTH_PROTO_FIELD_LIFETIME:
+            op.fields.lifetime = (int32_t)field->value;
+            break;
+        case UNIAUTH_PROTO_FIELD_THRESHOLD:
+            op.threshold = (int32_t)field->value;
+            continue;
+        case UNIAUTH_PROTO_FIELD_REVISION:
+            op.revision = field->value;
+            continue;
+        default:
+            /* E.g. a projection mask: replies always hold whole records. */
+            continue;
+        }
+
+        if (field->clear) {
+            op.cleared |= bit;
+        }
+        else {
+            op.present |= bit;
+        }
+    }
+
+    return uniauth_embedded_exec(&op,record);
+}
+
+static int uniauth_transact(struct uniauth_request* req,
+    struct uniauth_storage* record,bool idempotent)
+{
+    /* Send the request message to the uniauth daemon and wait for the complete
+     * reply. If the reply is a record, its fields are decoded into 'record'
+     * (if not NULL) as they arrive. The kind of reply is returned, or -1 if an
+     * error was raised. UNIAUTH_UNSUPPORTED is returned without sending
+     * anything if the request needs an optional operation that the daemon did
+     * not advertise.
+     *
+     * If the connection turns out to be dead we reconnect and try once more,
+     * provided that cannot apply the request twice: either nothing was sent,
+     * or the operation is idempotent.
+     */
+
+    int sock;
+    int status;
+    bool sent;
+    bool retried = false;
+    size_t shard;
+    uint64_t deadline;
+    struct uniauth_peer peer;
+    struct uniauth_parser parser;
+    struct uniauth_buffer buf;
+
+    if (uniauth_embedded_active()) {
+        return embedded_transact(req,record);
+    }
+    if (uniauth_share_usable()) {
+        status = uniauth_share_transact(req,record,idempotent);
+        if (status != UNIAUTH_SHARE_FALLBACK) {
+            return status;
+        }
+    }
+    if (uniauth_deadline_begin(&deadline) == -1) {
+        return -1;
+    }
+
+    shard = request_shard(req);
+    buffer_init(&buf);
+    while (true) {
+        sock = uniauth_conn_acquire(&peer,shard);
+        if (sock == -1) {
+            buffer_free(&buf);
+            return -1;
+        }
+
+        /* Let the caller fall back if the daemon lacks the operation. */
+        if ((req->feature & ~peer.features) != 0) {
+            uniauth_conn_release(sock,false);
+            buffer_free(&buf);
+            return UNIAUTH_UNSUPPORTED;
+        }
+
+        if (!request_encode(req,&peer)) {
+            uniauth_conn_release(sock,false);
+            buffer_free(&buf);
+            php_error(E_ERROR,"protocol message is too large");
+            return -1;
+        }
+        if (peer.ring != NULL) {
+            status = uniauth_ring_sendv(sock,peer.ring,req->iov,req->iovcnt,deadline);
+        }
+        else {
+            status = uniauth_connect_sendv(sock,req->iov,req->iovcnt,
+                peer.packet ? UNIAUTH_MAX_PACKET : 0,deadline);
+        }
+        sent = (status == 0);
+
+        /* Wait for and read the response. Hopefully this loop should never
+         * reiterate.
+         */
+        buf.size = 0;
+        parser_init(&parser,record,&peer);
+        while (status == 0 || status == 1) {
+            status = uniauth_connect_recv(sock,&buf,&parser,deadline);
+            if (status == 0) {
+                uniauth_conn_release(sock,false);
+                buffer_free(&buf);
+                return parser.kind;
+            }
+        }
+
+        uniauth_conn_release(sock,true);
+        parser_abort(&parser);
+        if (status != UNIAUTH_CONN_LOST || retried || (sent && !idempotent)) {
+            break;
+        }
+        retried = true;
+    }
+    buffer_free(&buf);
+
+    if (status == 2) {
+        php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+    }
+    else if (status == UNIAUTH_CONN_LOST) {
+        php_error(E_ERROR,"connection to uniauth daemon lost");
+    }
+    return -1;
+}
+
+static int uniauth_connect_handshake(int sock,struct uniauth_peer* peer)
+{
+    /* Negotiate the protocol version for a new connection and find out which
+     * optional operations the daemon supports. The exchange itself uses
+     * version 1. UNIAUTH_CONN_LOST is returned if the daemon hung up on us.
+     */
+
+    int status;
+    uint64_t deadline;
+    struct uniauth_request req;
+    struct uniauth_parser parser;
+    struct uniauth_buffer buf;
+
+    peer->version = UNIAUTH_PROTOCOL_V1;
+    peer->features = 0;
+    if (UNIAUTH_G(protocol) < UNIAUTH_PROTOCOL_V2 || UNIAUTH_G(protocolFallback)) {
+        return 0;
+    }
+    if (uniauth_deadline_begin(&deadline) == -1) {
+        return -1;
+    }
+
+    request_init(&req,UNIAUTH_PROTO_HELLO);
+    request_field_integer(&req,UNIAUTH_PROTO_FIELD_VERSION,UNIAUTH_PROTOCOL_V2);
+    request_encode(&req,peer);
+
+    buffer_init(&buf);
+    parser_init(&parser,NULL,peer);
+    status = uniauth_connect_sendv(sock,req.iov,req.iovcnt,
+        peer->packet ? UNIAUTH_MAX_PACKET : 0,deadline);
+    if (status == 0) {
+        do {
+            status = uniauth_connect_recv(sock,&buf,&parser,deadline);
+        } while (status == 1);
+    }
+    buffer_free(&buf);
+
+    if (status == 0) {
+        /* Anything but a record means the daemon does not know HELLO. */
+        if (parser.kind == UNIAUTH_PROTO_RESPONSE_RECORD) {
+            if (parser.version >= UNIAUTH_PROTOCOL_V2) {
+                peer->version = UNIAUTH_PROTOCOL_V2;
+            }
+            peer->features = parser.features;
+        }
+        return 0;
+    }
+    if (status == 2) {
+        php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+        return -1;
+    }
+    return status;
+}
+
+static int uniauth_connect_ring(int sock,struct uniauth_peer* peer)
+{
+    /* Move a new connection to the ring transport if it is enabled and the
+     * daemon offers it. The reply to RING carries the descriptor of the
+     * segment. If the daemon declines, the connection stays on the socket.
+     */
+
+    int fd = -1;
+    int status;
+    uint64_t deadline;
+    struct uniauth_request req;
+    struct uniauth_parser parser;
+    struct uniauth_buffer buf;
+
+    if (!UNIAUTH_G(shmRing) || (peer->features & UNIAUTH_FEATURE_SHM_RING) == 0) {
         return 0;
     }
+    if (uniauth_deadline_begin(&deadline) == -1) {
+        return -1;
+    }
+
+    request_init(&req,UNIAUTH_PROTO_RING);
+    request_encode(&req,peer);
+
+    buffer_init(&buf);
+    parser_init(&parser,NULL,peer);
+    status = uniauth_connect_sendv(sock,req.iov,req.iovcnt,
+        peer->packet ? UNIAUTH_MAX_PACKET : 0,deadline);
+    if (status == 0) {
+        do {
+            status = uniauth_connect_recvfd(sock,&buf,&parser,deadline,&fd);
+        } while (status == 1);
+    }
+    buffer_free(&buf);
+
+    /* The daemon has switched over once it replied with a message, so we
+     * cannot carry on without the segment.
+     */
+    if (status == 0 && parser.kind == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+        errno = EPROTO;
+        if (fd == -1 || (peer->ring = uniauth_ring_attach(fd)) == NULL) {
+            php_error(E_ERROR,"could not map uniauth daemon ring: %s",strerror(errno));
+            status = -1;
+        }
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+
+    if (status == 2) {
+        php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+        return -1;
+    }
+    if (status == UNIAUTH_CONN_LOST) {
+        php_error(E_ERROR,"connection to uniauth daemon lost");
+        return -1;
+    }
+    return status;
+}
+
+/* Lookup helpers shared by the single and pipelined lookup operations */
+
+static bool lookup_cached(const char* key,size_t keylen,uint32_t fields,
+    struct uniauth_storage* backing,struct uniauth_storage** result)
+{
+    struct uniauth_cache_entry* entry;
+
+    /* If a prefetch is in flight, its reply may well be for this key. If
+     * that fails (e.g. it timed out) we give up on this lookup as well.
+     */
+    if (UNIAUTH_G(prefetchKey) != NULL && uniauth_prefetch_complete() == -1) {
+        *result = NULL;
+        return true;
+    }
+
+    /* Serve the lookup from the request cache if we have seen the key
+     * before (with the fields we need).
+     */
+    entry = uniauth_cache_find(key,keylen);
+    if (entry != NULL && (!entry->found || (entry->fields & fields) == fields)) {
+        UNIAUTH_G(cacheHits) += 1;
+        if (!entry->found) {
+            *result = NULL;
+            return true;
+        }
+        uniauth_storage_copy(backing,&entry->stor);
+        *result = backing;
+        return true;
+    }
+    UNIAUTH_G(cacheMisses) += 1;
+
+    /* Next try the cache shared with the other workers (if enabled). */
+    if (uniauth_shmcache_active()) {
+        if (uniauth_shmcache_lookup(key,keylen,backing)) {
+            UNIAUTH_G(shmHits) += 1;
+            uniauth_cache_store(key,keylen,backing,UNIAUTH_FIELDS_RECORD);
+            *result = backing;
+            return true;
+        }
+        UNIAUTH_G(shmMisses) += 1;
+    }
+
+    return false;
+}
+
+static struct uniauth_storage* lookup_reply(const char* key,size_t keylen,
+    int kind,struct uniauth_storage* backing,uint64_t generation,
+    uint32_t fields)
+{
+    /* An error response always means the record was not found. */
+    if (kind != UNIAUTH_PROTO_RESPONSE_RECORD) {
+        uniauth_cache_store(key,keylen,NULL,UNIAUTH_FIELDS_RECORD);
+        return NULL;
+    }
+
+    /* The fields were already decoded into the uniauth_storage buffer provided
+     * while the reply was read. A record stored under a digest comes back
+     * without its key, so give it the caller's: later writes need it. Return a
+     * pointer to it that indicates success. Only whole records are shared with
+     * other workers.
+     */
+    if (backing->key == NULL) {
+        backing->key = uniauth_field_new(key,keylen);
+        backing->keySz = keylen;
+    }
+    uniauth_cache_store(key,keylen,backing,fields);
+    if (fields == UNIAUTH_FIELDS_RECORD) {
+        uniauth_shmcache_store(key,keylen,backing,generation);
+    }
+    return backing;
+}
+
+static bool lookup_revalidate(const char* key,size_t keylen,
+    struct uniauth_storage* backing,uint64_t generation,
+    struct uniauth_storage** result)
+{
+    int kind;
+    struct uniauth_request req;
+    struct uniauth_storage current;
+
+    /* A shared cache entry that has gone stale can be revalidated by revision
+     * instead of fetching the record again.
+     */
+    if (!uniauth_shmcache_lookup_stale(key,keylen,backing)) {
+        return false;
+    }
+
+    request_init(&req,UNIAUTH_PROTO_LOOKUP_IF_CHANGED);
+    req.feature = UNIAUTH_FEATURE_IF_CHANGED;
+    request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,key,keylen);
+    request_field_time(&req,UNIAUTH_PROTO_FIELD_REVISION,backing->revision);
+    kind = uniauth_transact(&req,&current,true);
+
+    if (kind == UNIAUTH_PROTO_RESPONSE_NOT_MODIFIED) {
+        uniauth_cache_store(key,keylen,backing,UNIAUTH_FIELDS_RECORD);
+        uniauth_shmcache_store(key,keylen,backing,generation);
+        *result = backing;
+        return true;
+    }
+
+    uniauth_storage_delete(backing);
+    if (kind == UNIAUTH_UNSUPPORTED) {
+        return false;
+    }
+    if (kind == -1) {
+        *result = NULL;
+        return true;
+    }
+
+    /* Otherwise the reply is the current record (if any). */
+    *backing = current;
+    *result = lookup_reply(key,keylen,kind,backing,generation,
+        UNIAUTH_FIELDS_RECORD);
+    return true;
+}
+
+/* Connect API implementations */
+
+struct uniauth_storage* uniauth_connect_lookup(const char* key,size_t keylen,
+    struct uniauth_storage* backing)
+{
+    return uniauth_connect_lookup_fields(key,keylen,backing,UNIAUTH_FIELDS_RECORD);
+}
+
+struct uniauth_storage* uniauth_connect_lookup_fields(const char* key,
+    size_t keylen,struct uniauth_storage* backing,uint32_t fields)
+{
+    int kind;
+    struct uniauth_request req;
+    struct uniauth_storage* result;
+    uint64_t generation;
+
+    /* Serve the lookup from one of the caches if possible. */
+    if (lookup_cached(key,keylen,fields,backing,&result)) {
+        return result;
+    }
+    generation = uniauth_shmcache_generation();
+    if (lookup_revalidate(key,keylen,backing,generation,&result)) {
+        return result;
+    }
+
+    /* Perform a lookup on the remote uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_LOOKUP);
+    request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,key,keylen);
+    request_field_mask(&req,fields);
+    kind = uniauth_transact(&req,backing,true);
+    if (kind == -1) {
+        return NULL;
+    }
+
+    return lookup_reply(key,keylen,kind,backing,generation,
+        request_projection(&req,fields));
+}
+
+struct uniauth_storage* uniauth_connect_lookup_touch(const char* key,
+    size_t keylen,struct uniauth_storage* backing,int32_t lifetime,
+    int32_t threshold,uint32_t fields,bool* touched)
+{
+    int kind;
+    struct uniauth_request req;
+    struct uniauth_storage* result;
+    uint64_t generation;
+
+    /* A cached record was not touched: the caller has to do it. */
+    *touched = false;
+    if (lookup_cached(key,keylen,fields,backing,&result)) {
+        return result;
+    }
+    generation = uniauth_shmcache_generation();
 
-    /* Anything else is an error. */
-    return -1;
+    /* Have the daemon apply the touch policy while it looks up the record.
+     * Reapplying it is harmless, so the request is safe to retry.
+     */
+    request_init(&req,UNIAUTH_PROTO_LOOKUP_TOUCH);
+    req.feature = UNIAUTH_FEATURE_LOOKUP_TOUCH;
+    request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,key,keylen);
+    request_field_integer(&req,UNIAUTH_PROTO_FIELD_LIFETIME,lifetime);
+    request_field_integer(&req,UNIAUTH_PROTO_FIELD_THRESHOLD,threshold);
+    request_field_mask(&req,fields);
+    kind = uniauth_transact(&req,backing,true);
+
+    if (kind == UNIAUTH_UNSUPPORTED) {
+        request_init(&req,UNIAUTH_PROTO_LOOKUP);
+        request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,key,keylen);
+        request_field_mask(&req,fields);
+        kind = uniauth_transact(&req,backing,true);
+    }
+    else if (kind == UNIAUTH_PROTO_RESPONSE_RECORD) {
+        *touched = true;
+    }
+    if (kind == -1) {
+        return NULL;
+    }
+
+    return lookup_reply(key,keylen,kind,backing,generation,
+        request_projection(&req,fields));
 }
 
-int uniauth_connect_create(struct uniauth_storage* stor)
+/* Prefetch: at request startup we may already know the session key that the
+ * script is about to look up. The LOOKUP is sent right away without waiting
+ * for the reply, which is consumed into the request cache by the first
+ * operation that needs the connection. The daemon round trip thus overlaps
+ * with whatever the script does before its first uniauth call.
+ */
+
+void uniauth_connect_prefetch(const char* key,size_t keylen)
+{
+    int sock = UNIAUTH_G(conn);
+    size_t shard;
+    struct uniauth_peer peer;
+    struct uniauth_request req;
+    struct msghdr msg;
+    ssize_t r;
+    struct uniauth_storage local;
+    struct uniauth_storage* result;
+    uint64_t generation;
+
+    /* A prefetch is only a hint, so it never raises errors and only uses an
+     * established connection: connecting means negotiating the protocol,
+     * which could fail loudly. If the daemon cannot be reached the script
+     * will find out when it asks for real. So the first request of a worker
+     * (or the first one after the connection was lost) does not prefetch.
+     * The connection must also go to the key's shard; an idle connection to
+     * it is switched to.
+     */
+    if (UNIAUTH_G(prefetchKey) != NULL || UNIAUTH_G(connBusy)) {
+        return;
+    }
+    shard = uniauth_shard_of(key,keylen);
+    if (sock == -1 || UNIAUTH_G(connShard) != shard) {
+        if (uniauth_shard_conn(shard)->fd == -1) {
+            return;
+        }
+        sock = uniauth_connect(&peer,shard);
+    }
+    if (lookup_cached(key,keylen,UNIAUTH_FIELDS_RECORD,&local,&result)) {
+        if (result != NULL) {
+            uniauth_storage_delete(result);
+        }
+        return;
+    }
+    generation = uniauth_shmcache_generation();
+
+    request_init(&req,UNIAUTH_PROTO_LOOKUP);
+    request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,key,keylen);
+    uniauth_conn_peer(&peer);
+    if (!request_encode(&req,&peer)) {
+        return;
+    }
+    if (peer.packet && req.size > UNIAUTH_MAX_PACKET) {
+        /* Would take more than one packet and thus might not go out whole. */
+        return;
+    }
+
+    if (peer.ring != NULL) {
+        int j;
+
+        /* The message must fit whole, as with the socket. */
+        if (uniauth_ring_space(peer.ring) < req.size) {
+            return;
+        }
+        for (j = 0;j < req.iovcnt;++j) {
+            uniauth_ring_write(peer.ring,req.iov[j].iov_base,req.iov[j].iov_len);
+        }
+    }
+    else {
+        memset(&msg,0,sizeof(struct msghdr));
+        msg.msg_iov = req.iov;
+        msg.msg_iovlen = req.iovcnt;
+
+        do {
+            r = sendmsg(sock,&msg,MSG_DONTWAIT | MSG_NOSIGNAL);
+        } while (r == -1 && errno == EINTR);
+        if (r != (ssize_t)req.size) {
+            /* A partial message would corrupt the stream. A lost connection
+             * is replaced by the next operation.
+             */
+            if (r > 0 || (r == -1 && uniauth_conn_lost_errno(errno))) {
+                close(sock);
+                UNIAUTH_G(conn) = -1;
+            }
+            return;
+        }
+    }
+
+    UNIAUTH_G(connBusy) = true;
+    UNIAUTH_G(prefetchKey) = estrndup(key,keylen);
+    UNIAUTH_G(prefetchKeySz) = keylen;
+    UNIAUTH_G(prefetchGeneration) = generation;
+}
+
+static int uniauth_prefetch_complete()
+{
+    int sock = UNIAUTH_G(conn);
+    int status;
+    struct uniauth_buffer buf;
+    char* key = UNIAUTH_G(prefetchKey);
+    size_t keylen = UNIAUTH_G(prefetchKeySz);
+    struct uniauth_storage local;
+    struct uniauth_storage* result;
+    struct uniauth_peer peer;
+    struct uniauth_parser parser;
+    uint64_t deadline = uniauth_deadline();
+
+    /* Take ownership of the pending reply so that no other caller (e.g. a
+     * fiber running while this one waits) tries to consume it too.
+     */
+    UNIAUTH_G(prefetchKey) = NULL;
+
+    buffer_init(&buf);
+    uniauth_conn_peer(&peer);
+    parser_init(&parser,&local,&peer);
+    do {
+        status = uniauth_connect_recv(sock,&buf,&parser,deadline);
+
+        /* If the connection dropped, the lookup will simply be redone. */
+        if (status == UNIAUTH_CONN_LOST) {
+            uniauth_conn_release(sock,true);
+            buffer_free(&buf);
+            efree(key);
+            return 0;
+        }
+
+        if (status == -1 || status == 2) {
+            uniauth_conn_release(sock,true);
+            parser_abort(&parser);
+            buffer_free(&buf);
+            efree(key);
+            if (status == 2) {
+                php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+            }
+            return -1;
+        }
+    } while (status != 0);
+    uniauth_conn_release(sock,false);
+    buffer_free(&buf);
+
+    result = lookup_reply(key,keylen,parser.kind,&local,
+        UNIAUTH_G(prefetchGeneration),UNIAUTH_FIELDS_RECORD);
+    if (result != NULL) {
+        uniauth_storage_delete(result);
+    }
+    efree(key);
+
+    return 0;
+}
+
+static void uniauth_prefetch_drain()
+{
+    int sock = UNIAUTH_G(conn);
+    int status = 1;
+    struct uniauth_buffer buf;
+    struct uniauth_peer peer;
+    struct uniauth_parser parser;
+    uint64_t deadline = uniauth_deadline();
+    struct pollfd pollInfo;
+
+    /* Read and discard the reply to an unused prefetch. This runs at request
+     * shutdown so it must not raise errors; on any failure (or timeout) the
+     * connection is closed instead.
+     */
+    efree(UNIAUTH_G(prefetchKey));
+    UNIAUTH_G(prefetchKey) = NULL;
+
+    buffer_init(&buf);
+    uniauth_conn_peer(&peer);
+    parser_init(&parser,NULL,&peer);
+    while (status == 1) {
+        ssize_t r;
+
+        buffer_prepare(&buf,&parser);
+        if (buf.size >= buf.cap) {
+            status = 2;
+            break;
+        }
+
+        if (peer.ring != NULL) {
+            r = uniauth_ring_read(peer.ring,buf.data+buf.size,buf.cap-buf.size);
+            if (r == 0) {
+                int timeout = UNIAUTH_RING_CHECK_MS;
+
+                if (deadline != 0) {
+                    uint64_t now = uniauth_clock_ms();
+
+                    if (now >= deadline) {
+                        status = 2;
+                        break;
+                    }
+                    if (deadline - now < (uint64_t)timeout) {
+                        timeout = (int)(deadline - now);
+                    }
+                }
+
+                /* See uniauth_ring_io_wait(). */
+                if (uniauth_ring_wait(peer.ring,false,timeout) == 1) {
+                    pollInfo.fd = sock;
+                    pollInfo.events = POLLIN;
+                    pollInfo.revents = 0;
+                    if (poll(&pollInfo,1,0) == 1) {
+                        status = 2;
+                        break;
+                    }
+                }
+                continue;
+            }
+        }
+        else {
+            r = recv(sock,buf.data+buf.size,buf.cap-buf.size,MSG_DONTWAIT);
+        }
+
+        if (r == -1 && errno == EINTR) {
+            continue;
+        }
+        if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            int timeout = -1;
+
+            if (deadline != 0) {
+                uint64_t now = uniauth_clock_ms();
+
+                if (now >= deadline) {
+                    status = 2;
+                    break;
+                }
+                timeout = (int)(deadline - now);
+            }
+
+            pollInfo.fd = sock;
+            pollInfo.events = POLLIN;
+            pollInfo.revents = 0;
+            if (poll(&pollInfo,1,timeout) == 0) {
+                status = 2;
+                break;
+            }
+            continue;
+        }
+        if (r <= 0) {
+            status = 2;
+            break;
+        }
+        buf.size += r;
+        status = parser_feed(&parser,buf.data,buf.size);
+    }
+
+    uniauth_conn_release(sock,status != 0 || parser.pos != buf.size);
+    buffer_free(&buf);
+}
+
+/* Pipelined lookups are sent in batches of roughly this many bytes. A batch
+ * is small enough to sit in the socket buffer (or request ring), so the daemon
+ * can always drain it while we are not yet reading its replies.
+ */
+#define UNIAUTH_PIPELINE_BATCH 16384
+
+static int lookup_many_next(int sock,struct uniauth_buffer* buf,
+    struct uniauth_parser* parser,uint64_t deadline)
+{
+    /* Make sure the receive buffer begins with a complete message, reading
+     * more from the socket as needed. Several replies may arrive in a single
+     * read, so first parse what is left over from the previous one.
+     */
+
+    int status = parser_feed(parser,buf->data,buf->size);
+
+    while (status == 1) {
+        status = uniauth_connect_recv(sock,buf,parser,deadline);
+    }
+
+    if (status == 2) {
+        php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+        return -1;
+    }
+    return status;
+}
+
+int uniauth_connect_lookup_many(size_t count,const char** keys,
+    const size_t* keylens,struct uniauth_storage* backing,
+    struct uniauth_storage** results)
 {
     int sock;
     int status;
-    char buffer[UNIAUTH_MAX_MESSAGE];
-    size_t iter = 1;
-    size_t sz = 0;
+    size_t i;
+    size_t first;
+    size_t batch;
+    size_t npending = 0;
+    size_t shard;
+    bool retried = false;
+    size_t* pending;
+    size_t* sizes;
+    size_t* keyShards;
+    char* out;
+    struct uniauth_buffer in;
+    struct uniauth_request req;
+    struct uniauth_peer peer;
+    struct uniauth_parser parser;
+    uint64_t generation;
+    uint64_t deadline;
 
-    /* Prepare the create message buffer to send to the uniauth daemon. */
-    buffer[0] = UNIAUTH_PROTO_CREATE;
-    if (!buffer_storage_record(buffer,sizeof(buffer),&iter,stor)) {
-        php_error(E_ERROR,"protocol message is too large");
+    /* Resolve what we can from the caches. Everything else is pending and must
+     * go to the daemon.
+     */
+    pending = safe_emalloc(count,3 * sizeof(size_t),0);
+    sizes = pending + count;
+    keyShards = sizes + count;
+    for (i = 0;i < count;++i) {
+        if (!lookup_cached(keys[i],keylens[i],UNIAUTH_FIELDS_RECORD,backing+i,
+                results+i))
+        {
+            pending[npending++] = i;
+        }
+    }
+    if (npending == 0 || EG(exception) != NULL) {
+        efree(pending);
+        return EG(exception) != NULL ? -1 : 0;
+    }
+    generation = uniauth_shmcache_generation();
+
+    /* Without a connection of our own there is nothing to pipeline: the
+     * embedded backend has no round trips to save, and shared connections are
+     * kept busy by the other threads.
+     */
+    if (uniauth_embedded_active() || uniauth_share_usable()) {
+        for (i = 0;i < npending;++i) {
+            size_t k = pending[i];
+
+            request_init(&req,UNIAUTH_PROTO_LOOKUP);
+            request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,keys[k],keylens[k]);
+            status = uniauth_transact(&req,backing+k,true);
+            if (status == -1) {
+                efree(pending);
+                return -1;
+            }
+            results[k] = lookup_reply(keys[k],keylens[k],status,backing+k,
+                generation,UNIAUTH_FIELDS_RECORD);
+        }
+        efree(pending);
+        return 0;
+    }
+
+    /* The whole batch counts as a single exchange for uniauth.timeout_ms. */
+    if (uniauth_deadline_begin(&deadline) == -1) {
+        efree(pending);
         return -1;
     }
 
-    /* Send the request message to the uniauth daemon. */
-    sock = uniauth_connect();
-    if (write(sock,buffer,iter) == -1) {
-        php_error(E_ERROR,"fail write(): %s",strerror(errno));
+    /* A batch goes over a single connection, so group the pending keys by
+     * shard (keeping their order within a shard). 'sizes' is free until the
+     * first batch is built.
+     */
+    for (i = 0;i < npending;++i) {
+        keyShards[pending[i]] = uniauth_shard_of(keys[pending[i]],keylens[pending[i]]);
+    }
+    if (shardCount > 1) {
+        size_t* counts = ecalloc(shardCount + 1,sizeof(size_t));
+
+        for (i = 0;i < npending;++i) {
+            counts[keyShards[pending[i]] + 1] += 1;
+        }
+        for (i = 1;i < shardCount;++i) {
+            counts[i] += counts[i-1];
+        }
+        for (i = 0;i < npending;++i) {
+            sizes[counts[keyShards[pending[i]]]++] = pending[i];
+        }
+        memcpy(pending,sizes,npending * sizeof(size_t));
+        efree(counts);
     }
 
-    /* Wait for and read the response. Hopefully this loop should never
-     * reiterate.
+    /* Send LOOKUP messages back-to-back in batches, then consume the replies
+     * for the batch in order as they stream back. On a packet connection each
+     * message of a batch is its own packet (see 'sizes').
      */
-    do {
-        status = uniauth_connect_recv(sock,buffer,sizeof(buffer),&sz);
+    shard = keyShards[pending[0]];
+    sock = uniauth_conn_acquire(&peer,shard);
+    if (sock == -1) {
+        efree(pending);
+        return -1;
+    }
+    out = emalloc(UNIAUTH_PIPELINE_BATCH + UNIAUTH_MAX_MESSAGE);
+    buffer_init(&in);
+    first = 0;
+    while (first < npending) {
+        size_t last = first;
+        size_t iter = 0;
 
-        if (status == 2) {
-            php_error(E_ERROR,"protocol error: server message incorrectly formatted");
+        /* Move on to the next shard's connection. */
+        if (keyShards[pending[first]] != shard) {
+            uniauth_conn_release(sock,false);
+            shard = keyShards[pending[first]];
+            sock = uniauth_conn_acquire(&peer,shard);
+            if (sock == -1) {
+                efree(out);
+                efree(pending);
+                buffer_free(&in);
+                return -1;
+            }
+        }
+
+        /* A small request ring limits the batch further. */
+        batch = UNIAUTH_PIPELINE_BATCH;
+        if (peer.ring != NULL
+            && uniauth_ring_capacity(peer.ring) - UNIAUTH_MAX_MESSAGE < batch)
+        {
+            batch = uniauth_ring_capacity(peer.ring) - UNIAUTH_MAX_MESSAGE;
+        }
+
+        while (last < npending && iter < batch && keyShards[pending[last]] == shard) {
+            int j;
+            size_t k = pending[last];
+
+            /* Each message is copied into the batch, which has room for one
+             * more of up to UNIAUTH_MAX_MESSAGE bytes.
+             */
+            request_init(&req,UNIAUTH_PROTO_LOOKUP);
+            request_field_key(&req,UNIAUTH_PROTO_FIELD_KEY,keys[k],keylens[k]);
+            if (!request_encode(&req,&peer) || req.size > UNIAUTH_MAX_MESSAGE) {
+                efree(out);
+                efree(pending);
+                buffer_free(&in);
+                uniauth_conn_release(sock,false);
+                php_error(E_ERROR,"protocol message is too large");
+                return -1;
+            }
+            for (j = 0;j < req.iovcnt;++j) {
+                memcpy(out + iter,req.iov[j].iov_base,req.iov[j].iov_len);
+                iter += req.iov[j].iov_len;
+            }
+            sizes[last - first] = req.size;
+            last += 1;
+        }
+
+        if (peer.ring != NULL) {
+            struct iovec vec = { out, iter };
+
+            status = uniauth_ring_sendv(sock,peer.ring,&vec,1,deadline);
+        }
+        else if (peer.packet) {
+            status = uniauth_connect_sendm(sock,out,sizes,last - first,deadline);
+        }
+        else {
+            status = uniauth_connect_send(sock,out,iter,deadline);
+        }
+
+        i = first;
+        while (status == 0 && i < last) {
+            size_t k = pending[i];
+
+            parser_init(&parser,backing+k,&peer);
+            status = lookup_many_next(sock,&in,&parser,deadline);
+            if (status != 0) {
+                parser_abort(&parser);
+                break;
+            }
+
+            results[k] = lookup_reply(keys[k],keylens[k],parser.kind,backing+k,
+                generation,UNIAUTH_FIELDS_RECORD);
+
+            /* Shift any following replies to the front of the buffer. */
+            buffer_consume(&in,parser.pos);
+            i += 1;
+        }
+
+        /* Lookups are idempotent, so if the connection was lost we resend
+         * whatever is still unanswered over a new one (once).
+         */
+        if (status == UNIAUTH_CONN_LOST && !retried) {
+            retried = true;
+            uniauth_conn_release(sock,true);
+            sock = uniauth_conn_acquire(&peer,shard);
+            if (sock == -1) {
+                efree(out);
+                efree(pending);
+                buffer_free(&in);
+                return -1;
+            }
+            first = i;
+            continue;
+        }
+
+        if (status != 0) {
+            efree(out);
+            efree(pending);
+            buffer_free(&in);
+            uniauth_conn_release(sock,true);
+            if (status == UNIAUTH_CONN_LOST) {
+                php_error(E_ERROR,"connection to uniauth daemon lost");
+            }
             return -1;
         }
-    } while (status != 0);
 
-    /* We should get pack RESPONSE_MESSAGE upon success. */
-    if (buffer[0] == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+        first = last;
+    }
+
+    uniauth_conn_release(sock,false);
+    efree(out);
+    efree(pending);
+    buffer_free(&in);
+    return 0;
+}
+
+static int write_result(struct uniauth_storage* stor,int kind,bool create)
+{
+    /* If the exchange was interrupted we cannot know whether the daemon
+     * applied the write, so forget what we know about the key.
+     */
+    if (kind == -1) {
+        uniauth_shared_invalidate(stor);
+        if (stor->key != NULL) {
+            uniauth_cache_invalidate(stor->key,stor->keySz);
+        }
+        return -1;
+    }
+
+    /* We should get pack RESPONSE_MESSAGE upon success. Keep the caches in
+     * step with what the daemon now holds.
+     */
+    uniauth_shared_invalidate(stor);
+    if (kind == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+        uniauth_cache_commit(stor,create);
+        stor->dirty = 0;
         return 0;
     }
 
     /* Anything else is an error. */
+    if (stor->key != NULL) {
+        uniauth_cache_invalidate(stor->key,stor->keySz);
+    }
     return -1;
 }
 
-int uniauth_connect_transfer(const char* src,const char* dst)
+ int uniauth_connect_commit(struct uniauth_storage* stor)
+ {
+     struct uniauth_request req;
+
+     /* Prepare the commit message to send to the uniauth daemon. */
+     request_init(&req,UNIAUTH_PROTO_COMMIT);
+     if (!request_storage_record(&req,stor)) {
+         php_error(E_ERROR,"protocol message is too large");
+         return -1;
+     }
+
+    /* Send the request message to the uniauth daemon and wait for the
+     * response.
+     */
+    return write_result(stor,uniauth_transact(&req,NULL,false),false);
+}
+
+int uniauth_connect_create(struct uniauth_storage* stor)
 {
-    int sock;
-    int status;
-    char buffer[UNIAUTH_MAX_MESSAGE];
-    size_t iter = 1;
-    size_t sz = 0;
-
-    /* Prepare the transfer message buffer to send to the uniauth daemon. */
-    buffer[0] = UNIAUTH_PROTO_TRANSF;
-    if (!buffer_field_string(buffer,sizeof(buffer),&iter,
-            UNIAUTH_PROTO_FIELD_TRANSSRC,src,strlen(src))
-        || !buffer_field_string(buffer,sizeof(buffer),&iter,
-            UNIAUTH_PROTO_FIELD_TRANSDST,dst,strlen(dst))
-        || !buffer_field_end(buffer,sizeof(buffer),&iter))
-    {
+    struct uniauth_request req;
+
+    /* Prepare the create message to send to the uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_CREATE);
+    if (!request_storage_record(&req,stor)) {
+        php_error(E_ERROR,"protocol message is too large");
+        return -1;
+    }
+
+    /* Send the request message to the uniauth daemon and wait for the
+     * response.
+     */
+    return write_result(stor,uniauth_transact(&req,NULL,false),true);
+}
+
+int uniauth_connect_upsert(struct uniauth_storage* stor)
+{
+    int kind;
+    struct uniauth_request req;
+    struct uniauth_storage local;
+
+    /* Prepare the upsert message to send to the uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_UPSERT);
+    req.feature = UNIAUTH_FEATURE_UPSERT;
+    if (!request_storage_record(&req,stor)) {
         php_error(E_ERROR,"protocol message is too large");
         return -1;
     }
+    kind = uniauth_transact(&req,NULL,false);
 
-    /* Send the request message to the uniauth daemon. */
-    sock = uniauth_connect();
-    if (write(sock,buffer,iter) == -1) {
-        php_error(E_ERROR,"fail write(): %s",strerror(errno));
+    /* Without daemon support we have to look up the record to decide whether
+     * to commit or create it.
+     */
+    if (kind == UNIAUTH_UNSUPPORTED) {
+        if (uniauth_connect_lookup(stor->key,stor->keySz,&local) != NULL) {
+            uniauth_storage_delete(&local);
+            return uniauth_connect_commit(stor);
+        }
+        if (EG(exception) != NULL) {
+            return -1;
+        }
+        return uniauth_connect_create(stor);
     }
 
-    /* Wait for and read the response. Hopefully this loop should never
-     * reiterate.
+    return write_result(stor,kind,false);
+}
+
+int uniauth_connect_cas(struct uniauth_storage* stor)
+{
+    int kind;
+    struct uniauth_request req;
+    struct uniauth_storage current;
+
+    /* We cannot detect conflicts without knowing the revision we started
+     * from (e.g. the daemon does not report revisions).
      */
-    do {
-        status = uniauth_connect_recv(sock,buffer,sizeof(buffer),&sz);
+    if (stor->revision == 0) {
+        return uniauth_connect_commit(stor);
+    }
 
-        if (status == 2) {
-            php_error(E_ERROR,"protocol error: server message incorrectly formatted");
-            return -1;
+    /* Prepare the conditional commit message to send to the uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_CAS);
+    req.feature = UNIAUTH_FEATURE_CAS;
+    if (!request_storage_record(&req,stor)
+        || !request_field_time(&req,UNIAUTH_PROTO_FIELD_REVISION,stor->revision))
+    {
+        php_error(E_ERROR,"protocol message is too large");
+        return -1;
+    }
+    kind = uniauth_transact(&req,&current,false);
+    if (kind == UNIAUTH_UNSUPPORTED) {
+        return uniauth_connect_commit(stor);
+    }
+
+    /* The record changed since it was read. Hand the current one back to the
+     * caller (and remember it).
+     */
+    if (kind == UNIAUTH_PROTO_RESPONSE_RECORD) {
+        if (current.key == NULL) {
+            current.key = stor->key;
+            current.keySz = stor->keySz;
+            stor->key = NULL;
         }
-    } while (status != 0);
+        uniauth_storage_delete(stor);
+        *stor = current;
+
+        uniauth_shmcache_invalidate(stor->key,stor->keySz);
+        uniauth_cache_store(stor->key,stor->keySz,stor,UNIAUTH_FIELDS_RECORD);
+        return 1;
+    }
+
+    return write_result(stor,kind,false);
+}
+
+int uniauth_connect_transfer(const char* src,const char* dst)
+{
+    int kind;
+    struct uniauth_request req;
+
+    /* Sessions on different shards cannot share a registration record. A copy
+     * would not see a later logout, so refuse (see uniauth_apply()).
+     */
+    if (uniauth_shard_of(src,strlen(src)) != uniauth_shard_of(dst,strlen(dst))) {
+        zend_throw_exception(NULL,
+            "applicant and registrar sessions are kept by different uniauth daemons",0);
+        return -1;
+    }
+
+    /* Prepare the transfer message to send to the uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_TRANSF);
+    if (!request_field_key(&req,UNIAUTH_PROTO_FIELD_TRANSSRC,src,strlen(src))
+        || !request_field_key(&req,UNIAUTH_PROTO_FIELD_TRANSDST,dst,strlen(dst)))
+    {
+        php_error(E_ERROR,"protocol message is too large");
+        return -1;
+    }
+
+    /* Send the request message to the uniauth daemon and wait for the
+     * response.
+     */
+    kind = uniauth_transact(&req,NULL,false);
+
+    /* The destination now references the source registration, so whatever we
+     * had cached for it is stale regardless of the outcome.
+     */
+    uniauth_cache_invalidate(dst,strlen(dst));
+    uniauth_shmcache_invalidate(dst,strlen(dst));
 
     /* We should get pack RESPONSE_MESSAGE upon success. */
-    if (buffer[0] == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+    if (kind == UNIAUTH_PROTO_RESPONSE_MESSAGE) {
+        return 0;
+    }
+
+    /* Anything else is an error. */
+    return -1;
+}
+
+int uniauth_connect_transfer_apply(const char* src,size_t srclen,
+    struct uniauth_storage* dst)
+{
+    int kind;
+    struct uniauth_request req;
+
+    /* The daemon resolves the destination from a plain key (the source's
+     * tag), which does not work when keys are digested, nor when the
+     * destination may live on another shard.
+     */
+    if (UNIAUTH_G(keyDigest) || shardCount > 1) {
+        memset(dst,0,sizeof(struct uniauth_storage));
+        return -1;
+    }
+
+    /* Prepare the transfer message to send to the uniauth daemon. */
+    request_init(&req,UNIAUTH_PROTO_TRANSF_APPLY);
+    req.feature = UNIAUTH_FEATURE_TRANSF_APPLY;
+    request_field_string(&req,UNIAUTH_PROTO_FIELD_TRANSSRC,src,srclen);
+
+    /* Send the request message to the uniauth daemon and wait for the
+     * response, which describes the destination record.
+     */
+    kind = uniauth_transact(&req,dst,false);
+    if (kind == UNIAUTH_UNSUPPORTED) {
+        memset(dst,0,sizeof(struct uniauth_storage));
+        return -1;
+    }
+
+    /* The daemon changes nothing if it reports an error. Otherwise both
+     * records changed (or may have if the exchange was interrupted).
+     */
+    if (kind != UNIAUTH_PROTO_RESPONSE_ERROR) {
+        uniauth_cache_invalidate(src,srclen);
+        uniauth_shmcache_invalidate(src,srclen);
+    }
+    if (kind == UNIAUTH_PROTO_RESPONSE_RECORD) {
+        if (dst->key != NULL) {
+            uniauth_cache_invalidate(dst->key,dst->keySz);
+            uniauth_shmcache_invalidate(dst->key,dst->keySz);
+        }
         return 0;
     }
 
     /* Anything else is an error. */
+    uniauth_storage_delete(dst);
+    memset(dst,0,sizeof(struct uniauth_storage));
     return -1;
 }
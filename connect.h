@@ -18,11 +18,109 @@
 /* Functions to manipulate a uniauth record in the PHP extension */
 void uniauth_storage_delete(struct uniauth_storage* stor);
 
+/* Record strings: the key, redirect and tag fields of a uniauth_storage record
+ * are null-terminated strings in an arena, a single block that holds all the
+ * strings of a record and is reference counted by them. A field can thus be
+ * shared with caches by bumping the count. Fields must therefore be allocated
+ * and freed with these functions and never modified in place.
+ *
+ * A record's strings are allocated together by creating an arena for 'count'
+ * strings of 'len' bytes in total, adding the strings and then releasing the
+ * arena; it is freed once its last string is.
+ */
+char* uniauth_field_new(const char* src,size_t n);
+char* uniauth_field_copy(const char* field);
+void uniauth_field_free(char* field);
+
+struct uniauth_arena;
+struct uniauth_arena* uniauth_arena_new(size_t len,int count);
+char* uniauth_arena_field(struct uniauth_arena* arena,const char* src,size_t n);
+void uniauth_arena_release(struct uniauth_arena* arena);
+
+/* The user information fields (username and displayName) are instead the
+ * character buffers of refcounted zend_strings, so that they go into the login
+ * array returned to userspace without a copy (see UNIAUTH_USER_FIELD_STR()).
+ * The same rules apply, using these functions.
+ */
+char* uniauth_user_field_new(const char* src,size_t n);
+char* uniauth_user_field_copy(const char* field);
+void uniauth_user_field_free(char* field);
+
+#define UNIAUTH_USER_FIELD_STR(field) \
+    ((zend_string*)((field) - XtOffsetOf(zend_string,val)))
+
 /* Connect commands; these wrap a protocol operation */
 struct uniauth_storage* uniauth_connect_lookup(const char* key,size_t keylen,
     struct uniauth_storage* backing);
+int uniauth_connect_lookup_many(size_t count,const char** keys,
+    const size_t* keylens,struct uniauth_storage* backing,
+    struct uniauth_storage** results);
 int uniauth_connect_commit(struct uniauth_storage* stor);
 int uniauth_connect_create(struct uniauth_storage* stor);
 int uniauth_connect_transfer(const char* src,const char* dst);
 
+/* Write operations that need daemon support; without it they fall back to the
+ * basic operations. An upsert commits the record if it exists and creates it
+ * otherwise. A CAS commits the record only if it has not changed since it was
+ * read (i.e. still has stor->revision). On a conflict it returns 1 and
+ * replaces 'stor' with the current record.
+ */
+int uniauth_connect_upsert(struct uniauth_storage* stor);
+int uniauth_connect_cas(struct uniauth_storage* stor);
+
+/* Looks up just the specified fields (a mask of UNIAUTH_FIELD_BIT bits) of a
+ * record. The result may have more fields than were asked for (e.g. if the
+ * daemon does not support projections) but never fewer.
+ */
+struct uniauth_storage* uniauth_connect_lookup_fields(const char* key,
+    size_t keylen,struct uniauth_storage* backing,uint32_t fields);
+
+/* Looks up (the specified fields of) a record and has the daemon extend its
+ * expiration in the same round trip (see UNIAUTH_PROTO_LOOKUP_TOUCH).
+ * 'touched' is set if the daemon applied the policy; otherwise (e.g. the
+ * record came from a cache or the daemon lacks support) the caller must touch
+ * the record itself.
+ */
+struct uniauth_storage* uniauth_connect_lookup_touch(const char* key,
+    size_t keylen,struct uniauth_storage* backing,int32_t lifetime,
+    int32_t threshold,uint32_t fields,bool* touched);
+
+/* Performs the whole transfer step of an auth flow in one exchange (see
+ * UNIAUTH_PROTO_TRANSF_APPLY). On success 'dst' receives the destination's key
+ * and former redirect URI. If -1 is returned without raising an error, the
+ * daemon did not (or could not) perform the transfer and nothing changed.
+ */
+int uniauth_connect_transfer_apply(const char* src,size_t srclen,
+    struct uniauth_storage* dst);
+
+/* Shards: 'paths' is the comma-separated list of daemon socket paths from
+ * uniauth.socket_path. Each session key is kept by one daemon, chosen by
+ * hashing the key. These are called at module startup and shutdown; startup
+ * fails if the list names no daemon.
+ */
+int uniauth_connect_shards_init(const char* paths);
+void uniauth_connect_shards_shutdown();
+size_t uniauth_connect_shard_count();
+
+/* Determines whether two session keys are kept by the same daemon. A transfer
+ * can only link sessions that are.
+ */
+bool uniauth_connect_same_shard(const char* a,size_t alen,const char* b,
+    size_t blen);
+
+/* Shared connections (threaded builds only): threads send their requests over
+ * 'count' connections per shard shared by the whole process instead of one
+ * connection each, provided the daemon supports UNIAUTH_FEATURE_MULTIPLEX.
+ * These are called at module startup and shutdown (after the shards are set
+ * up). The count is the total, or 0 if sharing is off.
+ */
+int uniauth_connect_share_init(size_t count);
+void uniauth_connect_share_shutdown();
+size_t uniauth_connect_share_count();
+
+/* Sends a LOOKUP without waiting for the reply; the reply is consumed by the
+ * next operation. This never raises errors.
+ */
+void uniauth_connect_prefetch(const char* key,size_t keylen);
+
 #endif
@@ -0,0 +1,100 @@
+/*
+ * digest.c
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "digest.h"
+#include <string.h>
+
+#define ROTL(x,b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND(v0,v1,v2,v3)                   \
+    do {                                        \
+        v0 += v1;                               \
+        v1 = ROTL(v1,13);                       \
+        v1 ^= v0;                               \
+        v0 = ROTL(v0,32);                       \
+        v2 += v3;                               \
+        v3 = ROTL(v3,16);                       \
+        v3 ^= v2;                               \
+        v0 += v3;                               \
+        v3 = ROTL(v3,21);                       \
+        v3 ^= v0;                               \
+        v2 += v1;                               \
+        v1 = ROTL(v1,17);                       \
+        v1 ^= v2;                               \
+        v2 = ROTL(v2,32);                       \
+    } while (0)
+
+static inline uint64_t load_le64(const unsigned char* p)
+{
+    int i;
+    uint64_t value = 0;
+
+    for (i = 7;i >= 0;--i) {
+        value = (value << 8) | p[i];
+    }
+    return value;
+}
+
+static inline void store_le64(unsigned char* p,uint64_t value)
+{
+    int i;
+
+    for (i = 0;i < 8;++i) {
+        p[i] = (value >> (i*8)) & 0xff;
+    }
+}
+
+void uniauth_digest(const unsigned char* secret,const char* src,size_t n,
+    unsigned char* out)
+{
+    size_t i;
+    uint64_t m;
+    uint64_t b;
+    uint64_t k0 = load_le64(secret);
+    uint64_t k1 = load_le64(secret + 8);
+    uint64_t v0 = UINT64_C(0x736f6d6570736575) ^ k0;
+    uint64_t v1 = UINT64_C(0x646f72616e646f6d) ^ k1 ^ 0xee;
+    uint64_t v2 = UINT64_C(0x6c7967656e657261) ^ k0;
+    uint64_t v3 = UINT64_C(0x7465646279746573) ^ k1;
+    const unsigned char* p = (const unsigned char*)src;
+    unsigned char tail[8];
+
+    /* Compress whole 8-byte words, then the remaining bytes along with the
+     * length.
+     */
+    for (i = 0;i + 8 <= n;i += 8) {
+        m = load_le64(p + i);
+        v3 ^= m;
+        SIPROUND(v0,v1,v2,v3);
+        SIPROUND(v0,v1,v2,v3);
+        v0 ^= m;
+    }
+
+    memset(tail,0,sizeof(tail));
+    memcpy(tail,p + i,n - i);
+    b = ((uint64_t)n << 56) | load_le64(tail);
+    v3 ^= b;
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    v0 ^= b;
+
+    /* Finalize; the 128-bit variant squeezes out a second word. */
+    v2 ^= 0xee;
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    store_le64(out,v0 ^ v1 ^ v2 ^ v3);
+
+    v1 ^= 0xdd;
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    SIPROUND(v0,v1,v2,v3);
+    store_le64(out + 8,v0 ^ v1 ^ v2 ^ v3);
+}
@@ -0,0 +1,22 @@
+/*
+ * digest.h
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * The functionality provided by this module computes the keyed digests that
+ * stand in for session keys on the wire (see UNIAUTH_FEATURE_KEY_DIGEST). The
+ * digest is SipHash-2-4 with 128-bit output.
+ */
+
+#ifndef UNIAUTH_DIGEST_H
+#define UNIAUTH_DIGEST_H
+#include "protocol.h"
+
+#define UNIAUTH_DIGEST_SECRET_SZ 16
+
+void uniauth_digest(const unsigned char* secret,const char* src,size_t n,
+    unsigned char* out);
+
+#endif
@@ -0,0 +1,975 @@
+/*
+ * embedded.c
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "embedded.h"
+#include "connect.h"
+#include "uniauth.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* The file holds a header, a table of buckets and an array of records. A
+ * session key hashes to a bucket, which has room for a few sessions. Each
+ * session references a record by index; a record is shared by the sessions
+ * that a transfer pointed at it and is freed with the last of them.
+ *
+ * Locking is per bucket and per record. An operation locks the buckets of the
+ * keys it names and then the records it needs, each in index order. Nothing
+ * takes a bucket lock while holding a record lock, so locks are always taken
+ * in the same order. The free list of records has its own lock, taken last. A
+ * lock word holds the pid of its owner so that a lock left behind by a process
+ * that died (e.g. in the previous run) can be taken over.
+ *
+ * Expired sessions are removed lazily: when an operation comes across one, and
+ * by a short sweep over the table when the records run out.
+ */
+
+#define UNIAUTH_EMBEDDED_MAGIC   0x64626d65 /* "embd" */
+#define UNIAUTH_EMBEDDED_VERSION 2
+#define UNIAUTH_EMBEDDED_LINE    64
+#define UNIAUTH_EMBEDDED_BUCKET  8
+#define UNIAUTH_EMBEDDED_KEY     118
+#define UNIAUTH_EMBEDDED_SESSION 128
+#define UNIAUTH_EMBEDDED_RECORD  512
+#define UNIAUTH_EMBEDDED_SPIN    128
+#define UNIAUTH_EMBEDDED_WAIT_MS 10
+#define UNIAUTH_EMBEDDED_SWEEP   64
+
+#define RECORD_HAS_USER     0x01
+#define RECORD_HAS_DISPLAY  0x02
+#define RECORD_HAS_REDIRECT 0x04
+#define RECORD_HAS_TAG      0x08
+
+/* Record strings in the order they are packed. */
+#define RECORD_STRINGS 4
+#define RECORD_USER 0
+#define RECORD_DISPLAY 1
+#define RECORD_REDIRECT 2
+#define RECORD_TAG 3
+
+struct embedded_lock
+{
+    uint32_t owner;           /* pid of the owner or 0 if unlocked */
+    uint32_t waiters;         /* processes sleeping on 'owner' */
+};
+
+struct embedded_session
+{
+    uint32_t hash;
+    uint32_t record;          /* record index plus one; 0 marks an empty slot */
+    uint16_t keySz;
+    char key[UNIAUTH_EMBEDDED_KEY];
+};
+
+struct embedded_bucket
+{
+    struct embedded_lock lock;
+    char pad[UNIAUTH_EMBEDDED_LINE - sizeof(struct embedded_lock)];
+    struct embedded_session sessions[UNIAUTH_EMBEDDED_BUCKET];
+} __attribute__((aligned(UNIAUTH_EMBEDDED_LINE)));
+
+struct embedded_record
+{
+    struct embedded_lock lock;
+    uint32_t refs;            /* sessions referencing the record */
+    uint32_t next;            /* free list link (index plus one) */
+    int32_t id;
+    int32_t lifetime;
+    int64_t expire;
+    int64_t updated;          /* UNIX timestamp of the last write */
+    int64_t revision;
+
+    uint16_t sizes[RECORD_STRINGS];
+    uint8_t flags;
+    uint8_t pad[3];
+    int32_t idle;             /* seconds a record without a lifetime is kept */
+
+    /* Strings are packed back-to-back (without terminators) in field order:
+     * username, displayName, redirect, tag.
+     */
+    char data[UNIAUTH_EMBEDDED_RECORD - 64];
+} __attribute__((aligned(UNIAUTH_EMBEDDED_LINE)));
+
+struct embedded_header
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t nbuckets;        /* a power of two */
+    uint32_t nrecords;
+    uint64_t revision;        /* last revision handed out */
+    uint32_t used;            /* records handed out at least once */
+    uint32_t freeHead;        /* index plus one of the first free record */
+    uint32_t sweep;           /* next bucket to sweep */
+    struct embedded_lock freeLock;
+} __attribute__((aligned(UNIAUTH_EMBEDDED_LINE)));
+
+static struct embedded_header* header = NULL;
+static struct embedded_bucket* buckets = NULL;
+static struct embedded_record* records = NULL;
+static size_t mapsz = 0;
+static uint32_t mask = 0;
+
+static const int recordFields[RECORD_STRINGS] = {
+    UNIAUTH_PROTO_FIELD_USER,
+    UNIAUTH_PROTO_FIELD_DISPLAY,
+    UNIAUTH_PROTO_FIELD_REDIRECT,
+    UNIAUTH_PROTO_FIELD_TAG
+};
+
+int uniauth_embedded_init(const char* path,size_t nsessions)
+{
+    int fd;
+    int err;
+    struct stat st;
+    struct embedded_header hdr;
+    size_t nbuckets = 1;
+    size_t nrecords = nsessions;
+    size_t sz;
+    void* mem;
+
+    if (sizeof(struct embedded_session) != UNIAUTH_EMBEDDED_SESSION
+        || sizeof(struct embedded_record) != UNIAUTH_EMBEDDED_RECORD
+        || nsessions == 0 || nsessions > UINT32_MAX / 2)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+
+    fd = open(path,O_RDWR | O_CREAT | O_CLOEXEC,0600);
+    if (fd == -1) {
+        return -1;
+    }
+
+    /* Keep other processes from setting up the same file at the same time.
+     * The lock goes away with the descriptor.
+     */
+    if (flock(fd,LOCK_EX) == -1 || fstat(fd,&st) == -1) {
+        goto fail;
+    }
+
+    /* An existing table keeps its geometry. Anything else in the file is left
+     * alone.
+     */
+    memset(&hdr,0,sizeof(struct embedded_header));
+    if (st.st_size > 0) {
+        if ((size_t)st.st_size < sizeof(struct embedded_header)
+            || pread(fd,&hdr,sizeof(struct embedded_header),0)
+                != sizeof(struct embedded_header)
+            || hdr.magic != UNIAUTH_EMBEDDED_MAGIC
+            || hdr.version != UNIAUTH_EMBEDDED_VERSION
+            || hdr.nbuckets == 0 || (hdr.nbuckets & (hdr.nbuckets-1)) != 0)
+        {
+            errno = EPROTO;
+            goto fail;
+        }
+        nbuckets = hdr.nbuckets;
+        nrecords = hdr.nrecords;
+    }
+    else {
+        while (nbuckets * UNIAUTH_EMBEDDED_BUCKET < nsessions) {
+            nbuckets <<= 1;
+        }
+    }
+
+    sz = sizeof(struct embedded_header)
+        + nbuckets * sizeof(struct embedded_bucket)
+        + nrecords * sizeof(struct embedded_record);
+    if (st.st_size > 0 && (size_t)st.st_size < sz) {
+        errno = EPROTO;
+        goto fail;
+    }
+    if (st.st_size == 0 && ftruncate(fd,sz) == -1) {
+        goto fail;
+    }
+
+    mem = mmap(NULL,sz,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+    if (mem == MAP_FAILED) {
+        goto fail;
+    }
+    close(fd);
+
+    header = mem;
+    buckets = (struct embedded_bucket*)(header + 1);
+    records = (struct embedded_record*)(buckets + nbuckets);
+    mapsz = sz;
+    mask = (uint32_t)(nbuckets - 1);
+
+    /* A new file is zero-filled, which yields empty buckets and no records
+     * handed out.
+     */
+    if (header->magic != UNIAUTH_EMBEDDED_MAGIC) {
+        header->version = UNIAUTH_EMBEDDED_VERSION;
+        header->nbuckets = (uint32_t)nbuckets;
+        header->nrecords = (uint32_t)nrecords;
+        __atomic_store_n(&header->magic,UNIAUTH_EMBEDDED_MAGIC,__ATOMIC_RELEASE);
+    }
+
+    return 0;
+
+fail:
+    err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+}
+
+void uniauth_embedded_shutdown()
+{
+    if (header != NULL) {
+        munmap(header,mapsz);
+        header = NULL;
+        buckets = NULL;
+        records = NULL;
+        mapsz = 0;
+    }
+}
+
+bool uniauth_embedded_active()
+{
+    return header != NULL;
+}
+
+/* Locks */
+
+static inline bool lock_try(struct embedded_lock* lock,uint32_t owner)
+{
+    uint32_t expected = 0;
+
+    return __atomic_compare_exchange_n(&lock->owner,&expected,owner,false,
+        __ATOMIC_SEQ_CST,__ATOMIC_RELAXED);
+}
+
+static void lock_acquire(struct embedded_lock* lock)
+{
+    int i;
+    uint32_t self = (uint32_t)getpid();
+    struct timespec ts;
+
+    for (i = 0;!lock_try(lock,self);++i) {
+        uint32_t owner;
+        long r;
+
+        if (i < UNIAUTH_EMBEDDED_SPIN) {
+            continue;
+        }
+
+        owner = __atomic_load_n(&lock->owner,__ATOMIC_SEQ_CST);
+        if (owner == 0) {
+            continue;
+        }
+
+        ts.tv_sec = 0;
+        ts.tv_nsec = UNIAUTH_EMBEDDED_WAIT_MS * 1000000L;
+        __atomic_fetch_add(&lock->waiters,1,__ATOMIC_SEQ_CST);
+        r = syscall(SYS_futex,&lock->owner,FUTEX_WAIT,owner,&ts,NULL,0);
+        __atomic_fetch_sub(&lock->waiters,1,__ATOMIC_SEQ_CST);
+
+        /* A lock held this long may belong to a process that is gone. */
+        if (r == -1 && errno == ETIMEDOUT && owner != self
+            && kill((pid_t)owner,0) == -1 && errno == ESRCH
+            && __atomic_compare_exchange_n(&lock->owner,&owner,self,false,
+                __ATOMIC_SEQ_CST,__ATOMIC_RELAXED))
+        {
+            return;
+        }
+    }
+}
+
+static void lock_release(struct embedded_lock* lock)
+{
+    __atomic_store_n(&lock->owner,0,__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&lock->waiters,__ATOMIC_SEQ_CST) != 0) {
+        syscall(SYS_futex,&lock->owner,FUTEX_WAKE,1,NULL,NULL,0);
+    }
+}
+
+static void lock_pair(struct embedded_lock* a,struct embedded_lock* b)
+{
+    /* Locks of the same kind are taken in address (i.e. index) order. */
+    if (a == b) {
+        lock_acquire(a);
+    }
+    else if (a < b) {
+        lock_acquire(a);
+        lock_acquire(b);
+    }
+    else {
+        lock_acquire(b);
+        lock_acquire(a);
+    }
+}
+
+static void unlock_pair(struct embedded_lock* a,struct embedded_lock* b)
+{
+    lock_release(a);
+    if (b != a) {
+        lock_release(b);
+    }
+}
+
+/* Helpers */
+
+static inline uint32_t embedded_hash(const char* key,size_t keylen)
+{
+    return (uint32_t)zend_inline_hash_func(key,keylen);
+}
+
+static inline struct embedded_bucket* embedded_bucket(uint32_t hash)
+{
+    return buckets + (hash & mask);
+}
+
+static inline struct embedded_record* embedded_record(uint32_t ref)
+{
+    return records + (ref - 1);
+}
+
+static struct embedded_session* bucket_find(struct embedded_bucket* bucket,
+    uint32_t hash,const char* key,size_t keylen)
+{
+    int i;
+
+    for (i = 0;i < UNIAUTH_EMBEDDED_BUCKET;++i) {
+        struct embedded_session* sess = bucket->sessions + i;
+
+        if (sess->record != 0 && sess->record <= header->used
+            && sess->hash == hash && sess->keySz == keylen
+            && memcmp(sess->key,key,keylen) == 0)
+        {
+            return sess;
+        }
+    }
+
+    return NULL;
+}
+
+static bool record_expired(const struct embedded_record* rec,int64_t now)
+{
+    /* A temporary record (e.g. an applicant waiting for authentication) has no
+     * expiration yet. It is kept for a lifetime after it was last written: its
+     * own or else the default lifetime of the worker that created it, so that
+     * every worker agrees on when it expires.
+     */
+    if (rec->expire == 0) {
+        int64_t lifetime = rec->lifetime > 0 ? rec->lifetime : rec->idle;
+
+        return rec->updated + lifetime <= now;
+    }
+    return rec->expire <= now;
+}
+
+static bool record_string(const struct embedded_record* rec,int index,
+    const char** str,size_t* len)
+{
+    int i;
+    const char* iter = rec->data;
+
+    for (i = 0;i < index;++i) {
+        iter += rec->sizes[i];
+    }
+    *str = iter;
+    *len = rec->sizes[index];
+    return (rec->flags & (1 << index)) != 0;
+}
+
+static inline int64_t next_revision()
+{
+    return (int64_t)__atomic_add_fetch(&header->revision,1,__ATOMIC_SEQ_CST);
+}
+
+/* Records */
+
+static uint32_t record_alloc_once()
+{
+    uint32_t ref = 0;
+
+    lock_acquire(&header->freeLock);
+    if (header->freeHead != 0) {
+        ref = header->freeHead;
+        header->freeHead = embedded_record(ref)->next;
+    }
+    else if (header->used < header->nrecords) {
+        ref = ++header->used;
+    }
+    lock_release(&header->freeLock);
+
+    return ref;
+}
+
+static void record_free(uint32_t ref)
+{
+    lock_acquire(&header->freeLock);
+    embedded_record(ref)->next = header->freeHead;
+    header->freeHead = ref;
+    lock_release(&header->freeLock);
+}
+
+static void session_drop(struct embedded_session* sess)
+{
+    /* Remove a session from its (locked) bucket, freeing the record with its
+     * last reference.
+     */
+
+    uint32_t ref = sess->record;
+    struct embedded_record* rec = embedded_record(ref);
+    uint32_t refs;
+
+    sess->record = 0;
+    lock_acquire(&rec->lock);
+    if (rec->refs > 0) {
+        rec->refs -= 1;
+    }
+    refs = rec->refs;
+    lock_release(&rec->lock);
+
+    if (refs == 0) {
+        record_free(ref);
+    }
+}
+
+static bool session_expire(struct embedded_session* sess,int64_t now)
+{
+    /* Drop the session if its record expired. */
+    bool expired;
+    struct embedded_record* rec = embedded_record(sess->record);
+
+    lock_acquire(&rec->lock);
+    expired = record_expired(rec,now);
+    lock_release(&rec->lock);
+
+    if (expired) {
+        session_drop(sess);
+    }
+    return expired;
+}
+
+static void embedded_sweep(int64_t now)
+{
+    /* Look for expired sessions in the next few buckets. Buckets that are
+     * busy (including any the caller holds) are skipped.
+     */
+
+    int i;
+    int j;
+    uint32_t self = (uint32_t)getpid();
+
+    for (i = 0;i < UNIAUTH_EMBEDDED_SWEEP;++i) {
+        uint32_t n = __atomic_fetch_add(&header->sweep,1,__ATOMIC_RELAXED);
+        struct embedded_bucket* bucket = buckets + (n & mask);
+
+        if (!lock_try(&bucket->lock,self)) {
+            continue;
+        }
+        for (j = 0;j < UNIAUTH_EMBEDDED_BUCKET;++j) {
+            if (bucket->sessions[j].record != 0) {
+                session_expire(bucket->sessions + j,now);
+            }
+        }
+        lock_release(&bucket->lock);
+    }
+}
+
+static uint32_t record_alloc(int64_t now)
+{
+    uint32_t ref = record_alloc_once();
+
+    if (ref == 0) {
+        embedded_sweep(now);
+        ref = record_alloc_once();
+    }
+    return ref;
+}
+
+static bool record_write(struct embedded_record* rec,
+    const struct uniauth_embedded_op* op,int64_t now)
+{
+    /* Apply the fields of a write to a record (which the caller has locked or
+     * that is not shared yet). The strings are repacked; if they do not fit,
+     * nothing is changed.
+     */
+
+    int i;
+    char data[sizeof(rec->data)];
+    size_t total = 0;
+    uint8_t flags = 0;
+    uint16_t sizes[RECORD_STRINGS];
+    const char* values[RECORD_STRINGS] = {
+        op->fields.username,
+        op->fields.displayName,
+        op->fields.redirect,
+        op->fields.tag
+    };
+    const size_t valueSizes[RECORD_STRINGS] = {
+        op->fields.usernameSz,
+        op->fields.displayNameSz,
+        op->fields.redirectSz,
+        op->fields.tagSz
+    };
+
+    for (i = 0;i < RECORD_STRINGS;++i) {
+        uint32_t bit = UNIAUTH_FIELD_BIT(recordFields[i]);
+        const char* str;
+        size_t len;
+        bool has = record_string(rec,i,&str,&len);
+
+        if ((op->cleared & bit) != 0) {
+            has = false;
+            len = 0;
+        }
+        else if ((op->present & bit) != 0) {
+            has = true;
+            str = values[i];
+            len = valueSizes[i];
+        }
+
+        if (len > sizeof(data) - total) {
+            return false;
+        }
+        memcpy(data + total,str,len);
+        total += len;
+        sizes[i] = (uint16_t)len;
+        if (has) {
+            flags |= 1 << i;
+        }
+    }
+
+    memcpy(rec->data,data,total);
+    memcpy(rec->sizes,sizes,sizeof(sizes));
+    rec->flags = flags;
+
+    if ((op->present | op->cleared) & UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID)) {
+        rec->id = op->fields.id;
+    }
+    if ((op->present | op->cleared) & UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_EXPIRE)) {
+        rec->expire = op->fields.expire;
+    }
+    if ((op->present | op->cleared) & UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_LIFETIME)) {
+        rec->lifetime = op->fields.lifetime;
+    }
+    rec->updated = now;
+    rec->revision = next_revision();
+
+    return true;
+}
+
+static void record_touch(struct embedded_record* rec,
+    const struct uniauth_embedded_op* op,int64_t now)
+{
+    /* See UNIAUTH_FEATURE_LOOKUP_TOUCH. */
+    int64_t lifetime = rec->lifetime > 0 ? rec->lifetime : op->fields.lifetime;
+
+    if (!IS_VALID_USER_ID(rec->id) || lifetime <= 0) {
+        return;
+    }
+    if (rec->expire == 0 || rec->expire - now < lifetime * op->threshold / 100) {
+        rec->expire = now + lifetime;
+        rec->updated = now;
+        rec->revision = next_revision();
+    }
+}
+
+static void record_read(const struct embedded_record* rec,const char* key,
+    size_t keylen,struct uniauth_storage* stor)
+{
+    /* Decode a copy of a record, with its session key, into a reply. The user
+     * information goes into zend_strings and the other strings into one
+     * arena.
+     */
+
+    int i;
+    int count = 1;
+    size_t len = keylen;
+    struct uniauth_arena* arena;
+    const char* str;
+    size_t n;
+
+    memset(stor,0,sizeof(struct uniauth_storage));
+    stor->id = rec->id;
+    stor->expire = rec->expire;
+    stor->lifetime = rec->lifetime;
+    stor->revision = rec->revision;
+
+    if (record_string(rec,RECORD_USER,&str,&n)) {
+        stor->username = uniauth_user_field_new(str,n);
+        stor->usernameSz = n;
+    }
+    if (record_string(rec,RECORD_DISPLAY,&str,&n)) {
+        stor->displayName = uniauth_user_field_new(str,n);
+        stor->displayNameSz = n;
+    }
+
+    for (i = RECORD_REDIRECT;i < RECORD_STRINGS;++i) {
+        if (rec->flags & (1 << i)) {
+            len += rec->sizes[i];
+            count += 1;
+        }
+    }
+
+    arena = uniauth_arena_new(len,count);
+    stor->key = uniauth_arena_field(arena,key,keylen);
+    stor->keySz = keylen;
+    if (record_string(rec,RECORD_REDIRECT,&str,&n)) {
+        stor->redirect = uniauth_arena_field(arena,str,n);
+        stor->redirectSz = n;
+    }
+    if (record_string(rec,RECORD_TAG,&str,&n)) {
+        stor->tag = uniauth_arena_field(arena,str,n);
+        stor->tagSz = n;
+    }
+    uniauth_arena_release(arena);
+}
+
+/* Operations */
+
+static int session_create(struct embedded_bucket* bucket,uint32_t hash,
+    const struct uniauth_embedded_op* op,int64_t now)
+{
+    /* Add a session with a new record to a locked bucket that does not have
+     * the key.
+     */
+
+    int i;
+    uint32_t ref;
+    struct embedded_record* rec;
+    struct embedded_session* sess = NULL;
+
+    if (op->keySz > UNIAUTH_EMBEDDED_KEY) {
+        return UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+
+    for (i = 0;i < UNIAUTH_EMBEDDED_BUCKET && sess == NULL;++i) {
+        if (bucket->sessions[i].record == 0) {
+            sess = bucket->sessions + i;
+        }
+    }
+    for (i = 0;i < UNIAUTH_EMBEDDED_BUCKET && sess == NULL;++i) {
+        if (session_expire(bucket->sessions + i,now)) {
+            sess = bucket->sessions + i;
+        }
+    }
+    if (sess == NULL) {
+        return UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+
+    ref = record_alloc(now);
+    if (ref == 0) {
+        return UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+    rec = embedded_record(ref);
+    memset(rec,0,sizeof(struct embedded_record));
+    rec->refs = 1;
+    rec->idle = (int32_t)UNIAUTH_G(lifetime);
+    if (!record_write(rec,op,now)) {
+        record_free(ref);
+        return UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+
+    sess->hash = hash;
+    sess->keySz = (uint16_t)op->keySz;
+    memcpy(sess->key,op->key,op->keySz);
+    sess->record = ref;
+
+    return UNIAUTH_PROTO_RESPONSE_MESSAGE;
+}
+
+static struct embedded_session* session_lookup(struct embedded_bucket* bucket,
+    uint32_t hash,const char* key,size_t keylen,int64_t now)
+{
+    /* Find a session in a locked bucket and lock its record. An expired
+     * session is dropped and not found.
+     */
+
+    struct embedded_session* sess = bucket_find(bucket,hash,key,keylen);
+    struct embedded_record* rec;
+
+    if (sess == NULL) {
+        return NULL;
+    }
+
+    rec = embedded_record(sess->record);
+    lock_acquire(&rec->lock);
+    if (record_expired(rec,now)) {
+        lock_release(&rec->lock);
+        session_drop(sess);
+        return NULL;
+    }
+
+    return sess;
+}
+
+static int embedded_lookup(const struct uniauth_embedded_op* op,
+    struct uniauth_storage* record,int64_t now)
+{
+    int kind = UNIAUTH_PROTO_RESPONSE_RECORD;
+    uint32_t hash = embedded_hash(op->key,op->keySz);
+    struct embedded_bucket* bucket = embedded_bucket(hash);
+    struct embedded_session* sess;
+    struct embedded_record* rec;
+    struct embedded_record copy;
+
+    lock_acquire(&bucket->lock);
+    sess = session_lookup(bucket,hash,op->key,op->keySz,now);
+    if (sess == NULL) {
+        lock_release(&bucket->lock);
+        return UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+
+    rec = embedded_record(sess->record);
+    if (op->op == UNIAUTH_PROTO_LOOKUP_TOUCH) {
+        record_touch(rec,op,now);
+    }
+    if (op->op == UNIAUTH_PROTO_LOOKUP_IF_CHANGED && rec->revision == op->revision) {
+        kind = UNIAUTH_PROTO_RESPONSE_NOT_MODIFIED;
+    }
+    else {
+        memcpy(&copy,rec,sizeof(struct embedded_record));
+    }
+    lock_release(&rec->lock);
+    lock_release(&bucket->lock);
+
+    if (kind == UNIAUTH_PROTO_RESPONSE_RECORD && record != NULL) {
+        record_read(&copy,op->key,op->keySz,record);
+    }
+    return kind;
+}
+
+static int embedded_write(const struct uniauth_embedded_op* op,
+    struct uniauth_storage* record,int64_t now)
+{
+    /* COMMIT, UPSERT and CAS update the record of an existing session; CREATE
+     * (and UPSERT) add a new session.
+     */
+
+    int kind = UNIAUTH_PROTO_RESPONSE_MESSAGE;
+    uint32_t hash = embedded_hash(op->key,op->keySz);
+    struct embedded_bucket* bucket = embedded_bucket(hash);
+    struct embedded_session* sess;
+    struct embedded_record* rec;
+    struct embedded_record copy;
+
+    lock_acquire(&bucket->lock);
+    sess = session_lookup(bucket,hash,op->key,op->keySz,now);
+    if (sess == NULL) {
+        if (op->op == UNIAUTH_PROTO_CREATE || op->op == UNIAUTH_PROTO_UPSERT) {
+            kind = session_create(bucket,hash,op,now);
+        }
+        else {
+            kind = UNIAUTH_PROTO_RESPONSE_ERROR;
+        }
+        lock_release(&bucket->lock);
+        return kind;
+    }
+
+    rec = embedded_record(sess->record);
+    if (op->op == UNIAUTH_PROTO_CREATE) {
+        kind = UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+    else if (op->op == UNIAUTH_PROTO_CAS && rec->revision != op->revision) {
+        kind = UNIAUTH_PROTO_RESPONSE_RECORD;
+        memcpy(&copy,rec,sizeof(struct embedded_record));
+    }
+    else if (!record_write(rec,op,now)) {
+        kind = UNIAUTH_PROTO_RESPONSE_ERROR;
+    }
+    lock_release(&rec->lock);
+    lock_release(&bucket->lock);
+
+    if (kind == UNIAUTH_PROTO_RESPONSE_RECORD && record != NULL) {
+        record_read(&copy,op->key,op->keySz,record);
+    }
+    return kind;
+}
+
+static bool embedded_tag(const char* key,size_t keylen,char* tag,size_t* tagSz,
+    int64_t now)
+{
+    /* Read the tag of a session's record (for TRANSF_APPLY). */
+
+    bool found = false;
+    uint32_t hash = embedded_hash(key,keylen);
+    struct embedded_bucket* bucket = embedded_bucket(hash);
+    struct embedded_session* sess;
+
+    lock_acquire(&bucket->lock);
+    sess = session_lookup(bucket,hash,key,keylen,now);
+    if (sess != NULL) {
+        struct embedded_record* rec = embedded_record(sess->record);
+        const char* str;
+
+        if (record_string(rec,RECORD_TAG,&str,tagSz) && *tagSz > 0
+            && *tagSz <= UNIAUTH_EMBEDDED_KEY)
+        {
+            memcpy(tag,str,*tagSz);
+            found = true;
+        }
+        lock_release(&rec->lock);
+    }
+    lock_release(&bucket->lock);
+
+    return found;
+}
+
+static int embedded_transfer(const struct uniauth_embedded_op* op,
+    struct uniauth_storage* record,int64_t now)
+{
+    /* TRANSF points the TRANSDST session at the registration record of the
+     * TRANSSRC session. TRANSF_APPLY takes the destination from the source's
+     * tag and also reports (and marks) the destination's redirect.
+     */
+
+    int kind = UNIAUTH_PROTO_RESPONSE_ERROR;
+    bool apply = (op->op == UNIAUTH_PROTO_TRANSF_APPLY);
+    char dst[UNIAUTH_EMBEDDED_KEY];
+    size_t dstlen;
+    char redirect[sizeof(((struct embedded_record*)NULL)->data)];
+    size_t redirectSz = 0;
+    bool hasRedirect = false;
+    uint32_t srcHash;
+    uint32_t dstHash;
+    uint32_t drop = 0;
+    struct embedded_bucket* srcBucket;
+    struct embedded_bucket* dstBucket;
+    struct embedded_session* from;
+    struct embedded_session* to;
+    struct embedded_record* srcRec;
+    struct embedded_record* dstRec;
+
+    if (op->src == NULL) {
+        return kind;
+    }
+    if (apply) {
+        /* The tag is checked again once everything is locked. */
+        if (!embedded_tag(op->src,op->srcSz,dst,&dstlen,now)) {
+            return kind;
+        }
+    }
+    else {
+        if (op->dst == NULL || op->dstSz > UNIAUTH_EMBEDDED_KEY) {
+            return kind;
+        }
+        memcpy(dst,op->dst,op->dstSz);
+        dstlen = op->dstSz;
+    }
+
+    srcHash = embedded_hash(op->src,op->srcSz);
+    dstHash = embedded_hash(dst,dstlen);
+    srcBucket = embedded_bucket(srcHash);
+    dstBucket = embedded_bucket(dstHash);
+
+    lock_pair(&srcBucket->lock,&dstBucket->lock);
+    from = bucket_find(srcBucket,srcHash,op->src,op->srcSz);
+    to = bucket_find(dstBucket,dstHash,dst,dstlen);
+    if (from == NULL || to == NULL || from == to) {
+        unlock_pair(&srcBucket->lock,&dstBucket->lock);
+        return kind;
+    }
+
+    srcRec = embedded_record(from->record);
+    dstRec = embedded_record(to->record);
+    lock_pair(&srcRec->lock,&dstRec->lock);
+
+    if (!record_expired(srcRec,now) && !record_expired(dstRec,now)) {
+        const char* str;
+        size_t len;
+
+        kind = apply ? UNIAUTH_PROTO_RESPONSE_RECORD : UNIAUTH_PROTO_RESPONSE_MESSAGE;
+        if (apply && (!record_string(srcRec,RECORD_TAG,&str,&len)
+                || len != dstlen || memcmp(str,dst,len) != 0))
+        {
+            kind = UNIAUTH_PROTO_RESPONSE_ERROR;
+        }
+        else if (apply) {
+            hasRedirect = record_string(dstRec,RECORD_REDIRECT,&str,&redirectSz);
+            memcpy(redirect,str,redirectSz);
+        }
+    }
+
+    if (kind != UNIAUTH_PROTO_RESPONSE_ERROR) {
+        if (srcRec != dstRec) {
+            srcRec->refs += 1;
+            dstRec->refs -= 1;
+            if (dstRec->refs == 0) {
+                drop = to->record;
+            }
+            to->record = from->record;
+        }
+
+        if (hasRedirect) {
+            struct uniauth_embedded_op mark;
+
+            memset(&mark,0,sizeof(struct uniauth_embedded_op));
+            mark.fields.redirect = "transfer";
+            mark.fields.redirectSz = sizeof("transfer") - 1;
+            mark.present = UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REDIRECT);
+            record_write(srcRec,&mark,now);
+        }
+    }
+
+    unlock_pair(&srcRec->lock,&dstRec->lock);
+    unlock_pair(&srcBucket->lock,&dstBucket->lock);
+    if (drop != 0) {
+        record_free(drop);
+    }
+
+    /* The reply to TRANSF_APPLY is the destination key and former redirect. */
+    if (kind == UNIAUTH_PROTO_RESPONSE_RECORD && record != NULL) {
+        struct uniauth_arena* arena;
+
+        arena = uniauth_arena_new(dstlen + redirectSz,hasRedirect ? 2 : 1);
+        record->key = uniauth_arena_field(arena,dst,dstlen);
+        record->keySz = dstlen;
+        if (hasRedirect) {
+            record->redirect = uniauth_arena_field(arena,redirect,redirectSz);
+            record->redirectSz = redirectSz;
+        }
+        uniauth_arena_release(arena);
+    }
+
+    return kind;
+}
+
+int uniauth_embedded_exec(const struct uniauth_embedded_op* op,
+    struct uniauth_storage* record)
+{
+    int64_t now = time(NULL);
+
+    if (record != NULL) {
+        memset(record,0,sizeof(struct uniauth_storage));
+    }
+
+    switch (op->op) {
+    case UNIAUTH_PROTO_LOOKUP:
+    case UNIAUTH_PROTO_LOOKUP_TOUCH:
+    case UNIAUTH_PROTO_LOOKUP_IF_CHANGED:
+        if (op->key != NULL) {
+            return embedded_lookup(op,record,now);
+        }
+        break;
+    case UNIAUTH_PROTO_COMMIT:
+    case UNIAUTH_PROTO_CREATE:
+    case UNIAUTH_PROTO_UPSERT:
+    case UNIAUTH_PROTO_CAS:
+        if (op->key != NULL) {
+            return embedded_write(op,record,now);
+        }
+        break;
+    case UNIAUTH_PROTO_TRANSF:
+    case UNIAUTH_PROTO_TRANSF_APPLY:
+        return embedded_transfer(op,record,now);
+    }
+
+    return UNIAUTH_PROTO_RESPONSE_ERROR;
+}
@@ -0,0 +1,66 @@
+/*
+ * embedded.h
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * The functionality provided by this module is an optional backend that keeps
+ * the session table in a shared file mapping instead of asking the uniauth
+ * daemon. The mapping is created at module startup, so it is shared by every
+ * worker forked from the process that loaded the extension, and since it is
+ * backed by a file the sessions outlive the workers (e.g. across a PHP-FPM
+ * restart). It implements the same operations as the daemon with the same
+ * semantics: sessions reference registration records, which are shared by
+ * TRANSF and freed with their last session.
+ */
+
+#ifndef UNIAUTH_EMBEDDED_H
+#define UNIAUTH_EMBEDDED_H
+#include "protocol.h"
+
+/* The optional operations the backend implements (see UNIAUTH_FEATURE_*). */
+#define UNIAUTH_EMBEDDED_FEATURES (UNIAUTH_FEATURE_LOOKUP_TOUCH     \
+        | UNIAUTH_FEATURE_TRANSF_APPLY                           \
+        | UNIAUTH_FEATURE_UPSERT                                 \
+        | UNIAUTH_FEATURE_CAS                                    \
+        | UNIAUTH_FEATURE_CLEAR                                  \
+        | UNIAUTH_FEATURE_IF_CHANGED)
+
+/* Module startup/shutdown: the table lives in the file at 'path', which is
+ * created with room for 'nsessions' sessions if it does not hold one yet. An
+ * existing table keeps its size.
+ */
+int uniauth_embedded_init(const char* path,size_t nsessions);
+void uniauth_embedded_shutdown();
+bool uniauth_embedded_active();
+
+/* An operation as it would be sent to the daemon: the op, the session keys it
+ * names and the record fields it carries. 'present' and 'cleared' are masks of
+ * UNIAUTH_FIELD_BIT bits of the fields set and cleared by the request. String
+ * fields point at the caller's strings.
+ */
+struct uniauth_embedded_op
+{
+    int op;
+    const char* key;
+    size_t keySz;
+    const char* src;          /* TRANSSRC */
+    size_t srcSz;
+    const char* dst;          /* TRANSDST */
+    size_t dstSz;
+    struct uniauth_storage fields;
+    uint32_t present;
+    uint32_t cleared;
+    int32_t threshold;
+    int64_t revision;
+};
+
+/* Performs the operation and returns the kind of reply the daemon would have
+ * sent (UNIAUTH_PROTO_RESPONSE_*). A record reply is decoded into 'record' if
+ * it is not NULL.
+ */
+int uniauth_embedded_exec(const struct uniauth_embedded_op* op,
+    struct uniauth_storage* record);
+
+#endif
@@ -49,8 +49,26 @@ struct uniauth_storage
 
     char* tag;
     size_t tagSz;
+
+    /* Revision of the record on the daemon (changes with every write) or 0 if
+     * unknown. See UNIAUTH_PROTO_CAS.
+     */
+
+    int64_t revision;
+
+    /* Fields changed since the record was read (a mask of UNIAUTH_DIRTY bits).
+     * If any are set, a commit sends just the key and these fields; a dirty
+     * field that is empty is cleared. A record with no dirty fields is sent in
+     * full (every field that is set).
+     */
+
+    uint32_t dirty;
 };
 
+/* Bit for a field type in a mask of fields (e.g. the dirty fields) */
+#define UNIAUTH_FIELD_BIT(field) (1u << (field))
+#define UNIAUTH_DIRTY(field) UNIAUTH_FIELD_BIT(field)
+
 /* Connection constants */
 
 #define SOCKET_PATH     "@uniauth"
@@ -61,11 +79,19 @@ struct uniauth_storage
 #define UNIAUTH_PROTO_COMMIT 0x01
 #define UNIAUTH_PROTO_CREATE 0x02
 #define UNIAUTH_PROTO_TRANSF 0x03
-#define UNIAUTH_OP_TOP       0x04
+#define UNIAUTH_PROTO_HELLO  0x04
+#define UNIAUTH_PROTO_LOOKUP_TOUCH 0x05
+#define UNIAUTH_PROTO_TRANSF_APPLY 0x06
+#define UNIAUTH_PROTO_UPSERT 0x07
+#define UNIAUTH_PROTO_CAS    0x08
+#define UNIAUTH_PROTO_LOOKUP_IF_CHANGED 0x09
+#define UNIAUTH_PROTO_RING   0x0a
+#define UNIAUTH_OP_TOP       0x0b
 
 #define UNIAUTH_PROTO_RESPONSE_MESSAGE 0x00
 #define UNIAUTH_PROTO_RESPONSE_ERROR   0x01
 #define UNIAUTH_PROTO_RESPONSE_RECORD  0x02
+#define UNIAUTH_PROTO_RESPONSE_NOT_MODIFIED 0x03
 
 #define UNIAUTH_PROTO_FIELD_KEY      0x00
 #define UNIAUTH_PROTO_FIELD_ID       0x01
@@ -77,13 +103,197 @@ struct uniauth_storage
 #define UNIAUTH_PROTO_FIELD_TRANSDST 0x07
 #define UNIAUTH_PROTO_FIELD_TAG      0x08
 #define UNIAUTH_PROTO_FIELD_LIFETIME 0x09
+#define UNIAUTH_PROTO_FIELD_VERSION  0x0a
+#define UNIAUTH_PROTO_FIELD_FEATURES 0x0b
+#define UNIAUTH_PROTO_FIELD_THRESHOLD 0x0c
+#define UNIAUTH_PROTO_FIELD_REVISION 0x0d
+#define UNIAUTH_PROTO_FIELD_MASK     0x0e
 #define UNIAUTH_PROTO_FIELD_END      (char)0xff
 
+/* Flag on a field type in a request: the field carries no value and is to be
+ * cleared (see UNIAUTH_FEATURE_CLEAR).
+ */
+#define UNIAUTH_PROTO_FIELD_CLEAR    0x80
+
+/* Flag on a field type in a request: the field carries the digest of a
+ * session key instead of the key (see UNIAUTH_FEATURE_KEY_DIGEST).
+ */
+#define UNIAUTH_PROTO_FIELD_DIGEST   0x40
+
 #define UNIAUTH_INT_SZ  4
 #define UNIAUTH_TIME_SZ 8
+#define UNIAUTH_KEY_DIGEST_SZ 16
 
 #define UNIAUTH_MAX_MESSAGE 4096
 
+/* Protocol versions: version 1 messages are an op (or response kind) byte
+ * followed by fields, each a type byte and a null-terminated string or
+ * little-endian integer, and end with FIELD_END. Version 2 messages start with
+ * a fixed header of op (or kind), flags, two reserved bytes (but see
+ * UNIAUTH_FEATURE_MULTIPLEX) and the little-endian 32-bit length of the rest
+ * of the message. Each field is then a type byte, a little-endian 32-bit
+ * value length and the value, so strings are binary-safe and need no
+ * terminator. A message or error response carries its text as the whole
+ * payload.
+ *
+ * Connections start out with version 1. A client may send HELLO with a VERSION
+ * field holding the highest version it supports. A daemon that understands it
+ * replies (in version 1) with a record carrying the VERSION it picked, and
+ * both sides use that version from the next message on. Older daemons reply
+ * with an error, in which case the connection stays at version 1. The reply
+ * may also carry a FEATURES field, a bit mask of the optional operations
+ * (UNIAUTH_FEATURE_*) that the daemon supports; clients must not send those
+ * unless advertised.
+ */
+
+#define UNIAUTH_PROTOCOL_V1 1
+#define UNIAUTH_PROTOCOL_V2 2
+
+#define UNIAUTH_PROTO_V2_HEADER 8
+#define UNIAUTH_MAX_MESSAGE_V2  (1 << 20)
+
+/* Packet transport: over a SOCK_SEQPACKET socket every packet holds a single
+ * message or, for messages longer than UNIAUTH_MAX_PACKET (which only version
+ * 2 allows), part of one. Such a message is split over consecutive packets of
+ * at most that size. A reader can thus take in a whole message with a single
+ * read in the common case and never sees two messages in one read.
+ */
+#define UNIAUTH_MAX_PACKET 4096
+
+/* Ring transport: a pair of single-producer, single-consumer byte rings in a
+ * shared memory segment created by the daemon (see UNIAUTH_FEATURE_SHM_RING).
+ * The request ring carries messages from client to daemon and the response
+ * ring the replies, framed exactly as on the socket. Each ring has free
+ * running byte counters: the writer advances 'head' after copying data in and
+ * the reader advances 'tail' after copying data out, both with release
+ * semantics. The data area holds 'size' bytes (a power of two) and byte n of
+ * the stream lives at offset n & (size-1).
+ *
+ * A reader that finds its ring empty (or a writer that finds it full) sets its
+ * waiting flag, checks the counters again and then sleeps in FUTEX_WAIT on the
+ * other side's counter. After advancing its own counter, a side only calls
+ * FUTEX_WAKE if the other side's flag is set, so no system calls are made while
+ * both sides keep up. The flags and counters are accessed sequentially
+ * consistent around the check.
+ *
+ * The segment begins with a header followed by the request and response data
+ * areas. Every part starts on its own cache line.
+ */
+
+#define UNIAUTH_RING_MAGIC 0x676e6972 /* "ring" */
+#define UNIAUTH_RING_LINE  64
+
+struct uniauth_ring_ctl
+{
+    uint32_t head;          /* bytes ever written (wraps around) */
+    uint32_t readerWaiting; /* reader sleeps on 'head' */
+    char pad0[UNIAUTH_RING_LINE - 8];
+    uint32_t tail;          /* bytes ever read (wraps around) */
+    uint32_t writerWaiting; /* writer sleeps on 'tail' */
+    char pad1[UNIAUTH_RING_LINE - 8];
+};
+
+struct uniauth_ring_segment
+{
+    uint32_t magic;         /* UNIAUTH_RING_MAGIC */
+    uint32_t size;          /* bytes in the data area of each ring */
+    char pad[UNIAUTH_RING_LINE - 8];
+    struct uniauth_ring_ctl request;
+    struct uniauth_ring_ctl response;
+};
+
+/* Optional operations */
+
+/* LOOKUP_TOUCH: looks up KEY like LOOKUP. If the record is authenticated (has
+ * a valid id) and its expiration is unset or less than THRESHOLD percent of
+ * its lifetime away, the daemon first extends the expiration to the lifetime
+ * from now. The record's own lifetime is used if positive, otherwise the
+ * LIFETIME field of the request. The reply is the (updated) record.
+ */
+#define UNIAUTH_FEATURE_LOOKUP_TOUCH 0x01
+
+/* TRANSF_APPLY: completes an auth flow in one atomic step. The daemon looks up
+ * the TRANSSRC record, whose TAG names the applicant (destination) record,
+ * and transfers the source registration to it like TRANSF. If the destination
+ * had a redirect URI, the source's REDIRECT is then set to "transfer". The
+ * reply is a record with the destination's KEY and the REDIRECT it had before
+ * the transfer. An error is returned (and nothing is changed) if either record
+ * does not exist or the source has no TAG.
+ */
+#define UNIAUTH_FEATURE_TRANSF_APPLY 0x02
+
+/* UPSERT: applies the fields like COMMIT if the KEY record exists, otherwise
+ * creates it like CREATE. The reply is the same as for those operations.
+ */
+#define UNIAUTH_FEATURE_UPSERT 0x04
+
+/* CAS: applies the fields like COMMIT, but only if the record's current
+ * revision equals the REVISION field of the request. A daemon supporting CAS
+ * includes the (64-bit) REVISION in every record it returns. If the revision
+ * does not match, nothing is changed and the reply is the current record.
+ */
+#define UNIAUTH_FEATURE_CAS 0x08
+
+/* Clearing fields: COMMIT, UPSERT and CAS only change the fields present in a
+ * request. A daemon advertising this feature accepts fields flagged with
+ * UNIAUTH_PROTO_FIELD_CLEAR (with no value, or an empty value in version 2) to
+ * remove a string or reset an integer to 0. Otherwise a string can only be
+ * set to the empty string.
+ */
+#define UNIAUTH_FEATURE_CLEAR 0x10
+
+/* Projections: LOOKUP and LOOKUP_TOUCH accept a MASK field holding the
+ * UNIAUTH_FIELD_BIT bits of the record fields to return. The reply then
+ * carries only those fields (the ones that are set). Without a MASK the whole
+ * record is returned.
+ */
+#define UNIAUTH_FEATURE_PROJECTION 0x20
+
+/* LOOKUP_IF_CHANGED: revalidates a copy of the KEY record that the client
+ * read at revision REVISION. If the record still has that revision, the reply
+ * is NOT_MODIFIED, which carries no fields (in version 1 it is the kind byte
+ * followed by FIELD_END). Otherwise the reply is the same as for LOOKUP.
+ */
+#define UNIAUTH_FEATURE_IF_CHANGED 0x40
+
+/* Key digests: the KEY, TRANSSRC and TRANSDST fields of a request may be
+ * flagged with UNIAUTH_PROTO_FIELD_DIGEST and carry a UNIAUTH_KEY_DIGEST_SZ
+ * byte keyed digest of the session key (in version 1 as raw bytes without a
+ * terminator). The daemon finds records by digest, so all clients must agree
+ * on whether and how keys are digested. Records stored under a digest have no
+ * KEY in replies. TRANSF_APPLY cannot be used with digests since the TAG holds
+ * a plain key.
+ */
+#define UNIAUTH_FEATURE_KEY_DIGEST 0x80
+
+/* SHM_RING: the client may send RING (with no fields) to move the connection
+ * to the ring transport. The daemon replies with a message response and, as
+ * SCM_RIGHTS ancillary data, a descriptor for a new shared memory segment; it
+ * replies with an error (and no descriptor) if it cannot provide one. After a
+ * successful reply all messages in both directions go through the rings. The
+ * socket stays open only so that each side notices when the other goes away.
+ */
+#define UNIAUTH_FEATURE_SHM_RING 0x100
+
+/* MULTIPLEX: in version 2, a client may put a nonzero request ID in the two
+ * reserved header bytes (little-endian) of a request. The daemon copies the ID
+ * into the header of the reply and may answer such requests in any order, so
+ * the client must match replies to requests by ID. Requests with ID 0 are
+ * answered in order as before. This lets many clients share a connection.
+ */
+#define UNIAUTH_FEATURE_MULTIPLEX 0x200
+
+/* All the fields of a record */
+#define UNIAUTH_FIELDS_RECORD (UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_KEY)  \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID)                     \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_USER)                   \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_DISPLAY)                \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_EXPIRE)                 \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REDIRECT)               \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_TAG)                    \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_LIFETIME)               \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REVISION))
+
 /* Other macros */
 
 /* In uniauth, an id is valid if it is a positive integer. */
@@ -0,0 +1,234 @@
+/*
+ * ring.c
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "ring.h"
+#include "uniauth.h"
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+/* Times to poll a ring before going to sleep on it. The daemon usually answers
+ * within microseconds, so a short spin often saves both futex calls.
+ */
+#define UNIAUTH_RING_SPIN 512
+
+struct uniauth_ring
+{
+    struct uniauth_ring_segment* seg;
+    size_t mapSz;
+    uint32_t size;
+    char* tx;                 /* request data */
+    char* rx;                 /* response data */
+};
+
+struct uniauth_ring* uniauth_ring_attach(int fd)
+{
+    struct stat st;
+    void* addr;
+    struct uniauth_ring_segment* seg;
+    struct uniauth_ring* ring;
+    uint32_t size;
+
+    if (fstat(fd,&st) == -1) {
+        return NULL;
+    }
+    if ((size_t)st.st_size < sizeof(struct uniauth_ring_segment)) {
+        errno = EPROTO;
+        return NULL;
+    }
+
+    addr = mmap(NULL,st.st_size,PROT_READ | PROT_WRITE,MAP_SHARED,fd,0);
+    if (addr == MAP_FAILED) {
+        return NULL;
+    }
+    seg = addr;
+
+    /* Each ring must hold at least two messages so that a full message can
+     * always be written while the daemon is working on another.
+     */
+    size = seg->size;
+    if (seg->magic != UNIAUTH_RING_MAGIC || (size & (size-1)) != 0
+        || size < 2 * UNIAUTH_MAX_MESSAGE
+        || (size_t)st.st_size < sizeof(struct uniauth_ring_segment) + 2 * (size_t)size)
+    {
+        munmap(addr,st.st_size);
+        errno = EPROTO;
+        return NULL;
+    }
+
+    ring = pemalloc(sizeof(struct uniauth_ring),1);
+    ring->seg = seg;
+    ring->mapSz = st.st_size;
+    ring->size = size;
+    ring->tx = (char*)addr + sizeof(struct uniauth_ring_segment);
+    ring->rx = ring->tx + size;
+
+    return ring;
+}
+
+void uniauth_ring_detach(struct uniauth_ring* ring)
+{
+    munmap(ring->seg,ring->mapSz);
+    pefree(ring,1);
+}
+
+size_t uniauth_ring_capacity(const struct uniauth_ring* ring)
+{
+    return ring->size;
+}
+
+size_t uniauth_ring_space(const struct uniauth_ring* ring)
+{
+    const struct uniauth_ring_ctl* ctl = &ring->seg->request;
+    uint32_t head = __atomic_load_n(&ctl->head,__ATOMIC_RELAXED);
+    uint32_t tail = __atomic_load_n(&ctl->tail,__ATOMIC_ACQUIRE);
+
+    /* A bogus tail only means the daemon's reads are wrong; never write past
+     * what it has acknowledged.
+     */
+    if (head - tail > ring->size) {
+        return 0;
+    }
+    return ring->size - (head - tail);
+}
+
+static inline void ring_wake(uint32_t* word,uint32_t* waiting)
+{
+    /* Pairs with the fence in uniauth_ring_wait(): either the sleeper sees the
+     * new counter or we see its flag.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(waiting,__ATOMIC_RELAXED)) {
+        syscall(SYS_futex,word,FUTEX_WAKE,1,NULL,NULL,0);
+    }
+}
+
+size_t uniauth_ring_write(struct uniauth_ring* ring,const char* src,size_t n)
+{
+    struct uniauth_ring_ctl* ctl = &ring->seg->request;
+    uint32_t head = __atomic_load_n(&ctl->head,__ATOMIC_RELAXED);
+    size_t space = uniauth_ring_space(ring);
+    size_t offset;
+    size_t first;
+
+    if (n > space) {
+        n = space;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    offset = head & (ring->size - 1);
+    first = ring->size - offset;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(ring->tx + offset,src,first);
+    memcpy(ring->tx,src + first,n - first);
+
+    __atomic_store_n(&ctl->head,head + (uint32_t)n,__ATOMIC_RELEASE);
+    ring_wake(&ctl->head,&ctl->readerWaiting);
+
+    return n;
+}
+
+ssize_t uniauth_ring_read(struct uniauth_ring* ring,char* dst,size_t n)
+{
+    struct uniauth_ring_ctl* ctl = &ring->seg->response;
+    uint32_t tail = __atomic_load_n(&ctl->tail,__ATOMIC_RELAXED);
+    uint32_t head = __atomic_load_n(&ctl->head,__ATOMIC_ACQUIRE);
+    size_t avail = head - tail;
+    size_t offset;
+    size_t first;
+
+    if (avail > ring->size) {
+        errno = EPROTO;
+        return -1;
+    }
+    if (n > avail) {
+        n = avail;
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    offset = tail & (ring->size - 1);
+    first = ring->size - offset;
+    if (first > n) {
+        first = n;
+    }
+    memcpy(dst,ring->rx + offset,first);
+    memcpy(dst + first,ring->rx,n - first);
+
+    __atomic_store_n(&ctl->tail,tail + (uint32_t)n,__ATOMIC_RELEASE);
+    ring_wake(&ctl->tail,&ctl->writerWaiting);
+
+    return n;
+}
+
+static inline bool ring_ready(struct uniauth_ring* ring,bool writable,
+    uint32_t counter)
+{
+    if (writable) {
+        struct uniauth_ring_ctl* ctl = &ring->seg->request;
+
+        return __atomic_load_n(&ctl->head,__ATOMIC_RELAXED) - counter < ring->size;
+    }
+    return counter != __atomic_load_n(&ring->seg->response.tail,__ATOMIC_RELAXED);
+}
+
+int uniauth_ring_wait(struct uniauth_ring* ring,bool writable,int timeout)
+{
+    /* A writer waits for the daemon to move the request ring's tail and a
+     * reader for it to move the response ring's head.
+     */
+    uint32_t* word;
+    uint32_t* waiting;
+    uint32_t counter;
+    struct timespec ts;
+    int i;
+    long r;
+
+    if (writable) {
+        word = &ring->seg->request.tail;
+        waiting = &ring->seg->request.writerWaiting;
+    }
+    else {
+        word = &ring->seg->response.head;
+        waiting = &ring->seg->response.readerWaiting;
+    }
+
+    for (i = 0;i < UNIAUTH_RING_SPIN;++i) {
+        counter = __atomic_load_n(word,__ATOMIC_ACQUIRE);
+        if (ring_ready(ring,writable,counter)) {
+            return 0;
+        }
+    }
+
+    __atomic_store_n(waiting,1,__ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    counter = __atomic_load_n(word,__ATOMIC_RELAXED);
+    if (ring_ready(ring,writable,counter)) {
+        __atomic_store_n(waiting,0,__ATOMIC_RELAXED);
+        return 0;
+    }
+
+    if (timeout >= 0) {
+        ts.tv_sec = timeout / 1000;
+        ts.tv_nsec = (long)(timeout % 1000) * 1000000;
+    }
+    r = syscall(SYS_futex,word,FUTEX_WAIT,counter,timeout >= 0 ? &ts : NULL,NULL,0);
+    __atomic_store_n(waiting,0,__ATOMIC_RELAXED);
+
+    return r == -1 && errno == ETIMEDOUT ? 1 : 0;
+}
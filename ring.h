@@ -0,0 +1,47 @@
+/*
+ * ring.h
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * The functionality provided by this module is the client side of the ring
+ * transport (see UNIAUTH_FEATURE_SHM_RING): it maps a segment passed by the
+ * daemon and moves bytes through its rings. Waiting for the daemon uses
+ * futexes; the caller decides how long to wait and checks the socket for
+ * hangups in between.
+ */
+
+#ifndef UNIAUTH_RING_H
+#define UNIAUTH_RING_H
+#include "protocol.h"
+#include <sys/types.h>
+
+struct uniauth_ring;
+
+/* Maps the segment behind 'fd' (which the caller still owns). NULL is returned
+ * with errno set if the segment is not a valid ring segment.
+ */
+struct uniauth_ring* uniauth_ring_attach(int fd);
+void uniauth_ring_detach(struct uniauth_ring* ring);
+
+/* Number of bytes each ring holds and number of bytes that can be written to
+ * the request ring right now.
+ */
+size_t uniauth_ring_capacity(const struct uniauth_ring* ring);
+size_t uniauth_ring_space(const struct uniauth_ring* ring);
+
+/* I/O: copy as many bytes as fit (or are available) without waiting and
+ * return the count. Reading returns -1 if the daemon left the response ring in
+ * an inconsistent state.
+ */
+size_t uniauth_ring_write(struct uniauth_ring* ring,const char* src,size_t n);
+ssize_t uniauth_ring_read(struct uniauth_ring* ring,char* dst,size_t n);
+
+/* Waits up to 'timeout' milliseconds (-1 meaning indefinitely) for the request
+ * ring to have space or the response ring to have data. Returns 1 on timeout,
+ * otherwise 0 (possibly before the ring became ready).
+ */
+int uniauth_ring_wait(struct uniauth_ring* ring,bool writable,int timeout);
+
+#endif
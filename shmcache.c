@@ -0,0 +1,530 @@
+/*
+ * shmcache.c
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ */
+
+#include "shmcache.h"
+#include "connect.h"
+#include "uniauth.h"
+#include <string.h>
+#include <sched.h>
+#include <sys/mman.h>
+
+/* The table is a fixed array of cache-line aligned slots. A key hashes to a
+ * home slot and may live anywhere in a small window following it (open
+ * addressing). Lookups examine the whole window so that removing an entry never
+ * needs a tombstone.
+ *
+ * Each slot is guarded by a sequence lock: writers make the sequence odd while
+ * they modify the slot and readers copy the slot optimistically, discarding the
+ * copy if the sequence changed underneath them. Readers therefore never write
+ * to shared memory. Writers that cannot claim a slot simply give up since this
+ * is only a cache.
+ */
+
+#define UNIAUTH_SHMCACHE_LINE  64
+#define UNIAUTH_SHMCACHE_SLOT  512
+#define UNIAUTH_SHMCACHE_PROBE 8
+#define UNIAUTH_SHMCACHE_SPIN  1024
+
+#define SLOT_HAS_USER     0x01
+#define SLOT_HAS_DISPLAY  0x02
+#define SLOT_HAS_REDIRECT 0x04
+#define SLOT_HAS_TAG      0x08
+
+struct uniauth_shmcache_slot
+{
+    uint32_t seq;           /* sequence lock; odd while being written */
+    uint32_t hash;          /* key hash; zero marks an empty slot */
+    int32_t id;
+    int32_t lifetime;
+    int64_t expire;
+    int64_t deadline;       /* UNIX timestamp after which the slot is stale */
+    int64_t revision;       /* record revision (if known) for revalidation */
+
+    uint16_t keySz;
+    uint16_t usernameSz;
+    uint16_t displayNameSz;
+    uint16_t redirectSz;
+    uint16_t tagSz;
+    uint8_t flags;
+    uint8_t pad[5];
+
+    /* Strings are packed back-to-back (without terminators) in field order:
+     * key, username, displayName, redirect, tag.
+     */
+    char data[UNIAUTH_SHMCACHE_SLOT - 56];
+} __attribute__((aligned(UNIAUTH_SHMCACHE_LINE)));
+
+struct uniauth_shmcache_header
+{
+    /* Bumped by every invalidation so that stores based on a lookup that
+     * started before the invalidation can be discarded.
+     */
+    uint64_t generation;
+} __attribute__((aligned(UNIAUTH_SHMCACHE_LINE)));
+
+static struct uniauth_shmcache_header* header = NULL;
+static struct uniauth_shmcache_slot* slots = NULL;
+static size_t mapsz = 0;
+static uint32_t mask = 0;
+static int cachettl = 0;
+
+int uniauth_shmcache_init(size_t nslots,int ttl)
+{
+    size_t n = UNIAUTH_SHMCACHE_PROBE;
+    void* mem;
+
+    if (sizeof(struct uniauth_shmcache_slot) != UNIAUTH_SHMCACHE_SLOT) {
+        return -1;
+    }
+
+    while (n < nslots) {
+        n <<= 1;
+    }
+
+    /* The mapping is anonymous but shared so that processes forked after
+     * module startup see each other's writes. Fresh pages are zero-filled,
+     * which yields a table of empty slots.
+     */
+    mapsz = sizeof(struct uniauth_shmcache_header)
+        + n * sizeof(struct uniauth_shmcache_slot);
+    mem = mmap(NULL,mapsz,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+    if (mem == MAP_FAILED) {
+        mapsz = 0;
+        return -1;
+    }
+
+    header = mem;
+    slots = (struct uniauth_shmcache_slot*)(header + 1);
+    mask = (uint32_t)(n - 1);
+    cachettl = ttl;
+
+    return 0;
+}
+
+void uniauth_shmcache_shutdown()
+{
+    if (header != NULL) {
+        munmap(header,mapsz);
+        header = NULL;
+        slots = NULL;
+        mapsz = 0;
+    }
+}
+
+bool uniauth_shmcache_active()
+{
+    return slots != NULL;
+}
+
+/* Helpers */
+
+static inline uint32_t shmcache_hash(const char* key,size_t keylen)
+{
+    /* Zero is reserved for empty slots. */
+    return (uint32_t)zend_inline_hash_func(key,keylen) | 1;
+}
+
+static inline struct uniauth_shmcache_slot* shmcache_slot(uint32_t hash,int i)
+{
+    return slots + ((hash + i) & mask);
+}
+
+static bool slot_acquire(struct uniauth_shmcache_slot* slot,uint32_t* seq)
+{
+    uint32_t s = __atomic_load_n(&slot->seq,__ATOMIC_RELAXED);
+
+    if ((s & 1) || !__atomic_compare_exchange_n(&slot->seq,&s,s+1,false,
+            __ATOMIC_SEQ_CST,__ATOMIC_RELAXED))
+    {
+        return false;
+    }
+
+    /* Order the odd sequence before any of the writes to the slot. */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    *seq = s;
+    return true;
+}
+
+static bool slot_acquire_spin(struct uniauth_shmcache_slot* slot,uint32_t* seq)
+{
+    int n;
+
+    /* Writers hold a slot for a handful of stores. If a writer died while
+     * holding the slot its sequence stays odd and readers will never use it,
+     * so giving up eventually is harmless.
+     */
+    for (n = 0;n < UNIAUTH_SHMCACHE_SPIN;++n) {
+        if (slot_acquire(slot,seq)) {
+            return true;
+        }
+        sched_yield();
+    }
+
+    return false;
+}
+
+static inline void slot_release(struct uniauth_shmcache_slot* slot,uint32_t seq)
+{
+    __atomic_store_n(&slot->seq,seq+2,__ATOMIC_RELEASE);
+}
+
+static bool slot_settle(struct uniauth_shmcache_slot* slot)
+{
+    int n;
+
+    /* Waits until no writer holds the slot. Invalidators call this after
+     * bumping the generation: a store that claims the slot after this point
+     * sees the new generation and backs off, and a store that already held it
+     * has finished writing its hash. A slot held by a dead writer is never
+     * used by readers, so it is skipped.
+     */
+    for (n = 0;n < UNIAUTH_SHMCACHE_SPIN;++n) {
+        if ((__atomic_load_n(&slot->seq,__ATOMIC_SEQ_CST) & 1) == 0) {
+            return true;
+        }
+        sched_yield();
+    }
+
+    return false;
+}
+
+static bool slot_read(struct uniauth_shmcache_slot* slot,
+    struct uniauth_shmcache_slot* copy)
+{
+    uint32_t seq = __atomic_load_n(&slot->seq,__ATOMIC_ACQUIRE);
+
+    if (seq & 1) {
+        return false;
+    }
+    memcpy(copy,slot,sizeof(struct uniauth_shmcache_slot));
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&slot->seq,__ATOMIC_RELAXED) == seq;
+}
+
+static inline bool slot_matches(const struct uniauth_shmcache_slot* slot,
+    uint32_t hash,const char* key,size_t keylen)
+{
+    return slot->hash == hash && slot->keySz == keylen
+        && keylen <= sizeof(slot->data)
+        && memcmp(slot->data,key,keylen) == 0;
+}
+
+static void slot_clear(struct uniauth_shmcache_slot* slot,uint32_t hash,
+    const char* key,size_t keylen)
+{
+    uint32_t seq;
+
+    if (slot_acquire_spin(slot,&seq)) {
+        if (slot_matches(slot,hash,key,keylen)) {
+            slot->hash = 0;
+        }
+        slot_release(slot,seq);
+    }
+}
+
+static inline char* slot_string(struct uniauth_arena* arena,const char* src,
+    size_t sz,bool present)
+{
+    return present ? uniauth_arena_field(arena,src,sz) : NULL;
+}
+
+/* Cache API */
+
+static bool shmcache_lookup(const char* key,size_t keylen,
+    struct uniauth_storage* backing,bool stale)
+{
+    int i;
+    uint32_t hash;
+    time_t now;
+    struct uniauth_shmcache_slot copy;
+    struct uniauth_arena* arena;
+
+    if (slots == NULL) {
+        return false;
+    }
+
+    hash = shmcache_hash(key,keylen);
+    now = time(NULL);
+
+    for (i = 0;i < UNIAUTH_SHMCACHE_PROBE;++i) {
+        struct uniauth_shmcache_slot* slot = shmcache_slot(hash,i);
+        const char* p;
+        size_t total;
+
+        /* Cheap pre-check before copying the slot. */
+        if (__atomic_load_n(&slot->hash,__ATOMIC_RELAXED) != hash) {
+            continue;
+        }
+        if (!slot_read(slot,&copy) || !slot_matches(&copy,hash,key,keylen)) {
+            continue;
+        }
+
+        /* A stale slot is only of use for revalidation, which needs the
+         * revision. The record must not have expired either way.
+         */
+        if (stale) {
+            if (copy.deadline > now || copy.revision == 0 || copy.expire <= now) {
+                return false;
+            }
+        }
+        else if (copy.deadline <= now) {
+            return false;
+        }
+
+        total = (size_t)copy.keySz + copy.usernameSz + copy.displayNameSz
+            + copy.redirectSz + copy.tagSz;
+        if (total > sizeof(copy.data)) {
+            return false;
+        }
+
+        memset(backing,0,sizeof(struct uniauth_storage));
+        arena = uniauth_arena_new(total - copy.usernameSz - copy.displayNameSz,3);
+        p = copy.data;
+        backing->key = slot_string(arena,p,copy.keySz,true);
+        backing->keySz = copy.keySz;
+        p += copy.keySz;
+        if (copy.flags & SLOT_HAS_USER) {
+            backing->username = uniauth_user_field_new(p,copy.usernameSz);
+        }
+        backing->usernameSz = copy.usernameSz;
+        p += copy.usernameSz;
+        if (copy.flags & SLOT_HAS_DISPLAY) {
+            backing->displayName = uniauth_user_field_new(p,copy.displayNameSz);
+        }
+        backing->displayNameSz = copy.displayNameSz;
+        p += copy.displayNameSz;
+        backing->redirect = slot_string(arena,p,copy.redirectSz,
+            copy.flags & SLOT_HAS_REDIRECT);
+        backing->redirectSz = copy.redirectSz;
+        p += copy.redirectSz;
+        backing->tag = slot_string(arena,p,copy.tagSz,copy.flags & SLOT_HAS_TAG);
+        backing->tagSz = copy.tagSz;
+        uniauth_arena_release(arena);
+
+        backing->id = copy.id;
+        backing->expire = copy.expire;
+        backing->lifetime = copy.lifetime;
+        backing->revision = copy.revision;
+        return true;
+    }
+
+    return false;
+}
+
+bool uniauth_shmcache_lookup(const char* key,size_t keylen,
+    struct uniauth_storage* backing)
+{
+    return shmcache_lookup(key,keylen,backing,false);
+}
+
+bool uniauth_shmcache_lookup_stale(const char* key,size_t keylen,
+    struct uniauth_storage* backing)
+{
+    return shmcache_lookup(key,keylen,backing,true);
+}
+
+uint64_t uniauth_shmcache_generation()
+{
+    if (header == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&header->generation,__ATOMIC_SEQ_CST);
+}
+
+void uniauth_shmcache_store(const char* key,size_t keylen,
+    const struct uniauth_storage* stor,uint64_t generation)
+{
+    int i;
+    uint32_t hash;
+    uint32_t seq;
+    time_t now;
+    time_t deadline;
+    size_t total;
+    char* p;
+    struct uniauth_shmcache_slot* victim = NULL;
+    struct uniauth_shmcache_slot* empty = NULL;
+    struct uniauth_shmcache_slot* oldest = NULL;
+    int64_t oldestDeadline = 0;
+
+    /* Only authenticated records with a known expiration are cached. */
+    if (slots == NULL || !IS_VALID_USER_ID(stor->id) || stor->expire == 0) {
+        return;
+    }
+
+    now = time(NULL);
+    deadline = now + cachettl;
+    if (stor->expire < deadline) {
+        deadline = stor->expire;
+    }
+    if (deadline <= now) {
+        return;
+    }
+
+    /* Records that do not fit a slot are not cached. */
+    total = keylen + stor->usernameSz + stor->displayNameSz + stor->redirectSz
+        + stor->tagSz;
+    if (total > sizeof(((struct uniauth_shmcache_slot*)0)->data)
+        || stor->usernameSz > UINT16_MAX
+        || stor->displayNameSz > UINT16_MAX || stor->redirectSz > UINT16_MAX
+        || stor->tagSz > UINT16_MAX)
+    {
+        return;
+    }
+
+    /* Pick a slot in the probe window: the one already holding the key, else
+     * an empty or stale slot, else the one closest to going stale.
+     */
+    hash = shmcache_hash(key,keylen);
+    for (i = 0;i < UNIAUTH_SHMCACHE_PROBE;++i) {
+        struct uniauth_shmcache_slot* slot = shmcache_slot(hash,i);
+        uint32_t h = __atomic_load_n(&slot->hash,__ATOMIC_RELAXED);
+        int64_t d = __atomic_load_n(&slot->deadline,__ATOMIC_RELAXED);
+
+        if (h == hash) {
+            victim = slot;
+            break;
+        }
+        if (h == 0 || d <= now) {
+            if (empty == NULL) {
+                empty = slot;
+            }
+        }
+        else if (oldest == NULL || d < oldestDeadline) {
+            oldest = slot;
+            oldestDeadline = d;
+        }
+    }
+    if (victim == NULL) {
+        victim = (empty != NULL ? empty : oldest);
+    }
+
+    if (!slot_acquire(victim,&seq)) {
+        return;
+    }
+
+    /* Discard the store if an invalidation happened since the record was
+     * fetched: the record may already be out of date.
+     */
+    if (__atomic_load_n(&header->generation,__ATOMIC_SEQ_CST) != generation) {
+        slot_release(victim,seq);
+        return;
+    }
+
+    victim->hash = hash;
+    victim->id = stor->id;
+    victim->lifetime = stor->lifetime;
+    victim->expire = stor->expire;
+    victim->deadline = deadline;
+    victim->revision = stor->revision;
+    victim->keySz = (uint16_t)keylen;
+    victim->usernameSz = (uint16_t)stor->usernameSz;
+    victim->displayNameSz = (uint16_t)stor->displayNameSz;
+    victim->redirectSz = (uint16_t)stor->redirectSz;
+    victim->tagSz = (uint16_t)stor->tagSz;
+    victim->flags = (stor->username != NULL ? SLOT_HAS_USER : 0)
+        | (stor->displayName != NULL ? SLOT_HAS_DISPLAY : 0)
+        | (stor->redirect != NULL ? SLOT_HAS_REDIRECT : 0)
+        | (stor->tag != NULL ? SLOT_HAS_TAG : 0);
+
+    p = victim->data;
+    memcpy(p,key,keylen);
+    p += keylen;
+    if (stor->username != NULL) {
+        memcpy(p,stor->username,stor->usernameSz);
+        p += stor->usernameSz;
+    }
+    if (stor->displayName != NULL) {
+        memcpy(p,stor->displayName,stor->displayNameSz);
+        p += stor->displayNameSz;
+    }
+    if (stor->redirect != NULL) {
+        memcpy(p,stor->redirect,stor->redirectSz);
+        p += stor->redirectSz;
+    }
+    if (stor->tag != NULL) {
+        memcpy(p,stor->tag,stor->tagSz);
+    }
+
+    slot_release(victim,seq);
+}
+
+void uniauth_shmcache_invalidate(const char* key,size_t keylen)
+{
+    int i;
+    uint32_t hash;
+
+    if (slots == NULL) {
+        return;
+    }
+
+    __atomic_add_fetch(&header->generation,1,__ATOMIC_SEQ_CST);
+
+    hash = shmcache_hash(key,keylen);
+    for (i = 0;i < UNIAUTH_SHMCACHE_PROBE;++i) {
+        struct uniauth_shmcache_slot* slot = shmcache_slot(hash,i);
+
+        if (slot_settle(slot)
+            && __atomic_load_n(&slot->hash,__ATOMIC_RELAXED) == hash)
+        {
+            slot_clear(slot,hash,key,keylen);
+        }
+    }
+}
+
+void uniauth_shmcache_invalidate_user(const char* username,size_t usernameSz)
+{
+    uint32_t i;
+    struct uniauth_shmcache_slot copy;
+
+    if (slots == NULL || username == NULL) {
+        return;
+    }
+
+    __atomic_add_fetch(&header->generation,1,__ATOMIC_SEQ_CST);
+
+    /* This walks the whole table. It is only done for writes that change the
+     * login state of a registration (register and purge), which are rare next
+     * to lookups.
+     */
+    for (i = 0;i <= mask;++i) {
+        struct uniauth_shmcache_slot* slot = slots + i;
+
+        if (!slot_settle(slot)
+            || __atomic_load_n(&slot->hash,__ATOMIC_RELAXED) == 0)
+        {
+            continue;
+        }
+
+        /* A torn read is treated as a match; the key comparison is redone
+         * under the lock.
+         */
+        if (slot_read(slot,&copy)) {
+            if (!(copy.flags & SLOT_HAS_USER) || copy.usernameSz != usernameSz
+                || (size_t)copy.keySz + usernameSz > sizeof(copy.data)
+                || memcmp(copy.data + copy.keySz,username,usernameSz) != 0)
+            {
+                continue;
+            }
+            slot_clear(slot,copy.hash,copy.data,copy.keySz);
+        }
+        else {
+            uint32_t seq;
+
+            if (slot_acquire_spin(slot,&seq)) {
+                if (slot->usernameSz == usernameSz
+                    && (size_t)slot->keySz + usernameSz <= sizeof(slot->data)
+                    && memcmp(slot->data + slot->keySz,username,usernameSz) == 0)
+                {
+                    slot->hash = 0;
+                }
+                slot_release(slot,seq);
+            }
+        }
+    }
+}
@@ -0,0 +1,48 @@
+/*
+ * shmcache.h
+ *
+ * This file is a part of php-uniauth.
+ *
+ * Copyright (C) Roger P. Gee
+ *
+ * The functionality provided by this module is an optional lookup cache that
+ * lives in an anonymous shared memory mapping created at module startup. Since
+ * the mapping is inherited by every worker forked from the process that loaded
+ * the extension (e.g. the PHP-FPM master), authenticated records looked up by
+ * one worker can be reused by all of them for a short time.
+ */
+
+#ifndef UNIAUTH_SHMCACHE_H
+#define UNIAUTH_SHMCACHE_H
+#include "protocol.h"
+
+/* Module startup/shutdown: 'nslots' is rounded up to a power of two and 'ttl'
+ * caps the number of seconds an entry may be served.
+ */
+int uniauth_shmcache_init(size_t nslots,int ttl);
+void uniauth_shmcache_shutdown();
+bool uniauth_shmcache_active();
+
+/* Lookup/store: the generation must be sampled before the record is fetched
+ * from the daemon so that a store racing with an invalidation is discarded.
+ */
+bool uniauth_shmcache_lookup(const char* key,size_t keylen,
+    struct uniauth_storage* backing);
+uint64_t uniauth_shmcache_generation();
+void uniauth_shmcache_store(const char* key,size_t keylen,
+    const struct uniauth_storage* stor,uint64_t generation);
+
+/* Looks up an entry that is past its deadline (but whose record has not
+ * expired) so that the caller can revalidate it with the daemon (see
+ * UNIAUTH_PROTO_LOOKUP_IF_CHANGED) and store it again.
+ */
+bool uniauth_shmcache_lookup_stale(const char* key,size_t keylen,
+    struct uniauth_storage* backing);
+
+/* Invalidation: by session key or by every key whose record carries the
+ * specified user name (i.e. possible aliases of a registration).
+ */
+void uniauth_shmcache_invalidate(const char* key,size_t keylen);
+void uniauth_shmcache_invalidate_user(const char* username,size_t usernameSz);
+
+#endif
@@ -0,0 +1,121 @@
+<?php
+
+/**
+ * bench.php - uniauth/test
+ *
+ * Measures the round-trip latency of lookups against a running uniauth daemon.
+ *
+ *   php test/bench.php [--size=BYTES] [--missing] [count]
+ *
+ * By default the script first registers 'count' sessions whose records take
+ * about BYTES bytes (4096 unless given), half of it in the tag, and then looks
+ * each of them up once.
+ * Every lookup thus goes to the daemon (the request cache only knows keys that
+ * were already looked up) and the daemon sends back the whole record, so this
+ * times the framing and decoding of large replies. Leave uniauth.shm_cache off.
+ * The sessions expire after a minute. Protocol version 1 limits messages to
+ * 4096 bytes, so use a smaller size with uniauth.protocol=1.
+ *
+ * With --missing, the lookups use fresh keys that do not exist instead, which
+ * times the (short) not-found reply.
+ *
+ * Compare the transports by running the script once for each, e.g.:
+ *
+ *   php -d uniauth.socket_path=@uniauth test/bench.php 100000
+ *   php -d uniauth.socket_path=seqpacket:@uniauth test/bench.php 100000
+ *   php -d uniauth.shm_ring=1 test/bench.php 100000
+ *   php -d uniauth.socket_path=tcp://127.0.0.1:7033 test/bench.php 100000
+ *
+ * The timed loop is bracketed by stat() calls on two paths under
+ * /uniauth-bench/ so that a trace of the script can be cut down to the
+ * lookups. test/bench.sh runs the script for each transport and reports the
+ * latency and the syscalls per lookup from such a trace.
+ */
+
+if (!function_exists('uniauth_lookup_many')) {
+    error_log("uniauth extension is not enabled");
+    exit(1);
+}
+
+$count = 10000;
+$size = 4096;
+$missing = false;
+foreach (array_slice($argv,1) as $arg) {
+    if ($arg == '--missing') {
+        $missing = true;
+    }
+    else if (strncmp($arg,'--size=',7) == 0) {
+        $size = max(64,(int)substr($arg,7));
+    }
+    else {
+        $count = max(1,(int)$arg);
+    }
+}
+
+/* The records are kept (and copied into the request cache) until the script
+ * ends.
+ */
+ini_set('memory_limit','-1');
+
+$prefix = bin2hex(random_bytes(8));
+$keys = [];
+for ($i = 0;$i < $count;++$i) {
+    $keys[] = "$prefix-$i";
+}
+
+/* Register the sessions. uniauth_apply() takes the tag from the 'uniauth'
+ * query parameter.
+ */
+if (!$missing) {
+    $name = str_repeat('u',intdiv($size,4));
+    $display = str_repeat('d',intdiv($size,4));
+    $_GET['uniauth'] = str_repeat('t',$size - 2 * intdiv($size,4));
+    foreach ($keys as $i => $key) {
+        uniauth_register($i + 1,$name,$display,$key,60);
+        uniauth_apply($key);
+    }
+}
+
+/* Establish the connection outside of the timed loop. */
+uniauth_lookup_many(["$prefix-warmup"]);
+
+/* Lookups served from a cache would not measure the transport. */
+$cached = function() {
+    $stats = uniauth_stats();
+    return $stats['cache_hits'] + $stats['shm_hits'];
+};
+$hits = $cached();
+
+$samples = [];
+@stat('/uniauth-bench/start');
+$start = hrtime(true);
+foreach ($keys as $key) {
+    $t = hrtime(true);
+    $result = uniauth_lookup_many([$key]);
+    $samples[] = hrtime(true) - $t;
+    if (!$missing && !isset($result[$key])) {
+        error_log("lookup of '$key' found no session");
+        exit(1);
+    }
+}
+$elapsed = hrtime(true) - $start;
+@stat('/uniauth-bench/stop');
+$hits = $cached() - $hits;
+
+sort($samples);
+$pct = function($p) use($samples,$count) {
+    return $samples[min($count - 1,(int)($count * $p))] / 1000;
+};
+
+printf("socket:   %s\n",ini_get('uniauth.socket_path'));
+printf("shm ring: %s\n",ini_get('uniauth.shm_ring') ? "requested" : "off");
+printf("records:  %s\n",$missing ? "none (not found)" : "$size bytes");
+printf("lookups:  %d\n",$count);
+if ($hits > 0) {
+    printf("cached:   %d (not timing the daemon)\n",$hits);
+}
+printf("total:    %.3f s\n",$elapsed / 1e9);
+printf("rate:     %.0f lookups/s\n",$count / ($elapsed / 1e9));
+printf("p50:      %.1f us\n",$pct(0.50));
+printf("p99:      %.1f us\n",$pct(0.99));
+printf("max:      %.1f us\n",$samples[$count - 1] / 1000);
@@ -0,0 +1,72 @@
+#!/bin/sh
+#
+# bench.sh - uniauth/test
+#
+# Compares the transports to a running uniauth daemon with bench.php. Each
+# transport is run twice: once on its own for the latency, and once under
+# strace, whose trace is cut down to the timed lookups to count the syscalls
+# per lookup. The futex column shows how often the ring transport had to wait
+# for or wake the daemon; the other transports never use futexes.
+#
+#   test/bench.sh [count] [size]
+#
+# The daemon is expected at $UNIAUTH_SOCKET (default: @uniauth). Further php
+# options (e.g. -d extension=...) may be given in $PHP_ARGS.
+
+count=${1:-10000}
+size=${2:-4096}
+socket=${UNIAUTH_SOCKET:-@uniauth}
+dir=$(dirname "$0")
+trace=$(mktemp)
+trap 'rm -f "$trace"' EXIT
+
+if ! command -v strace >/dev/null 2>&1; then
+    echo "bench.sh: strace is required" >&2
+    exit 1
+fi
+
+run() {
+    name=$1
+    shift
+
+    out=$(php $PHP_ARGS "$@" "$dir/bench.php" --size="$size" "$count") || exit 1
+    p50=$(echo "$out" | sed -n 's/^p50: *//p')
+    p99=$(echo "$out" | sed -n 's/^p99: *//p')
+
+    strace -f -qq -o "$trace" php $PHP_ARGS "$@" "$dir/bench.php" \
+        --size="$size" "$count" >/dev/null || exit 1
+
+    # Count the calls made between the two marker stat()s. strace splits a
+    # call over two lines when another thread's call comes in between; only
+    # the first line counts.
+    awk -v count="$count" -v name="$name" -v p50="$p50" -v p99="$p99" '
+        /uniauth-bench\/start/ { on = 1; next }
+        /uniauth-bench\/stop/ { on = 0; next }
+        !on || /resumed>/ || / \+\+\+ / || / --- / { next }
+        {
+            sub(/^[0-9]+ +/,"")
+            call = $0
+            sub(/\(.*/,"",call)
+            calls[call] += 1
+            total += 1
+            if (call ~ /^recv/) {
+                reads += 1
+            }
+        }
+        END {
+            detail = ""
+            for (call in calls) {
+                detail = detail sprintf(" %s=%.2f",call,calls[call] / count)
+            }
+            printf "%-12s %12s %12s %10.2f %8.2f %s\n",name,p50,p99,
+                total / count,calls["futex"] / count,detail
+            if (name == "ring" && reads >= count / 2) {
+                printf "%-12s (replies came over the socket: the daemon did not offer the ring)\n",""
+            }
+        }' "$trace"
+}
+
+printf "%-12s %12s %12s %10s %8s %s\n" transport p50 p99 syscalls futex "(per lookup)"
+run stream -d uniauth.socket_path="$socket"
+run seqpacket -d uniauth.socket_path="seqpacket:$socket"
+run ring -d uniauth.socket_path="$socket" -d uniauth.shm_ring=1
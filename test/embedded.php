@@ -0,0 +1,307 @@
+<?php
+
+/**
+ * embedded.php - uniauth/test
+ *
+ * Runs an auth flow and its failure cases against the embedded backend. Use
+ * test/embedded.sh, which gives the script a fresh table file:
+ *
+ *   php -d uniauth.embedded_path=/tmp/table test/embedded.php
+ *
+ * The whole script is one request, so the extension's request cache would
+ * answer for any session the script already used. Each step therefore runs in
+ * a forked worker that inherits the table (a shared mapping) but only knows the
+ * sessions the parent never touched; the parent itself makes no uniauth calls.
+ * Steps that end the script (a redirect by uniauth() or uniauth_transfer())
+ * are expected to do so.
+ */
+
+if (!function_exists('uniauth_register')) {
+    error_log("uniauth extension is not enabled");
+    exit(1);
+}
+if (!function_exists('pcntl_fork')) {
+    error_log("pcntl extension is not enabled");
+    exit(1);
+}
+if (ini_get('uniauth.embedded_path') == '') {
+    error_log("uniauth.embedded_path is not set (run test/embedded.sh)");
+    exit(1);
+}
+
+$prefix = bin2hex(random_bytes(8));
+$failures = 0;
+
+function key_of($name) {
+    global $prefix;
+    return "$prefix-$name";
+}
+
+function check($cond,$what) {
+    if (!$cond) {
+        throw new Exception($what);
+    }
+}
+
+function expect_exception(callable $fn,$pattern) {
+    try {
+        $fn();
+    } catch (Exception $e) {
+        check(preg_match($pattern,$e->getMessage()),
+            "unexpected exception: " . $e->getMessage());
+        return;
+    }
+    throw new Exception("no exception matching $pattern");
+}
+
+/* Runs 'fn' in a forked worker and returns its pid. The worker exits with 1
+ * if 'fn' throws.
+ */
+function spawn(callable $fn) {
+    $pid = pcntl_fork();
+    if ($pid == -1) {
+        error_log("fork failed");
+        exit(1);
+    }
+    if ($pid == 0) {
+        try {
+            $fn();
+        } catch (Throwable $e) {
+            fwrite(STDERR,"    " . $e->getMessage() . "\n");
+            exit(1);
+        }
+        exit(0);
+    }
+    return $pid;
+}
+
+function join_worker($pid) {
+    pcntl_waitpid($pid,$status);
+    return pcntl_wifexited($status) ? pcntl_wexitstatus($status) : -1;
+}
+
+function step($name,callable $fn) {
+    global $failures;
+
+    $status = join_worker(spawn($fn));
+    if ($status != 0) {
+        $failures += 1;
+        printf("FAIL %s\n",$name);
+        return;
+    }
+    printf("ok   %s\n",$name);
+}
+
+/* Runs a step that redirects, which ends the worker without returning. */
+function redirect_step($name,callable $fn) {
+    step($name,function() use($fn) {
+        $fn();
+        throw new Exception("did not redirect");
+    });
+}
+
+/* Register and look up */
+
+step('register creates an authenticated session',function() {
+    uniauth_register(7,'alice','Alice',key_of('alice'),3600);
+});
+
+step('a session is visible to other workers',function() {
+    $login = uniauth(null,key_of('alice'));
+    check(is_array($login),"no login array");
+    check($login['id'] === 7 && $login['user'] === 'alice'
+        && $login['display'] === 'Alice',"wrong login array");
+    check(uniauth_check(key_of('alice')),"uniauth_check() is false");
+    $many = uniauth_lookup_many([key_of('alice'),key_of('nobody')]);
+    check($many[key_of('alice')]['id'] === 7,"lookup_many missed the session");
+    check($many[key_of('nobody')] === null,"lookup_many found a missing session");
+});
+
+/* The auth flow: applicant, apply, register, transfer */
+
+redirect_step('uniauth() creates the applicant session',function() {
+    uniauth('http://applicant.test/return',key_of('applicant'));
+});
+
+step('apply and register the registrar session',function() {
+    $_GET['uniauth'] = key_of('applicant');
+    uniauth_apply(key_of('registrar'));
+    check(!uniauth_check(key_of('registrar')),"registrar is authenticated early");
+    uniauth_register(9,'bob','Bob',key_of('registrar'),3600);
+});
+
+step('applying the same applicant again is not a conflict',function() {
+    $_GET['uniauth'] = key_of('applicant');
+    uniauth_apply(key_of('registrar'));
+});
+
+redirect_step('transfer links the applicant',function() {
+    uniauth_transfer(key_of('registrar'));
+});
+
+step('the applicant is authenticated',function() {
+    $login = uniauth(null,key_of('applicant'));
+    check(is_array($login) && $login['id'] === 9 && $login['user'] === 'bob',
+        "applicant did not get the registration");
+});
+
+step('transfer without apply fails',function() {
+    uniauth_register(3,'eve','Eve',key_of('lone'),3600);
+    expect_exception(function() {
+        uniauth_transfer(key_of('lone'));
+    },'/did not apply/');
+});
+
+/* Purge */
+
+step('purge ends the shared registration',function() {
+    check(uniauth_purge(key_of('applicant')),"purge found no session");
+    check(!uniauth_check(key_of('applicant')),"applicant still authenticated");
+    check(!uniauth_purge(key_of('applicant')),"second purge found a session");
+});
+
+step('purge is seen by the registrar',function() {
+    check(!uniauth_check(key_of('registrar')),"registrar still authenticated");
+});
+
+/* CAS conflicts. The worker reads the session into its request cache, a
+ * second worker changes it, and the first one then writes from its stale
+ * copy.
+ */
+
+step('apply detects a concurrent apply',function() {
+    $_GET['uniauth'] = key_of('tab-1');
+    uniauth_apply(key_of('tabs'));
+    uniauth_lookup_many([key_of('tabs')]);
+
+    $status = join_worker(spawn(function() {
+        $_GET['uniauth'] = key_of('tab-2');
+        uniauth_apply(key_of('tabs'));
+    }));
+    check($status == 0,"second apply failed");
+
+    $_GET['uniauth'] = key_of('tab-3');
+    expect_exception(function() {
+        uniauth_apply(key_of('tabs'));
+    },'/claimed by another application/');
+});
+
+step('register detects a concurrent register',function() {
+    uniauth_register(1,'first','First',key_of('race'),3600);
+    uniauth_lookup_many([key_of('race')]);
+
+    $status = join_worker(spawn(function() {
+        uniauth_register(2,'second','Second',key_of('race'),3600);
+    }));
+    check($status == 0,"second register failed");
+
+    expect_exception(function() {
+        uniauth_register(3,'third','Third',key_of('race'),3600);
+    },'/registered to another user/');
+});
+
+step('register retries a conflict with the same user',function() {
+    uniauth_register(4,'same','Same',key_of('same'),3600);
+    uniauth_lookup_many([key_of('same')]);
+
+    $status = join_worker(spawn(function() {
+        uniauth_register(4,'same','Same',key_of('same'),3600);
+    }));
+    check($status == 0,"second register failed");
+
+    uniauth_register(4,'same','Renamed',key_of('same'),3600);
+});
+
+step('the retried register was written',function() {
+    $login = uniauth(null,key_of('same'));
+    check(is_array($login) && $login['display'] === 'Renamed',"write was lost");
+});
+
+/* Expiry */
+
+step('register a short session',function() {
+    uniauth_register(5,'brief','Brief',key_of('brief'),1);
+});
+
+redirect_step('create a temporary session with a short lifetime',function() {
+    ini_set('uniauth.lifetime','1');
+    uniauth('http://applicant.test/return',key_of('temporary'));
+});
+
+sleep(3);
+
+step('sessions expire',function() {
+    check(!uniauth_check(key_of('brief')),"session outlived its lifetime");
+});
+
+step('a temporary session keeps the lifetime it was created with',function() {
+    check(ini_get('uniauth.lifetime') > 3,"worker lifetime is too short");
+    $_GET['uniauth'] = key_of('temporary');
+    uniauth_apply(key_of('late'));
+    uniauth_register(6,'late','Late',key_of('late'),3600);
+    expect_exception(function() {
+        uniauth_transfer(key_of('late'));
+    },'/does not exist/');
+});
+
+/* Two workers contending on the same sessions (and thus the same buckets).
+ * Both register their own user with each session. A worker whose register
+ * throws must not have written, so each session ends up with the user of a
+ * worker whose register went through.
+ */
+
+$rounds = 2000;
+$start = microtime(true) + 0.5;
+$workers = [];
+foreach ([1,2] as $w) {
+    $workers[$w] = spawn(function() use($w,$rounds,$start) {
+        $done = [];
+        time_sleep_until($start);
+        for ($i = 0;$i < $rounds;++$i) {
+            try {
+                uniauth_register(100 + $w,"worker$w","Worker $w",key_of("contend-$i"),3600);
+                $done[] = $i;
+            } catch (Exception $e) {
+                check(preg_match('/another user|kept changing/',$e->getMessage()),
+                    "unexpected exception: " . $e->getMessage());
+            }
+        }
+        file_put_contents(sys_get_temp_dir() . "/" . key_of("worker-$w"),
+            implode("\n",$done));
+    });
+}
+$ok = true;
+foreach ($workers as $w => $pid) {
+    $ok = (join_worker($pid) == 0) && $ok;
+}
+step('contending workers only fail with conflicts',function() use($ok) {
+    check($ok,"a worker failed");
+});
+
+step('contended sessions hold a successful writer',function() use($rounds) {
+    $wrote = [];
+    foreach ([1,2] as $w) {
+        $file = sys_get_temp_dir() . "/" . key_of("worker-$w");
+        $lines = file_get_contents($file);
+        unlink($file);
+        $wrote[$w] = $lines === '' ? [] : array_flip(explode("\n",$lines));
+    }
+
+    $keys = [];
+    for ($i = 0;$i < $rounds;++$i) {
+        $keys[] = key_of("contend-$i");
+    }
+    $logins = uniauth_lookup_many($keys);
+    for ($i = 0;$i < $rounds;++$i) {
+        $login = $logins[key_of("contend-$i")];
+        check(is_array($login),"round $i has no session");
+        $w = $login['id'] - 100;
+        check(isset($wrote[$w][$i]),"round $i holds a write that failed");
+    }
+});
+
+if ($failures > 0) {
+    printf("%d failed\n",$failures);
+    exit(1);
+}
+printf("all passed\n");
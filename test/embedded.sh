@@ -0,0 +1,17 @@
+#!/bin/sh
+#
+# embedded.sh - uniauth/test
+#
+# Runs embedded.php against a fresh embedded backend table, which is removed
+# afterwards. The script needs the pcntl extension to fork its workers.
+#
+#   test/embedded.sh
+#
+# Further php options (e.g. -d extension=...) may be given in $PHP_ARGS.
+
+dir=$(dirname "$0")
+table=$(mktemp -d)
+trap 'rm -rf "$table"' EXIT
+
+php $PHP_ARGS -d uniauth.embedded_path="$table/sessions" \
+    -d uniauth.embedded_size=16384 "$dir/embedded.php"
@@ -4,7 +4,7 @@
 import string
 from struct import *
 from socket import *
-from sys import stderr, stdout, stdin
+from sys import stderr, stdout, stdin, argv
 
 class Empty(object):
     pass
@@ -19,6 +19,16 @@ def command(com,data):
         msg += "\x02"
     elif com == "transfer":
         msg += "\x03"
+    elif com == "touch":
+        msg += "\x05"
+    elif com == "transfer-apply":
+        msg += "\x06"
+    elif com == "upsert":
+        msg += "\x07"
+    elif com == "cas":
+        msg += "\x08"
+    elif com == "if-changed":
+        msg += "\x09"
     else:
         stderr.write("bad command\n")
         return ""
@@ -29,6 +39,11 @@ def command(com,data):
             return ""
         msg += "\x06" + pack(str(len(data.src)+1)+"s",data.src)
         msg += "\x07" + pack(str(len(data.dst)+1)+"s",data.dst)
+    elif com == "transfer-apply":
+        if not hasattr(data,"src"):
+            stderr.write("missing src for transfer-apply\n")
+            return ""
+        msg += "\x06" + pack(str(len(data.src)+1)+"s",data.src)
     else:
         if not hasattr(data,"key"):
             stderr.write("missing key property\n")
@@ -46,6 +61,14 @@ def command(com,data):
             msg += "\x05" + pack(str(len(data.redirect)+1)+"s",data.redirect)
         if hasattr(data,"tag"):
             msg += "\x08" + pack(str(len(data.tag)+1)+"s",data.tag)
+        if hasattr(data,"lifetime"):
+            msg += "\x09" + pack("<i",int(data.lifetime))
+        if hasattr(data,"threshold"):
+            msg += "\x0c" + pack("<i",int(data.threshold))
+        if hasattr(data,"revision"):
+            msg += "\x0d" + pack("<q",int(data.revision))
+        if hasattr(data,"mask"):
+            msg += "\x0e" + pack("<i",int(data.mask,0))
 
     msg += "\xff"
     return msg
@@ -64,6 +87,9 @@ def print_response(response):
     elif type == "\x01":
         # error: functionally this behaves just like message
         print response[1:len(response)-1]
+    elif type == "\x03":
+        # not modified: no fields
+        print "not modified"
     elif type == "\x02":
         # record: parse fields
         i = 1
@@ -101,6 +127,15 @@ def print_response(response):
             elif fieldNo == "\x09":
                 t = "int"
                 s = "  lifetime: "
+            elif fieldNo == "\x0a":
+                t = "int"
+                s = "  version: "
+            elif fieldNo == "\x0b":
+                t = "int"
+                s = "  features: "
+            elif fieldNo == "\x0d":
+                t = "long"
+                s = "  revision: "
             elif fieldNo == "\xff":
                 break
 
@@ -119,9 +154,15 @@ def print_response(response):
 
             print s
 
-addr = "\0uniauth"
-sock = socket(AF_UNIX,SOCK_STREAM)
-sock.connect(addr)
+# An optional host:port argument connects over TCP instead.
+if len(argv) > 1:
+    host, port = argv[1].rsplit(':',1)
+    sock = create_connection((host.strip('[]'),int(port)))
+    sock.setsockopt(IPPROTO_TCP,TCP_NODELAY,1)
+else:
+    addr = "\0uniauth"
+    sock = socket(AF_UNIX,SOCK_STREAM)
+    sock.connect(addr)
 
 while True:
     print "command:"
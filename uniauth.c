@@ -8,12 +8,60 @@
 
 #include "uniauth.h"
 #include "connect.h"
+#include "embedded.h"
+#include "shmcache.h"
+#include <errno.h>
 
 /* Lifetime: a session has indefinate lifetime if its value is less-than or
  * equal to zero. An indefinate session gets a lifetime of the
  * uniauth.lifetime value defined by the extension's initialization settings.
  */
-#define LIFETIME(lifetime) (lifetime <= 0 ? INI_INT(UNIAUTH_LIFETIME_INI) : lifetime)
+#define LIFETIME(value) ((value) <= 0 ? UNIAUTH_G(lifetime) : (value))
+
+/* Touch threshold: a session's expiration is extended once less than this
+ * percentage of its lifetime remains.
+ */
+#define TOUCH_THRESHOLD 50
+
+/* Conditional writes that keep conflicting are retried this many times in
+ * total. In uniauth() the final attempt is unconditional; uniauth_register()
+ * and uniauth_apply() fail instead.
+ */
+#define CAS_ATTEMPTS 3
+
+/* A registrar cookie ID that lands on the applicant's daemon is searched for
+ * this many times per daemon before giving up.
+ */
+#define REKEY_ATTEMPTS 32
+
+/* Fields looked up for building a login array (and touching the record) and
+ * for refreshing the uniauth cookie. The cookie lookup also takes the login
+ * fields (they are small) so that the uniauth() call that normally follows it
+ * is served from the request cache.
+ */
+#define LOGIN_FIELDS (UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_KEY)        \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID)                     \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_USER)                   \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_DISPLAY)                \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_EXPIRE)                 \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_LIFETIME))
+#define COOKIE_FIELDS (LOGIN_FIELDS                                     \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REDIRECT))
+
+/* Fields read before the conditional writes of uniauth_register() and
+ * uniauth_apply(), and the fields that uniauth_register() writes.
+ */
+#define REGISTER_FIELDS (UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_KEY)     \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID)                     \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REVISION))
+#define APPLY_FIELDS (UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_KEY)        \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_TAG)                    \
+        | UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_REVISION))
+#define REGISTER_DIRTY (UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_ID)           \
+        | UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_USER)                       \
+        | UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_DISPLAY)                    \
+        | UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_EXPIRE)                     \
+        | UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_LIFETIME))
 
 /* Module/request functions */
 static PHP_MINIT_FUNCTION(uniauth);
@@ -30,6 +78,9 @@ static PHP_FUNCTION(uniauth_check);
 static PHP_FUNCTION(uniauth_apply);
 static PHP_FUNCTION(uniauth_purge);
 static PHP_FUNCTION(uniauth_cookie);
+static PHP_FUNCTION(uniauth_lookup_many);
+static PHP_FUNCTION(uniauth_set_wait_handler);
+static PHP_FUNCTION(uniauth_stats);
 
 /* Function entries */
 static zend_function_entry php_uniauth_functions[] = {
@@ -40,6 +91,9 @@ static zend_function_entry php_uniauth_functions[] = {
     PHP_FE(uniauth_apply,NULL)
     PHP_FE(uniauth_purge,NULL)
     PHP_FE(uniauth_cookie,NULL)
+    PHP_FE(uniauth_lookup_many,NULL)
+    PHP_FE(uniauth_set_wait_handler,NULL)
+    PHP_FE(uniauth_stats,NULL)
 
     {NULL, NULL, NULL}
 };
@@ -64,25 +118,161 @@ ZEND_GET_MODULE(uniauth)
 
 /* Uniauth INI settings */
 
+/* Settings consulted on every request (or every call) are cached in the module
+ * globals by their update handlers. The rest are only read at startup.
+ */
+
+static inline int hex_digit(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+static PHP_INI_MH(OnUpdateKeyDigest)
+{
+    /* The setting is the digest secret as hex digits, or empty to send plain
+     * session keys.
+     */
+
+    size_t i;
+    unsigned char secret[UNIAUTH_DIGEST_SECRET_SZ];
+
+    if (ZSTR_LEN(new_value) == 0) {
+        UNIAUTH_G(keyDigest) = 0;
+        return SUCCESS;
+    }
+    if (ZSTR_LEN(new_value) != sizeof(secret) * 2) {
+        return FAILURE;
+    }
+
+    for (i = 0;i < sizeof(secret);++i) {
+        int hi = hex_digit(ZSTR_VAL(new_value)[i*2]);
+        int lo = hex_digit(ZSTR_VAL(new_value)[i*2+1]);
+
+        if (hi < 0 || lo < 0) {
+            return FAILURE;
+        }
+        secret[i] = (unsigned char)(hi << 4 | lo);
+    }
+
+    memcpy(UNIAUTH_G(keyDigestSecret),secret,sizeof(secret));
+    UNIAUTH_G(keyDigest) = 1;
+    return SUCCESS;
+}
+
 PHP_INI_BEGIN()
-PHP_INI_ENTRY(UNIAUTH_LIFETIME_INI, "86400", PHP_INI_ALL, NULL)
+STD_PHP_INI_ENTRY(UNIAUTH_LIFETIME_INI, "86400", PHP_INI_ALL, OnUpdateLong,
+    lifetime, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_ENTRY(UNIAUTH_SOCKET_PATH_INI, SOCKET_PATH, PHP_INI_SYSTEM, OnUpdateStringUnempty,
+    socketPath, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_ENTRY(UNIAUTH_RECONNECT_BACKOFF_INI, "100", PHP_INI_ALL, OnUpdateLong,
+    reconnectBackoff, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_ENTRY(UNIAUTH_TIMEOUT_INI, "1000", PHP_INI_ALL, OnUpdateLong,
+    timeout, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_ENTRY(UNIAUTH_REQUEST_BUDGET_INI, "0", PHP_INI_ALL, OnUpdateLong,
+    requestBudget, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_ENTRY(UNIAUTH_PROTOCOL_INI, "2", PHP_INI_SYSTEM, OnUpdateLong,
+    protocol, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_BOOLEAN(UNIAUTH_PREFETCH_INI, "0", PHP_INI_ALL, OnUpdateBool,
+    prefetch, zend_uniauth_globals, uniauth_globals)
+STD_PHP_INI_BOOLEAN(UNIAUTH_SHM_RING_INI, "0", PHP_INI_SYSTEM, OnUpdateBool,
+    shmRing, zend_uniauth_globals, uniauth_globals)
+PHP_INI_ENTRY(UNIAUTH_KEY_DIGEST_INI, "", PHP_INI_SYSTEM, OnUpdateKeyDigest)
+PHP_INI_ENTRY(UNIAUTH_SHM_CACHE_INI, "0", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY(UNIAUTH_SHM_CACHE_SIZE_INI, "4096", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY(UNIAUTH_SHM_CACHE_TTL_INI, "30", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY(UNIAUTH_EMBEDDED_PATH_INI, "", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY(UNIAUTH_EMBEDDED_SIZE_INI, "16384", PHP_INI_SYSTEM, NULL)
+PHP_INI_ENTRY(UNIAUTH_SHARED_CONNS_INI, "0", PHP_INI_SYSTEM, NULL)
 PHP_INI_END()
 
+/* Uniauth classes */
+
+zend_class_entry* uniauth_timeout_exception_ce;
+
 /* Implementation of module/request functions */
 
+static void login_keys_init();
+
 PHP_MINIT_FUNCTION(uniauth)
 {
+    zend_class_entry ce;
+
     uniauth_globals_init();
     REGISTER_INI_ENTRIES();
+    login_keys_init();
+
+    INIT_CLASS_ENTRY(ce,"UniauthTimeoutException",NULL);
+    uniauth_timeout_exception_ce = zend_register_internal_class_ex(&ce,
+        zend_ce_exception);
+
+    /* Sessions are spread over the daemons listed in the socket path. */
+    if (uniauth_connect_shards_init(INI_STR(UNIAUTH_SOCKET_PATH_INI)) == -1) {
+        php_error(E_WARNING,"invalid uniauth socket path '%s'; using '%s'",
+            INI_STR(UNIAUTH_SOCKET_PATH_INI),SOCKET_PATH);
+        uniauth_connect_shards_init(SOCKET_PATH);
+    }
+
+    /* The shared cache must be mapped before the SAPI forks its workers. */
+    if (INI_BOOL(UNIAUTH_SHM_CACHE_INI)
+        && INI_INT(UNIAUTH_SHM_CACHE_SIZE_INI) > 0
+        && INI_INT(UNIAUTH_SHM_CACHE_TTL_INI) > 0)
+    {
+        if (uniauth_shmcache_init(INI_INT(UNIAUTH_SHM_CACHE_SIZE_INI),
+                INI_INT(UNIAUTH_SHM_CACHE_TTL_INI)) == -1)
+        {
+            php_error(E_WARNING,"could not allocate uniauth shared cache: %s",
+                strerror(errno));
+        }
+    }
+
+    /* Likewise the embedded backend, which replaces the daemon. */
+    if (*INI_STR(UNIAUTH_EMBEDDED_PATH_INI) != 0
+        && INI_INT(UNIAUTH_EMBEDDED_SIZE_INI) > 0)
+    {
+        if (uniauth_embedded_init(INI_STR(UNIAUTH_EMBEDDED_PATH_INI),
+                INI_INT(UNIAUTH_EMBEDDED_SIZE_INI)) == -1)
+        {
+            php_error(E_WARNING,"could not open uniauth embedded backend '%s': %s",
+                INI_STR(UNIAUTH_EMBEDDED_PATH_INI),strerror(errno));
+        }
+    }
+
+#ifdef ZTS
+    /* Threads share connections to the daemon instead of keeping their own. */
+    if (INI_INT(UNIAUTH_SHARED_CONNS_INI) > 0) {
+        uniauth_connect_share_init(INI_INT(UNIAUTH_SHARED_CONNS_INI));
+    }
+#endif
 
     return SUCCESS;
 }
 
 PHP_MINFO_FUNCTION(uniauth)
 {
+    char shards[32];
+
     php_info_print_table_start();
     php_info_print_table_row(2,PHP_UNIAUTH_EXTNAME,"enabled");
     php_info_print_table_row(2,"extension version",PHP_UNIAUTH_EXTVER);
+    php_info_print_table_row(2,"shared cache",
+        uniauth_shmcache_active() ? "enabled" : "disabled");
+    php_info_print_table_row(2,"embedded backend",
+        uniauth_embedded_active() ? "enabled" : "disabled");
+    snprintf(shards,sizeof(shards),"%zu",uniauth_connect_shard_count());
+    php_info_print_table_row(2,"daemon shards",shards);
+#ifdef ZTS
+    php_info_print_table_row(2,"shared connections",
+        uniauth_connect_share_count() > 0 ? "enabled" : "disabled");
+#endif
     php_info_print_table_end();
 
     DISPLAY_INI_ENTRIES();
@@ -90,21 +280,34 @@ PHP_MINFO_FUNCTION(uniauth)
 
 PHP_MSHUTDOWN_FUNCTION(uniauth)
 {
+    uniauth_shmcache_shutdown();
+    uniauth_embedded_shutdown();
+#ifdef ZTS
+    uniauth_connect_share_shutdown();
+#endif
     uniauth_globals_shutdown();
+    uniauth_connect_shards_shutdown();
     UNREGISTER_INI_ENTRIES();
 
     return SUCCESS;
 }
 
+static void prefetch_request_session();
+
 PHP_RINIT_FUNCTION(uniauth)
 {
     uniauth_globals_request_init();
 
+    if (UNIAUTH_G(prefetch)) {
+        prefetch_request_session();
+    }
+
     return SUCCESS;
 }
 
 PHP_RSHUTDOWN_FUNCTION(uniauth)
 {
+    uniauth_globals_request_shutdown();
 
     return SUCCESS;
 }
@@ -183,6 +386,32 @@ static int set_global(const char* gbl,int gbllen,const char* key,int keylen,zval
 #define SET_GLOBAL(g,k,v)                       \
     set_global(g,sizeof(g)-1,k,sizeof(k)-1,v)
 
+/* Define a helper function that starts looking up the session the request
+ * most likely refers to. The uniauth cookie takes precedence over the PHP
+ * session cookie since uniauth_cookie() overrides the PHP session. Request
+ * variables are already registered when module RINIT handlers run.
+ */
+
+static void prefetch_request_session()
+{
+    zval* cookies = &PG(http_globals)[TRACK_VARS_COOKIE];
+    zval* entry = NULL;
+
+    if (Z_TYPE_P(cookies) != IS_ARRAY) {
+        return;
+    }
+
+    entry = zend_hash_str_find(Z_ARRVAL_P(cookies),"uniauth",sizeof("uniauth")-1);
+    if (entry == NULL && PS(session_name) != NULL) {
+        entry = zend_hash_str_find(Z_ARRVAL_P(cookies),PS(session_name),
+            strlen(PS(session_name)));
+    }
+
+    if (entry != NULL && Z_TYPE_P(entry) == IS_STRING && Z_STRLEN_P(entry) > 0) {
+        uniauth_connect_prefetch(Z_STRVAL_P(entry),Z_STRLEN_P(entry));
+    }
+}
+
 /* Define a helper function for compiling the redirect uri to the current
  * request.
  */
@@ -282,8 +511,10 @@ static int set_redirect_uri(struct uniauth_storage* stor)
 
     /* Copy buffer into record structure. */
     len = strlen(buf);
-    stor->redirect = estrndup(buf,len);
+    uniauth_field_free(stor->redirect);
+    stor->redirect = uniauth_field_new(buf,len);
     stor->redirectSz = len;
+    stor->dirty |= UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_REDIRECT);
     efree(port);
 
     return SUCCESS;
@@ -321,6 +552,118 @@ static void set_uniauth_cookie(char* id,int id_len,time_t expires)
     zend_string_release(path);
 }
 
+/* Define a helper function for generating a new uniauth cookie session id. */
+
+static int generate_cookie_id(zval* dst)
+{
+    int i;
+    size_t len;
+    zend_string* encoded;
+    unsigned char buf[UNIAUTH_COOKIE_IDLEN / 4 * 3];
+    char output[UNIAUTH_COOKIE_IDLEN+1];
+
+    i = 0;
+    while (i < sizeof(buf)) {
+        long n;
+        n = php_rand();
+        RAND_RANGE(n,0,0xff,PHP_RAND_MAX);
+        buf[i] = (unsigned char)n;
+        i += 1;
+    }
+
+    memset(output,'0',sizeof(output));
+    encoded = php_base64_encode(buf,sizeof(buf));
+    if (encoded == NULL) {
+        return FAILURE;
+    }
+    len = (encoded->len > UNIAUTH_COOKIE_IDLEN ? UNIAUTH_COOKIE_IDLEN : encoded->len);
+    memcpy(output,encoded->val,len);
+    zend_string_release(encoded);
+
+    output[UNIAUTH_COOKIE_IDLEN] = 0;
+    ZVAL_STRING(dst,output);
+    return SUCCESS;
+}
+
+/* Define a helper function that moves a registrar's uniauth cookie session to
+ * the daemon that keeps the applicant session. The new session id is stored in
+ * 'dst' (and in the cookie).
+ */
+
+static int rekey_registrar_cookie(const char* applicantID,size_t applicantlen,
+    zval* dst)
+{
+    size_t i;
+    size_t attempts = REKEY_ATTEMPTS * uniauth_connect_shard_count();
+
+    /* Each new ID lands on the applicant's daemon with a chance of 1/n. */
+    for (i = 0;i < attempts;++i) {
+        if (generate_cookie_id(dst) != SUCCESS) {
+            break;
+        }
+        if (uniauth_connect_same_shard(Z_STRVAL_P(dst),Z_STRLEN_P(dst),
+                applicantID,applicantlen))
+        {
+            Z_ADDREF_P(dst);
+            if (SET_GLOBAL("_COOKIE","uniauth",dst) != SUCCESS) {
+                zval_ptr_dtor(dst);
+                zval_ptr_dtor(dst);
+                ZVAL_UNDEF(dst);
+                return FAILURE;
+            }
+            set_uniauth_cookie(Z_STRVAL_P(dst),Z_STRLEN_P(dst),0);
+            return SUCCESS;
+        }
+        zval_ptr_dtor(dst);
+    }
+
+    ZVAL_UNDEF(dst);
+    return FAILURE;
+}
+
+/* Define a helper function that does the same for a registrar that uses the
+ * PHP session: the session ID is regenerated (discarding the old one) until it
+ * lands on the applicant's daemon. The session must be active and headers
+ * must not have been sent yet.
+ */
+
+static int rekey_registrar_session(const char* applicantID,size_t applicantlen)
+{
+    size_t i;
+    size_t attempts = REKEY_ATTEMPTS * uniauth_connect_shard_count();
+    int result = FAILURE;
+    zval func;
+    zval retval;
+    zval args[1];
+
+    if (PS(session_status) != php_session_active) {
+        return FAILURE;
+    }
+
+    ZVAL_STRINGL(&func,"session_regenerate_id",sizeof("session_regenerate_id")-1);
+    ZVAL_TRUE(&args[0]);
+    for (i = 0;i < attempts;++i) {
+        ZVAL_UNDEF(&retval);
+        if (call_user_function(NULL,NULL,&func,&retval,1,args) == FAILURE
+            || EG(exception) != NULL || Z_TYPE(retval) != IS_TRUE)
+        {
+            zval_ptr_dtor(&retval);
+            break;
+        }
+        zval_ptr_dtor(&retval);
+
+        if (PS(id) != NULL && uniauth_connect_same_shard(PS(id)->val,PS(id)->len,
+                applicantID,applicantlen))
+        {
+            result = SUCCESS;
+            break;
+        }
+    }
+    zval_ptr_dtor(&func);
+
+    return result;
+}
+
 /* Define a helper function for touching uniauth storage records. */
 
 static inline int uniauth_set_expire(struct uniauth_storage* stor)
@@ -329,7 +672,9 @@ static inline int uniauth_set_expire(struct uniauth_storage* stor)
     int lifetime = LIFETIME(stor->lifetime);
     int diff = stor->expire - now;
 
-    if (stor->expire == 0 || (diff > 0 && diff < lifetime / 2)) {
+    if (stor->expire == 0
+        || (diff > 0 && diff < (int64_t)lifetime * TOUCH_THRESHOLD / 100))
+    {
         stor->expire = now + lifetime;
         return 1;
     }
@@ -352,6 +697,76 @@ static inline void uniauth_touch_record(struct uniauth_storage* stor)
     }
 }
 
+/* Define helper functions for the conditional writes of uniauth_register()
+ * and uniauth_apply().
+ */
+
+static inline bool same_field(const char* a,size_t alen,const char* b,size_t blen)
+{
+    return alen == blen && (alen == 0 || memcmp(a,b,alen) == 0);
+}
+
+static void set_registration(struct uniauth_storage* stor,zend_long id,
+    const char* name,size_t namelen,const char* displayname,
+    size_t displaynamelen,zend_long lifetime)
+{
+    uniauth_user_field_free(stor->username);
+    uniauth_user_field_free(stor->displayName);
+    stor->id = (int32_t)id;
+    stor->username = uniauth_user_field_new(name,namelen);
+    stor->usernameSz = namelen;
+    stor->displayName = uniauth_user_field_new(displayname,displaynamelen);
+    stor->displayNameSz = displaynamelen;
+    stor->expire = time(NULL) + LIFETIME(lifetime);
+    stor->lifetime = (int32_t)lifetime;
+}
+
+/* Define a helper function for building the login array returned to
+ * userspace for an authenticated record. The keys are interned at module
+ * startup and the user information strings are shared with the record.
+ */
+
+static zend_string* login_key_id;
+static zend_string* login_key_user;
+static zend_string* login_key_display;
+static zend_string* login_key_expire;
+
+static void login_keys_init()
+{
+    login_key_id = zend_string_init_interned("id",sizeof("id")-1,1);
+    login_key_user = zend_string_init_interned("user",sizeof("user")-1,1);
+    login_key_display = zend_string_init_interned("display",sizeof("display")-1,1);
+    login_key_expire = zend_string_init_interned("expire",sizeof("expire")-1,1);
+}
+
+static inline void login_field(zval* zv,const char* field)
+{
+    if (field != NULL) {
+        ZVAL_STR_COPY(zv,UNIAUTH_USER_FIELD_STR(field));
+    }
+    else {
+        ZVAL_NULL(zv);
+    }
+}
+
+static void set_login_array(zval* dst,const struct uniauth_storage* stor)
+{
+    zval zv;
+    HashTable* ht;
+
+    array_init_size(dst,4);
+    ht = Z_ARRVAL_P(dst);
+
+    ZVAL_LONG(&zv,stor->id);
+    zend_hash_add_new(ht,login_key_id,&zv);
+    login_field(&zv,stor->username);
+    zend_hash_add_new(ht,login_key_user,&zv);
+    login_field(&zv,stor->displayName);
+    zend_hash_add_new(ht,login_key_display,&zv);
+    ZVAL_LONG(&zv,stor->expire + 10);
+    zend_hash_add_new(ht,login_key_expire,&zv);
+}
+
 /* Define a helper function for looking up the default session id. */
 
 static char* get_default_sessid(size_t* out_len)
@@ -410,6 +825,9 @@ PHP_FUNCTION(uniauth)
     sapi_header_line ctr = {0};
     size_t bufsz;
     zend_string* encoded;
+    bool touched;
+    int attempt;
+    int status;
 
     /* Grab URL from userspace along with the session id if the user chooses to
      * specify it.
@@ -428,32 +846,32 @@ PHP_FUNCTION(uniauth)
         }
     }
 
-    /* Check to see if we have a user ID for the session. */
-    stor = uniauth_connect_lookup(sessid,sesslen,&local);
+    /* Check to see if we have a user ID for the session. The daemon touches
+     * the record in the same round trip if it can. Without a redirect URL we
+     * only need what goes into the login array (and touching the record).
+     */
+    stor = uniauth_connect_lookup_touch(sessid,sesslen,&local,
+        (int32_t)UNIAUTH_G(lifetime),TOUCH_THRESHOLD,
+        url != NULL ? UNIAUTH_FIELDS_RECORD : LOGIN_FIELDS,&touched);
+    if (EG(exception) != NULL) {
+        return;
+    }
     if (stor != NULL) {
         /* Check if user ID number is valid. */
         if (IS_VALID_USER_ID(stor->id)) {
-            /* Touch the expire time so we keep the session alive. The daemon
-             * does not set expire times.
+            /* Touch the expire time so we keep the session alive unless the
+             * daemon already did.
              */
-            uniauth_touch_record(stor);
-
-            /* Return user info array to userspace. */
-            array_init(return_value);
-            add_assoc_long(return_value,"id",stor->id);
-            if (stor->username != NULL) {
-                add_assoc_string(return_value,"user",stor->username);
+            if (!touched) {
+                uniauth_touch_record(stor);
             }
-            else {
-                add_assoc_null(return_value,"user");
+            if (EG(exception) != NULL) {
+                uniauth_storage_delete(stor);
+                return;
             }
-            if (stor->displayName != NULL) {
-                add_assoc_string(return_value,"display",stor->displayName);
-            }
-            else {
-                add_assoc_null(return_value,"display");
-            }
-            add_assoc_long(return_value,"expire",stor->expire + 10);
+
+            /* Return user info array to userspace. */
+            set_login_array(return_value,stor);
             uniauth_storage_delete(stor);
             return;
 
@@ -469,15 +887,32 @@ PHP_FUNCTION(uniauth)
         }
 
         /* If the ID was not set, then we update the redirect URI and continue
-         * to redirect the script.
+         * to redirect the script. The change is only committed if the record
+         * is still the one we looked up. Otherwise (e.g. the session was just
+         * authenticated in another tab) we start over with the current record.
          */
-        if (set_redirect_uri(stor) != SUCCESS) {
-            uniauth_storage_delete(stor);
-            RETURN_FALSE;
-        }
+        attempt = 0;
+        do {
+            if (IS_VALID_USER_ID(stor->id)) {
+                set_login_array(return_value,stor);
+                uniauth_storage_delete(stor);
+                return;
+            }
+
+            if (set_redirect_uri(stor) != SUCCESS) {
+                uniauth_storage_delete(stor);
+                RETURN_FALSE;
+            }
 
-        /* Commit redirect URI changes back to server. */
-        uniauth_connect_commit(stor);
+            /* Commit redirect URI changes back to server. */
+            attempt += 1;
+            if (attempt < CAS_ATTEMPTS) {
+                status = uniauth_connect_cas(stor);
+            }
+            else {
+                status = uniauth_connect_commit(stor);
+            }
+        } while (status == 1);
     }
     else {
         /* If no redirect URL was provided, then we just return null to indicate
@@ -493,7 +928,7 @@ PHP_FUNCTION(uniauth)
          */
         stor = &local;
         memset(stor,0,sizeof(struct uniauth_storage));
-        stor->key = estrndup(sessid,sesslen);
+        stor->key = uniauth_field_new(sessid,sesslen);
         stor->keySz = sesslen;
 
         /* Fill out stor->redirect. */
@@ -506,6 +941,12 @@ PHP_FUNCTION(uniauth)
         uniauth_connect_create(stor);
     }
 
+    /* Do not redirect if the daemon operation was interrupted. */
+    if (EG(exception) != NULL) {
+        uniauth_storage_delete(stor);
+        return;
+    }
+
     /* URL-encode (via 'standard' extension) the key so we can safely pass it in
      * a query string.
      */
@@ -550,6 +991,8 @@ PHP_FUNCTION(uniauth_register)
     size_t sesslen = 0;
     zend_long lifetime = 0;
     time_t expires = 0;
+    int32_t seen;
+    int attempt;
 
     /* Grab id parameter from userspace. */
     if (zend_parse_parameters(
@@ -576,52 +1019,62 @@ PHP_FUNCTION(uniauth_register)
         lifetime = 0;
     }
 
-    /* Lookup the uniauth_storage for the session. Create one if does not
-     * exist. Then assign the id to the structure. An expiration is created
-     * since we want this session to live (so we can keep registering new
-     * sessions with it). If the expiration exists we touch it so it updates.
+    /* Write the user information to the uniauth_storage for the session,
+     * creating it if it does not exist. We will always override any existing
+     * values. An expiration is created since we want this session to live (so
+     * we can keep registering new sessions with it). The write only goes
+     * through if the session is still the one we read: if another request
+     * registered a different user with it in the meantime, we fail instead of
+     * silently replacing that user.
      */
-    stor = uniauth_connect_lookup(sessid,sesslen,&backing);
-    if (stor != NULL) {
-        /* Set storage parameters. We will always override any existing
-         * values.
-         */
-        stor->id = (int32_t)id;
-        if (stor->username != NULL) {
-            efree(stor->username);
-        }
-        if (stor->displayName != NULL) {
-            efree(stor->displayName);
+    stor = uniauth_connect_lookup_fields(sessid,sesslen,&backing,REGISTER_FIELDS);
+    seen = (stor != NULL) ? stor->id : 0;
+    attempt = 0;
+    while (EG(exception) == NULL) {
+        attempt += 1;
+        if (stor == NULL) {
+            stor = &backing;
+            memset(stor,0,sizeof(struct uniauth_storage));
+            stor->key = uniauth_field_new(sessid,sesslen);
+            stor->keySz = sesslen;
+            set_registration(stor,id,name,namelen,displayname,displaynamelen,lifetime);
+            if (uniauth_connect_create(stor) == 0 || EG(exception) != NULL) {
+                break;
+            }
+
+            /* Another request created the session first. */
+            uniauth_storage_delete(stor);
+            stor = uniauth_connect_lookup_fields(sessid,sesslen,&backing,REGISTER_FIELDS);
+            if (stor == NULL) {
+                break;
+            }
         }
-        stor->username = estrdup(name);
-        stor->usernameSz = namelen;
-        stor->displayName = estrdup(displayname);
-        stor->displayNameSz = displaynamelen;
-        stor->expire = time(NULL) + LIFETIME(lifetime);
-        stor->lifetime = (int32_t)lifetime;
-        if (lifetime == 0) {
-            expires = stor->expire;
+        else {
+            set_registration(stor,id,name,namelen,displayname,displaynamelen,lifetime);
+            stor->dirty = REGISTER_DIRTY;
+            if (uniauth_connect_cas(stor) != 1) {
+                break;
+            }
         }
 
-        uniauth_connect_commit(stor);
-    }
-    else {
-        stor = &backing;
-        memset(stor,0,sizeof(struct uniauth_storage));
-        stor->key = estrndup(sessid,sesslen);
-        stor->keySz = sesslen;
-        stor->id = (int32_t)id;
-        stor->username = estrdup(name);
-        stor->usernameSz = namelen;
-        stor->displayName = estrdup(displayname);
-        stor->displayNameSz = displaynamelen;
-        stor->expire = time(NULL) + LIFETIME(lifetime);
-        stor->lifetime = (int32_t)lifetime;
-        if (lifetime == 0) {
-            expires = stor->expire;
+        /* The session changed since we read it. */
+        if (IS_VALID_USER_ID(stor->id) && stor->id != seen && stor->id != id) {
+            zend_throw_exception(NULL,
+                "session was registered to another user at the same time",0);
         }
-
-        uniauth_connect_create(stor);
+        else if (attempt >= CAS_ATTEMPTS) {
+            zend_throw_exception(NULL,"session kept changing while registering",0);
+        }
+    }
+    if (stor == NULL) {
+        return;
+    }
+    if (EG(exception) != NULL) {
+        uniauth_storage_delete(stor);
+        return;
+    }
+    if (lifetime == 0) {
+        expires = stor->expire;
     }
 
     /* Update uniauth cookie expiration. The cookie expiration is only set
@@ -664,41 +1117,65 @@ PHP_FUNCTION(uniauth_transfer)
         }
     }
 
-    /* Lookup the source session so that we can grab the foreign session
-     * ID. This should have been recorded in the 'tag' field by a call to
-     * uniauth_apply().
+    /* Have the daemon resolve the destination from the source's tag, transfer
+     * the registration and mark the source in one atomic exchange. If it
+     * cannot, we go through the steps ourselves, which also tells us what
+     * went wrong.
      */
-    src = uniauth_connect_lookup(sessid,sesslen,backing);
-    if (src == NULL) {
-        zend_throw_exception(NULL,"Source registration does not exist",0);
-        return;
+    src = NULL;
+    if (uniauth_connect_transfer_apply(sessid,sesslen,backing+1) == 0) {
+        memset(backing,0,sizeof(struct uniauth_storage));
+        dst = backing+1;
     }
-    if (src->tag == NULL) {
-        zend_throw_exception(NULL,"Source registration did not apply",0);
-        uniauth_storage_delete(backing);
+    else if (EG(exception) != NULL) {
         return;
     }
-    foreignSession = src->tag;
-    foreignSessionlen = src->tagSz;
+    else {
+        /* Lookup the source session so that we can grab the foreign session
+         * ID. This should have been recorded in the 'tag' field by a call to
+         * uniauth_apply().
+         */
+        src = uniauth_connect_lookup(sessid,sesslen,backing);
+        if (EG(exception) != NULL) {
+            return;
+        }
+        if (src == NULL) {
+            zend_throw_exception(NULL,"Source registration does not exist",0);
+            return;
+        }
+        if (src->tag == NULL) {
+            zend_throw_exception(NULL,"Source registration did not apply",0);
+            uniauth_storage_delete(backing);
+            return;
+        }
+        foreignSession = src->tag;
+        foreignSessionlen = src->tagSz;
 
-    /* We have to lookup the destination record so we can grab its redirect URI
-     * before it's overwritten.
-     */
-    dst = uniauth_connect_lookup(foreignSession,foreignSessionlen,backing+1);
-    if (dst == NULL) {
-        zend_throw_exception(NULL,"Destination registration does not exist",0);
-        uniauth_storage_delete(backing);
-        return;
-    }
+        /* We have to lookup the destination record so we can grab its
+         * redirect URI before it's overwritten.
+         */
+        dst = uniauth_connect_lookup(foreignSession,foreignSessionlen,backing+1);
+        if (EG(exception) != NULL) {
+            uniauth_storage_delete(backing);
+            return;
+        }
+        if (dst == NULL) {
+            zend_throw_exception(NULL,"Destination registration does not exist",0);
+            uniauth_storage_delete(backing);
+            return;
+        }
 
-    /* Transfer the info from the source record to the destination record. The
-     * uniauth daemon will do this for us.
-     */
-    if (uniauth_connect_transfer(sessid,foreignSession) == -1) {
-        zend_throw_exception(NULL,"transfer failed",0);
-        uniauth_storage_delete(backing);
-        uniauth_storage_delete(backing+1);
-        return;
+        /* Transfer the info from the source record to the destination record.
+         * The uniauth daemon will do this for us.
+         */
+        if (uniauth_connect_transfer(sessid,foreignSession) == -1) {
+            if (EG(exception) == NULL) {
+                zend_throw_exception(NULL,"transfer failed",0);
+            }
+            uniauth_storage_delete(backing);
+            uniauth_storage_delete(backing+1);
+            return;
+        }
     }
 
     /* Add header to redirect back to pending page. */
@@ -718,17 +1195,22 @@ PHP_FUNCTION(uniauth_transfer)
     }
 
     /* Overwrite 'redirect' record field with token "transfer" to indicate the
-     * transfer took place.
+     * transfer took place (the daemon already did this if it did the
+     * transfer on its own).
      */
-    if (src->redirect) {
-        efree(src->redirect);
+    if (src != NULL) {
+        uniauth_field_free(src->redirect);
+        src->redirect = uniauth_field_new("transfer",sizeof("transfer")-1);
+        src->redirectSz = sizeof("transfer")-1;
+        src->dirty |= UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_REDIRECT);
+        uniauth_connect_commit(src);
     }
-    src->redirect = estrdup("transfer");
-    src->redirectSz = sizeof("transfer")-1;
-    uniauth_connect_commit(src);
 
     uniauth_storage_delete(backing);
     uniauth_storage_delete(backing+1);
+    if (EG(exception) != NULL) {
+        return;
+    }
 
     /* Terminate user script to perform redirect. */
     zend_bailout();
@@ -759,7 +1241,8 @@ PHP_FUNCTION(uniauth_check)
     }
 
     /* Check to see if we have a user ID for the session. If so, return true. */
-    stor = uniauth_connect_lookup(sessid,sesslen,&local);
+    stor = uniauth_connect_lookup_fields(sessid,sesslen,&local,
+        UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID));
     if (stor != NULL) {
         result = IS_VALID_USER_ID(stor->id);
         uniauth_storage_delete(stor);
@@ -781,8 +1264,13 @@ PHP_FUNCTION(uniauth_apply)
     char* sessid = NULL;
     size_t sesslen = 0;
     zval* zv;
+    zval rekeyed;
     char* applicantID;
-    int create;
+    size_t applicantlen;
+    char* seen = NULL;
+    size_t seenSz = 0;
+    int attempt;
+    bool rekey = false;
 
     /* Grab parameters from userspace. */
     if (zend_parse_parameters(ZEND_NUM_ARGS(),"|s",&sessid,&sesslen) == FAILURE) {
@@ -790,6 +1278,7 @@ PHP_FUNCTION(uniauth_apply)
     }
 
     if (sessid == NULL) {
+        rekey = true;
         sessid = get_default_sessid(&sesslen);
 
         if (sessid == NULL) {
@@ -797,23 +1286,6 @@ PHP_FUNCTION(uniauth_apply)
         }
     }
 
-    /* Query the registrar session in case it already exists. We'll create it if
-     * it does not.
-     */
-    stor = uniauth_connect_lookup(sessid,sesslen,&local);
-    create = (stor == NULL);
-    if (create) {
-        stor = &local;
-        memset(stor,0,sizeof(struct uniauth_storage));
-        stor->key = estrndup(sessid,sesslen);
-        stor->keySz = sesslen;
-    }
-    else if (stor->tag != NULL) {
-        efree(stor->tag);
-        stor->tag = NULL;
-        stor->tagSz = 0;
-    }
-
     /* Grab the applicant ID from the _GET superglobal array. Assign it to the
      * 'tag' field. We save this so we can reference the applicant session later
      * on in the flow.
@@ -821,23 +1293,126 @@ PHP_FUNCTION(uniauth_apply)
     zv = GET_GLOBAL("_GET","uniauth");
     applicantID = zv ? Z_STRVAL_P(zv) : NULL;
     if (applicantID == NULL) {
-        if (!create) {
-            uniauth_storage_delete(stor);
-        }
         zend_throw_exception(NULL,"No 'uniauth' query parameter was specified",0);
         return;
     }
-    stor->tag = estrdup(applicantID);
-    stor->tagSz = strlen(applicantID);
+    applicantlen = strlen(applicantID);
+
+    /* With several daemons, the transfer can only link the registrar session
+     * to the applicant session if one daemon keeps both. A default registrar
+     * session (from the uniauth cookie or the PHP session) that is not yet
+     * authenticated is simply replaced by one with an ID that lands on the
+     * applicant's daemon. Otherwise the flow cannot complete, so we fail now
+     * rather than in uniauth_transfer().
+     */
+    ZVAL_UNDEF(&rekeyed);
+    if (sessid != NULL && uniauth_connect_shard_count() > 1
+        && !uniauth_connect_same_shard(sessid,sesslen,applicantID,applicantlen))
+    {
+        bool authenticated = false;
 
-    /* Perform transaction. */
-    if (create) {
-        uniauth_connect_create(stor);
+        stor = uniauth_connect_lookup_fields(sessid,sesslen,&local,
+            UNIAUTH_FIELD_BIT(UNIAUTH_PROTO_FIELD_ID));
+        if (EG(exception) != NULL) {
+            return;
+        }
+        if (stor != NULL) {
+            authenticated = IS_VALID_USER_ID(stor->id);
+            uniauth_storage_delete(stor);
+        }
+
+        if (!rekey || authenticated) {
+            sessid = NULL;
+        }
+        else if (UNIAUTH_G(useCookie)) {
+            if (rekey_registrar_cookie(applicantID,applicantlen,&rekeyed) == SUCCESS) {
+                sessid = Z_STRVAL(rekeyed);
+                sesslen = Z_STRLEN(rekeyed);
+            }
+            else {
+                sessid = NULL;
+            }
+        }
+        else if (rekey_registrar_session(applicantID,applicantlen) == SUCCESS) {
+            sessid = PS(id)->val;
+            sesslen = PS(id)->len;
+        }
+        else {
+            sessid = NULL;
+        }
+
+        if (sessid == NULL) {
+            if (EG(exception) == NULL) {
+                zend_throw_exception(NULL,
+                    "applicant and registrar sessions are kept by different uniauth daemons",0);
+            }
+            zval_ptr_dtor(&rekeyed);
+            return;
+        }
     }
-    else {
-        uniauth_connect_commit(stor);
+
+    /* Write the tag to the registrar session, creating the session if it does
+     * not exist yet. The write only goes through if the session is still the
+     * one we read, so that two applications started at the same time (e.g. in
+     * two tabs) cannot silently replace each other's tag: if another one
+     * claimed the session in the meantime, we fail instead.
+     */
+    stor = uniauth_connect_lookup_fields(sessid,sesslen,&local,APPLY_FIELDS);
+    if (stor != NULL) {
+        seen = uniauth_field_copy(stor->tag);
+        seenSz = stor->tagSz;
+    }
+    attempt = 0;
+    while (EG(exception) == NULL) {
+        attempt += 1;
+        if (stor == NULL) {
+            stor = &local;
+            memset(stor,0,sizeof(struct uniauth_storage));
+            stor->key = uniauth_field_new(sessid,sesslen);
+            stor->keySz = sesslen;
+            stor->tag = uniauth_field_new(applicantID,applicantlen);
+            stor->tagSz = applicantlen;
+            if (uniauth_connect_create(stor) == 0 || EG(exception) != NULL) {
+                break;
+            }
+
+            /* Another request created the session first. */
+            uniauth_storage_delete(stor);
+            stor = uniauth_connect_lookup_fields(sessid,sesslen,&local,APPLY_FIELDS);
+            if (stor == NULL) {
+                break;
+            }
+        }
+        else {
+            uniauth_field_free(stor->tag);
+            stor->tag = uniauth_field_new(applicantID,applicantlen);
+            stor->tagSz = applicantlen;
+            stor->dirty = UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_TAG);
+            if (uniauth_connect_cas(stor) != 1) {
+                break;
+            }
+        }
+
+        /* The session changed since we read it. It is fine if it already
+         * names our applicant.
+         */
+        if (same_field(stor->tag,stor->tagSz,applicantID,applicantlen)) {
+            break;
+        }
+        if (!same_field(stor->tag,stor->tagSz,seen,seenSz)) {
+            zend_throw_exception(NULL,
+                "registrar session was claimed by another application",0);
+        }
+        else if (attempt >= CAS_ATTEMPTS) {
+            zend_throw_exception(NULL,"registrar session kept changing while applying",0);
+        }
+    }
+
+    if (stor != NULL) {
         uniauth_storage_delete(stor);
     }
+    uniauth_field_free(seen);
+    zval_ptr_dtor(&rekeyed);
 }
 /* }}} */
 
@@ -869,6 +1444,7 @@ PHP_FUNCTION(uniauth_purge)
     if (stor != NULL) {
         if (IS_VALID_USER_ID(stor->id)) {
             stor->id = -1;
+            stor->dirty |= UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_ID);
             uniauth_connect_commit(stor);
             result = 1;
         }
@@ -897,32 +1473,9 @@ PHP_FUNCTION(uniauth_cookie)
      */
     result = GET_GLOBAL("_COOKIE","uniauth");
     if (result == NULL) {
-        int i;
-        size_t len;
-        zend_string* encoded;
-        unsigned char buf[UNIAUTH_COOKIE_IDLEN / 4 * 3];
-        char output[UNIAUTH_COOKIE_IDLEN+1];
-
-        i = 0;
-        while (i < sizeof(buf)) {
-            long n;
-            n = php_rand();
-            RAND_RANGE(n,0,0xff,PHP_RAND_MAX);
-            buf[i] = (unsigned char)n;
-            i += 1;
-        }
-
-        memset(output,'0',sizeof(output));
-        encoded = php_base64_encode(buf,sizeof(buf));
-        if (encoded == NULL) {
+        if (generate_cookie_id(&sessid) != SUCCESS) {
             RETURN_FALSE;
         }
-        len = (encoded->len > UNIAUTH_COOKIE_IDLEN ? UNIAUTH_COOKIE_IDLEN : encoded->len);
-        memcpy(output,encoded->val,len);
-        zend_string_release(encoded);
-
-        output[UNIAUTH_COOKIE_IDLEN] = 0;
-        ZVAL_STRING(&sessid,output);
 
         /* Go ahead and set the cookie in the superglobal so it is available for
          * userland. Subsequent calls to the uniauth extension could require the
@@ -943,7 +1496,12 @@ PHP_FUNCTION(uniauth_cookie)
         struct uniauth_storage local;
         struct uniauth_storage* stor;
 
-        stor = uniauth_connect_lookup(Z_STRVAL(sessid),Z_STRLEN(sessid),&local);
+        stor = uniauth_connect_lookup_fields(Z_STRVAL(sessid),Z_STRLEN(sessid),
+            &local,COOKIE_FIELDS);
+        if (EG(exception) != NULL) {
+            zval_ptr_dtor(&sessid);
+            return;
+        }
         if (stor != NULL) {
             if (stor->expire > 0) {
                 /* We touch the cookie if the redirect was set to transfer
@@ -952,8 +1510,10 @@ PHP_FUNCTION(uniauth_cookie)
                  */
                 if (stor->redirect != NULL && strcmp(stor->redirect,"transfer") == 0) {
                     touch = 1;
+                    uniauth_field_free(stor->redirect);
+                    stor->redirect = NULL;
                     stor->redirectSz = 0;
-                    stor->redirect[0] = 0;
+                    stor->dirty |= UNIAUTH_DIRTY(UNIAUTH_PROTO_FIELD_REDIRECT);
                     uniauth_connect_commit(stor);
                 }
                 else {
@@ -970,6 +1530,10 @@ PHP_FUNCTION(uniauth_cookie)
             }
 
             uniauth_storage_delete(stor);
+            if (EG(exception) != NULL) {
+                zval_ptr_dtor(&sessid);
+                return;
+            }
         }
     }
 
@@ -986,3 +1550,128 @@ PHP_FUNCTION(uniauth_cookie)
     RETVAL_ZVAL(&sessid,0,0);
 }
 /* }}} */
+
+/* {{{ proto array uniauth_lookup_many(array keys)
+   Looks up several uniauth sessions at once. The result maps each session ID to
+   its login array or null if the session is not authenticated */
+PHP_FUNCTION(uniauth_lookup_many)
+{
+    zval* keys;
+    zval* entry;
+    zval login;
+    size_t i;
+    size_t count = 0;
+    bool failed;
+    zend_string** ids;
+    const char** keyv;
+    size_t* keylens;
+    struct uniauth_storage* backing;
+    struct uniauth_storage** results;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"a",&keys) == FAILURE) {
+        return;
+    }
+
+    /* Collect the distinct session IDs. The result array is pre-populated with
+     * null so that it preserves the order of the input.
+     */
+    i = zend_hash_num_elements(Z_ARRVAL_P(keys));
+    array_init_size(return_value,i);
+    ids = safe_emalloc(i,sizeof(zend_string*),0);
+    ZEND_HASH_FOREACH_VAL(Z_ARRVAL_P(keys),entry) {
+        zend_string* id = zval_get_string(entry);
+
+        if (ZSTR_LEN(id) == 0 || zend_symtable_exists(Z_ARRVAL_P(return_value),id)) {
+            zend_string_release(id);
+            continue;
+        }
+
+        ZVAL_NULL(&login);
+        zend_symtable_update(Z_ARRVAL_P(return_value),id,&login);
+        ids[count++] = id;
+    } ZEND_HASH_FOREACH_END();
+
+    if (count == 0) {
+        efree(ids);
+        return;
+    }
+
+    keyv = safe_emalloc(count,sizeof(const char*),0);
+    keylens = safe_emalloc(count,sizeof(size_t),0);
+    backing = safe_emalloc(count,sizeof(struct uniauth_storage),0);
+    results = ecalloc(count,sizeof(struct uniauth_storage*));
+    for (i = 0;i < count;++i) {
+        keyv[i] = ZSTR_VAL(ids[i]);
+        keylens[i] = ZSTR_LEN(ids[i]);
+    }
+
+    /* A failure may leave some of the records already resolved; these are
+     * freed without being reported.
+     */
+    failed = (uniauth_connect_lookup_many(count,keyv,keylens,backing,results) != 0);
+    for (i = 0;i < count;++i) {
+        struct uniauth_storage* stor = results[i];
+
+        if (stor == NULL) {
+            continue;
+        }
+        if (!failed && IS_VALID_USER_ID(stor->id)) {
+            set_login_array(&login,stor);
+            zend_symtable_update(Z_ARRVAL_P(return_value),ids[i],&login);
+        }
+        uniauth_storage_delete(stor);
+    }
+
+    for (i = 0;i < count;++i) {
+        zend_string_release(ids[i]);
+    }
+    efree(ids);
+    efree(keyv);
+    efree(keylens);
+    efree(backing);
+    efree(results);
+}
+/* }}} */
+
+/* {{{ proto void uniauth_set_wait_handler(?callable handler)
+   Registers a function that suspends the current fiber until the uniauth daemon
+   socket is ready, enabling non-blocking daemon I/O inside fibers */
+PHP_FUNCTION(uniauth_set_wait_handler)
+{
+    zval* handler;
+
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"z!",&handler) == FAILURE) {
+        return;
+    }
+
+    if (handler != NULL && !zend_is_callable(handler,0,NULL)) {
+        zend_throw_exception(NULL,"Wait handler must be callable",0);
+        return;
+    }
+
+    if (!Z_ISUNDEF(UNIAUTH_G(waitHandler))) {
+        zval_ptr_dtor(&UNIAUTH_G(waitHandler));
+        ZVAL_UNDEF(&UNIAUTH_G(waitHandler));
+    }
+    if (handler != NULL) {
+        ZVAL_COPY(&UNIAUTH_G(waitHandler),handler);
+    }
+}
+/* }}} */
+
+/* {{{ proto array uniauth_stats()
+   Returns counters describing how the extension talked to the uniauth daemon
+   during the current request */
+PHP_FUNCTION(uniauth_stats)
+{
+    if (zend_parse_parameters(ZEND_NUM_ARGS(),"") == FAILURE) {
+        return;
+    }
+
+    array_init(return_value);
+    add_assoc_long(return_value,"cache_hits",UNIAUTH_G(cacheHits));
+    add_assoc_long(return_value,"cache_misses",UNIAUTH_G(cacheMisses));
+    add_assoc_long(return_value,"shm_hits",UNIAUTH_G(shmHits));
+    add_assoc_long(return_value,"shm_misses",UNIAUTH_G(shmMisses));
+}
+/* }}} */
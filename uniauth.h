@@ -27,6 +27,8 @@
 #ifdef ZTS
 #include <TSRM.h>
 #endif
+#include "digest.h"
+#include "ring.h"
 
 /* Definitions */
 
@@ -39,15 +41,97 @@
 #define UNIAUTH_COOKIE_IDLEN 64
 
 #define UNIAUTH_LIFETIME_INI "uniauth.lifetime"
+#define UNIAUTH_SHM_CACHE_INI "uniauth.shm_cache"
+#define UNIAUTH_SHM_CACHE_SIZE_INI "uniauth.shm_cache_size"
+#define UNIAUTH_SHM_CACHE_TTL_INI "uniauth.shm_cache_ttl"
+#define UNIAUTH_PREFETCH_INI "uniauth.prefetch"
+#define UNIAUTH_SOCKET_PATH_INI "uniauth.socket_path"
+#define UNIAUTH_RECONNECT_BACKOFF_INI "uniauth.reconnect_backoff_ms"
+#define UNIAUTH_TIMEOUT_INI "uniauth.timeout_ms"
+#define UNIAUTH_REQUEST_BUDGET_INI "uniauth.request_budget_ms"
+#define UNIAUTH_PROTOCOL_INI "uniauth.protocol"
+#define UNIAUTH_KEY_DIGEST_INI "uniauth.key_digest"
+#define UNIAUTH_SHM_RING_INI "uniauth.shm_ring"
+#define UNIAUTH_EMBEDDED_PATH_INI "uniauth.embedded_path"
+#define UNIAUTH_EMBEDDED_SIZE_INI "uniauth.embedded_size"
+#define UNIAUTH_SHARED_CONNS_INI "uniauth.shared_conns"
 
 /* Uniauth module globals */
 
+struct uniauth_spare_conn;
+struct uniauth_shard_conn;
+
 ZEND_BEGIN_MODULE_GLOBALS(uniauth)
   int conn;
+  int connVersion;
+  int connFeatures;
+  zend_bool connPacket;
+  struct uniauth_ring* connRing;
+  int connTimeout;
+  zend_bool connBusy;
   unsigned long useCookie;
+
+  /* INI settings cached by their update handlers. */
+  zend_long lifetime;
+  char* socketPath;
+  zend_long reconnectBackoff;
+  zend_long timeout;
+  zend_long requestBudget;
+  zend_long protocol;
+  zend_bool prefetch;
+  zend_bool shmRing;
+
+  /* Set when the daemon dropped a connection on which we offered a newer
+   * protocol version; later connections do not offer it again.
+   */
+  zend_bool protocolFallback;
+
+  /* Secret for the digests sent in place of session keys (if enabled). The
+   * digest of the last key is kept for the rest of the request.
+   */
+  zend_bool keyDigest;
+  unsigned char keyDigestSecret[UNIAUTH_DIGEST_SECRET_SZ];
+  char* digestKey;
+  size_t digestKeySz;
+  unsigned char digest[UNIAUTH_KEY_DIGEST_SZ];
+
+  /* Monotonic time (in milliseconds) at which the request started. */
+  uint64_t requestStart;
+
+  /* Shard that 'conn' goes to and the per-shard connection state (reconnect
+   * backoff, transport fallback and idle connections to the other shards).
+   */
+  size_t connShard;
+  struct uniauth_shard_conn* shardConns;
+
+  /* Key of a LOOKUP sent at request startup whose reply is still pending on
+   * 'conn'.
+   */
+  char* prefetchKey;
+  size_t prefetchKeySz;
+  uint64_t prefetchGeneration;
+
+  /* Extra connections used while 'conn' is owned by a suspended fiber. */
+  struct uniauth_spare_conn* spares;
+  size_t spareCount;
+
+  /* Userspace callable that suspends the current fiber until the daemon
+   * socket is ready.
+   */
+  zval waitHandler;
+
+  /* Request-scoped cache of decoded records keyed by session ID. */
+  HashTable* records;
+  unsigned long cacheHits;
+  unsigned long cacheMisses;
+  unsigned long shmHits;
+  unsigned long shmMisses;
 ZEND_END_MODULE_GLOBALS(uniauth)
 extern ZEND_DECLARE_MODULE_GLOBALS(uniauth);
 
+/* Class of the exception thrown when the daemon does not answer in time. */
+extern zend_class_entry* uniauth_timeout_exception_ce;
+
 #ifdef ZTS
 #include "TSRM.h"
 #define UNIAUTH_G(v)                                    \
@@ -62,6 +146,7 @@ extern ZEND_DECLARE_MODULE_GLOBALS(uniauth);
  */
 void uniauth_globals_init();
 void uniauth_globals_request_init();
+void uniauth_globals_request_shutdown();
 void uniauth_globals_shutdown();
 
 #endif